@@ -0,0 +1,305 @@
+// native ELF dependency scanner
+#include "elf_scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// ELF constants, defined here so the scanner does not depend on the
+// target's <elf.h>
+#define ELF_CLASS32 1
+#define ELF_CLASS64 2
+#define ELF_DATA_MSB 2
+#define ELF_PT_LOAD 1
+#define ELF_PT_DYNAMIC 2
+#define ELF_SHT_DYNAMIC 6
+#define ELF_DT_NULL 0
+#define ELF_DT_NEEDED 1
+#define ELF_DT_STRTAB 5
+#define ELF_DT_STRSZ 10
+#define ELF_DT_RPATH 15
+#define ELF_DT_RUNPATH 29
+#define ELF_MAX_NEEDED 1024
+
+// A mapped ELF file. Reads past the end return 0 and set bad.
+typedef struct {
+    const uint8_t* buf;
+    size_t size;
+    int is64;
+    int msb;
+    int bad;
+} ElfFile;
+
+// Read an unsigned field of 2, 4 or 8 bytes in the file's byte order
+static uint64_t elf_get(ElfFile* f, uint64_t off, int bytes) {
+    if (off > f->size || f->size - off < (uint64_t)bytes) {
+        f->bad = 1;
+        return 0;
+    }
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) {
+        int shift = f->msb ? (bytes - 1 - i) * 8 : i * 8;
+        v |= (uint64_t)f->buf[off + i] << shift;
+    }
+    return v;
+}
+
+// Read an address-sized field (4 bytes in ELF32, 8 in ELF64)
+static uint64_t elf_addr(ElfFile* f, uint64_t off) {
+    return elf_get(f, off, f->is64 ? 8 : 4);
+}
+
+// Translate a virtual address to a file offset through the PT_LOAD
+// segments. Returns 0 if no segment contains it.
+static uint64_t elf_vaddr_to_offset(ElfFile* f, uint64_t vaddr) {
+    uint64_t phoff = elf_addr(f, f->is64 ? 32 : 28);
+    uint64_t phentsize = elf_get(f, f->is64 ? 54 : 42, 2);
+    uint64_t phnum = elf_get(f, f->is64 ? 56 : 44, 2);
+    for (uint64_t i = 0; i < phnum && !f->bad; i++) {
+        uint64_t ph = phoff + i * phentsize;
+        if (elf_get(f, ph, 4) != ELF_PT_LOAD) continue;
+        uint64_t offset = elf_addr(f, ph + (f->is64 ? 8 : 4));
+        uint64_t seg_vaddr = elf_addr(f, ph + (f->is64 ? 16 : 8));
+        uint64_t filesz = elf_addr(f, ph + (f->is64 ? 32 : 16));
+        if (vaddr >= seg_vaddr && vaddr - seg_vaddr < filesz) {
+            return offset + (vaddr - seg_vaddr);
+        }
+    }
+    return 0;
+}
+
+// Locate the dynamic section, from the program headers or, for files
+// without them, the section headers. *strtab is set when the section
+// headers name the string table directly.
+static int elf_find_dynamic(ElfFile* f, uint64_t* dyn_off, uint64_t* dyn_size, uint64_t* strtab) {
+    *strtab = 0;
+    uint64_t phoff = elf_addr(f, f->is64 ? 32 : 28);
+    uint64_t phentsize = elf_get(f, f->is64 ? 54 : 42, 2);
+    uint64_t phnum = elf_get(f, f->is64 ? 56 : 44, 2);
+    for (uint64_t i = 0; i < phnum && !f->bad; i++) {
+        uint64_t ph = phoff + i * phentsize;
+        if (elf_get(f, ph, 4) == ELF_PT_DYNAMIC) {
+            *dyn_off = elf_addr(f, ph + (f->is64 ? 8 : 4));
+            *dyn_size = elf_addr(f, ph + (f->is64 ? 32 : 16));
+            return f->bad ? -1 : 0;
+        }
+    }
+
+    uint64_t shoff = elf_addr(f, f->is64 ? 40 : 32);
+    uint64_t shentsize = elf_get(f, f->is64 ? 58 : 46, 2);
+    uint64_t shnum = elf_get(f, f->is64 ? 60 : 48, 2);
+    for (uint64_t i = 0; i < shnum && !f->bad; i++) {
+        uint64_t sh = shoff + i * shentsize;
+        if (elf_get(f, sh + 4, 4) != ELF_SHT_DYNAMIC) continue;
+        *dyn_off = elf_addr(f, sh + (f->is64 ? 24 : 16));
+        *dyn_size = elf_addr(f, sh + (f->is64 ? 32 : 20));
+        uint64_t link = elf_get(f, sh + (f->is64 ? 40 : 24), 4);
+        *strtab = elf_addr(f, shoff + link * shentsize + (f->is64 ? 24 : 16));
+        return f->bad ? -1 : 0;
+    }
+    return -1;
+}
+
+// String at offset str of the dynamic string table, or NULL if it runs
+// out of the table or the file
+static const char* elf_dynstr(ElfFile* f, uint64_t strtab, uint64_t strsz, uint64_t str) {
+    if (str >= strsz || strtab > f->size || str >= f->size - strtab) return NULL;
+    const char* s = (const char*)f->buf + strtab + str;
+    uint64_t max = f->size - strtab - str;
+    if (strsz - str < max) max = strsz - str;
+    return memchr(s, '\0', max) ? s : NULL;
+}
+
+static ElfDynamicInfo* elf_parse_dynamic(ElfFile* f) {
+    uint64_t dyn_off = 0, dyn_size = 0, strtab = 0;
+    if (elf_find_dynamic(f, &dyn_off, &dyn_size, &strtab) != 0) {
+        return NULL; // Statically linked or not an executable format we know
+    }
+
+    // Collect the entries we care about
+    uint64_t entsize = f->is64 ? 16 : 8;
+    uint64_t strtab_vaddr = 0, strsz = 0, rpath = UINT64_MAX, runpath = UINT64_MAX;
+    uint64_t needed[ELF_MAX_NEEDED];
+    int needed_count = 0;
+    for (uint64_t off = dyn_off; off + entsize <= dyn_off + dyn_size; off += entsize) {
+        uint64_t tag = elf_addr(f, off);
+        uint64_t val = elf_addr(f, off + entsize / 2);
+        if (f->bad || tag == ELF_DT_NULL) break;
+        switch (tag) {
+        case ELF_DT_NEEDED:
+            if (needed_count < ELF_MAX_NEEDED) needed[needed_count++] = val;
+            break;
+        case ELF_DT_STRTAB: strtab_vaddr = val; break;
+        case ELF_DT_STRSZ: strsz = val; break;
+        case ELF_DT_RPATH: rpath = val; break;
+        case ELF_DT_RUNPATH: runpath = val; break;
+        }
+    }
+    if (strtab == 0 && strtab_vaddr != 0) {
+        strtab = elf_vaddr_to_offset(f, strtab_vaddr);
+    }
+    if (f->bad || strtab == 0) {
+        return NULL;
+    }
+    if (strsz == 0 || strsz > f->size - strtab) {
+        strsz = f->size - strtab;
+    }
+
+    // Copy the strings into one block along with the struct
+    const char* names[ELF_MAX_NEEDED];
+    size_t bytes = sizeof(ElfDynamicInfo) + (needed_count + 1) * sizeof(char*);
+    int count = 0;
+    for (int i = 0; i < needed_count; i++) {
+        names[count] = elf_dynstr(f, strtab, strsz, needed[i]);
+        if (names[count]) bytes += strlen(names[count++]) + 1;
+    }
+    const char* rpath_str = rpath != UINT64_MAX ? elf_dynstr(f, strtab, strsz, rpath) : NULL;
+    const char* runpath_str = runpath != UINT64_MAX ? elf_dynstr(f, strtab, strsz, runpath) : NULL;
+    if (rpath_str) bytes += strlen(rpath_str) + 1;
+    if (runpath_str) bytes += strlen(runpath_str) + 1;
+
+    ElfDynamicInfo* info = malloc(bytes);
+    if (!info) {
+        fprintf(stderr, "Memory allocation failed for ELF dynamic info\n");
+        return NULL;
+    }
+    info->needed = (char**)(info + 1);
+    info->needed_count = count;
+    char* p = (char*)(info->needed + count + 1);
+    for (int i = 0; i < count; i++) {
+        info->needed[i] = strcpy(p, names[i]);
+        p += strlen(p) + 1;
+    }
+    info->needed[count] = NULL;
+    info->rpath = rpath_str ? strcpy(p, rpath_str) : NULL;
+    if (rpath_str) p += strlen(p) + 1;
+    info->runpath = runpath_str ? strcpy(p, runpath_str) : NULL;
+    return info;
+}
+
+// Read the dynamic section of an ELF file
+ElfDynamicInfo* elf_read_dynamic(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 52) {
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    ElfFile f = { map, (size_t)st.st_size, 0, 0, 0 };
+    ElfDynamicInfo* info = NULL;
+    if (memcmp(f.buf, "\177ELF", 4) == 0 &&
+        (f.buf[4] == ELF_CLASS32 || f.buf[4] == ELF_CLASS64)) {
+        f.is64 = f.buf[4] == ELF_CLASS64;
+        f.msb = f.buf[5] == ELF_DATA_MSB;
+        info = elf_parse_dynamic(&f);
+    }
+    munmap(map, (size_t)st.st_size);
+    return info;
+}
+
+// Look for name in each directory of a search list. Entries are split at
+// any of the characters in seps; $ORIGIN expands to origin.
+static char* elf_search(const char* list, const char* seps, const char* origin, const char* name) {
+    if (!list) return NULL;
+    const char* p = list;
+    while (*p) {
+        size_t len = strcspn(p, seps);
+        char dir[PATH_MAX];
+        int n = -1;
+        if (len >= 7 && strncmp(p, "$ORIGIN", 7) == 0) {
+            n = snprintf(dir, sizeof(dir), "%s%.*s", origin, (int)(len - 7), p + 7);
+        } else if (len >= 9 && strncmp(p, "${ORIGIN}", 9) == 0) {
+            n = snprintf(dir, sizeof(dir), "%s%.*s", origin, (int)(len - 9), p + 9);
+        } else if (len > 0) {
+            n = snprintf(dir, sizeof(dir), "%.*s", (int)len, p);
+        }
+
+        char candidate[PATH_MAX];
+        struct stat st;
+        if (n > 0 && n < (int)sizeof(dir) &&
+            snprintf(candidate, sizeof(candidate), "%s/%s", dir, name) < (int)sizeof(candidate) &&
+            stat(candidate, &st) == 0 && S_ISREG(st.st_mode)) {
+            return strdup(candidate);
+        }
+        p += len;
+        if (*p) p++;
+    }
+    return NULL;
+}
+
+// Resolve a DT_NEEDED name to a library path
+char* elf_resolve_needed(const char* path, const ElfDynamicInfo* info, const char* name,
+                         const char* extra_lib_paths) {
+    if (strchr(name, '/')) {
+        struct stat st;
+        return (name[0] == '/' && stat(name, &st) == 0) ? strdup(name) : NULL;
+    }
+
+    char origin[PATH_MAX];
+    const char* slash = strrchr(path, '/');
+    if (slash) {
+        snprintf(origin, sizeof(origin), "%.*s", (int)(slash - path), path);
+    } else {
+        snprintf(origin, sizeof(origin), ".");
+    }
+
+    char* found = NULL;
+    if (!info->runpath) found = elf_search(info->rpath, ":", origin, name);
+    if (!found) found = elf_search(getenv("LD_LIBRARY_PATH"), ":", origin, name);
+    if (!found) found = elf_search(info->runpath, ":", origin, name);
+    if (!found) found = elf_search(extra_lib_paths, ",", origin, name);
+    return found;
+}
+
+// Scan an ELF file and resolve its direct dependencies
+int elf_scan_dependencies(const char* path, const char* extra_lib_paths, char*** libs_out) {
+    *libs_out = NULL;
+    ElfDynamicInfo* info = elf_read_dynamic(path);
+    if (!info) {
+        return -1;
+    }
+
+    char** libs = malloc((info->needed_count + 1) * sizeof(char*));
+    if (!libs) {
+        fprintf(stderr, "Memory allocation failed during dependency scan\n");
+        free(info);
+        return -1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < info->needed_count; i++) {
+        char* lib = elf_resolve_needed(path, info, info->needed[i], extra_lib_paths);
+        if (!lib) {
+            printf("  Could not resolve %s needed by %s\n", info->needed[i], path);
+            continue;
+        }
+        int duplicate = 0;
+        for (int j = 0; j < count && !duplicate; j++) {
+            duplicate = strcmp(libs[j], lib) == 0;
+        }
+        if (duplicate) {
+            free(lib);
+        } else {
+            libs[count++] = lib;
+        }
+    }
+    libs[count] = NULL;
+    free(info);
+
+    *libs_out = libs;
+    return count;
+}
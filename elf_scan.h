@@ -0,0 +1,34 @@
+/*
+ * elf_scan.h - Native ELF dependency scanner
+ */
+#ifndef ELF_SCAN_H
+#define ELF_SCAN_H
+
+// Dynamic section contents of an ELF file that matter for dependency
+// resolution. Strings point into the same malloc'd block as the struct.
+typedef struct {
+    char** needed;      // DT_NEEDED entries, NULL-terminated
+    int needed_count;
+    const char* rpath;    // DT_RPATH, NULL if absent
+    const char* runpath;  // DT_RUNPATH, NULL if absent
+} ElfDynamicInfo;
+
+// Read the dynamic section of an ELF32/ELF64 file of either byte order.
+// Returns NULL if the file is not ELF or has no dynamic section; free the
+// result with free().
+ElfDynamicInfo* elf_read_dynamic(const char* path);
+
+// Resolve a DT_NEEDED name the way the runtime linker does: DT_RPATH
+// (when there is no DT_RUNPATH), LD_LIBRARY_PATH, DT_RUNPATH, then the
+// comma-separated extra_lib_paths. $ORIGIN is expanded to the directory
+// of path. Returns a malloc'd absolute path or NULL if not found.
+char* elf_resolve_needed(const char* path, const ElfDynamicInfo* info, const char* name,
+                         const char* extra_lib_paths);
+
+// Scan an ELF file and resolve its direct dependencies. On success
+// *libs_out holds a NULL-terminated array of malloc'd library paths and
+// the number of resolved libraries is returned; -1 if the file is not a
+// dynamically linked ELF file.
+int elf_scan_dependencies(const char* path, const char* extra_lib_paths, char*** libs_out);
+
+#endif
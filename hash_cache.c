@@ -0,0 +1,236 @@
+// contents digests of store files, keyed by stat fingerprint
+#include "hash_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "nix_store.h"
+
+#define HASH_CACHE_PATH NIX_STORE_PATH "/.nix-db/hashcache"
+#define HASH_CACHE_MAGIC "QNIXHC\n"  // 8 bytes including the terminating NUL
+#define HASH_CACHE_VERSION 1
+
+// The header is followed by HashCacheEntry records up to the end of the
+// file. New digests are appended; a later entry for an inode replaces an
+// earlier one, and hash_cache_save() rewrites the file without them.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} HashCacheHeader;
+
+// Nanoseconds where struct stat has timespec fields (st_mtime is then a
+// macro for st_mtim.tv_sec); whole seconds elsewhere
+#if defined(st_mtime)
+#define STAT_MTIME_NSEC(st) ((uint32_t)(st)->st_mtim.tv_nsec)
+#define STAT_CTIME_NSEC(st) ((uint32_t)(st)->st_ctim.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(st) 0u
+#define STAT_CTIME_NSEC(st) 0u
+#endif
+
+static void fingerprint(HashCacheEntry* e, const struct stat* st) {
+    e->dev = (uint64_t)st->st_dev;
+    e->ino = (uint64_t)st->st_ino;
+    e->size = (uint64_t)st->st_size;
+    e->mtime_sec = (int64_t)st->st_mtime;
+    e->ctime_sec = (int64_t)st->st_ctime;
+    e->mtime_nsec = STAT_MTIME_NSEC(st);
+    e->ctime_nsec = STAT_CTIME_NSEC(st);
+}
+
+static int same_fingerprint(const HashCacheEntry* a, const HashCacheEntry* b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+           a->ctime_sec == b->ctime_sec && a->ctime_nsec == b->ctime_nsec;
+}
+
+static size_t slot_of(const HashCache* cache, uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ (dev * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    return (size_t)(h ^ (h >> 32)) & (cache->slot_capacity - 1);
+}
+
+// Slot holding (dev, ino), or the empty slot where it would go
+static uint32_t* find_slot(const HashCache* cache, uint64_t dev, uint64_t ino) {
+    size_t mask = cache->slot_capacity - 1;
+    for (size_t i = slot_of(cache, dev, ino);; i = (i + 1) & mask) {
+        uint32_t* slot = &cache->slots[i];
+        if (!*slot) return slot;
+        const HashCacheEntry* e = &cache->entries[*slot - 1];
+        if (e->dev == dev && e->ino == ino) return slot;
+    }
+}
+
+static int grow(HashCache* cache) {
+    if (cache->count == cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 256;
+        HashCacheEntry* entries = realloc(cache->entries, capacity * sizeof(HashCacheEntry));
+        if (!entries) return -1;
+        cache->entries = entries;
+        uint8_t* used = realloc(cache->used, capacity);
+        if (!used) return -1;
+        cache->used = used;
+        cache->capacity = capacity;
+    }
+    if ((cache->count + 1) * 2 > cache->slot_capacity) {
+        size_t slot_capacity = cache->slot_capacity ? cache->slot_capacity * 2 : 512;
+        uint32_t* slots = calloc(slot_capacity, sizeof(uint32_t));
+        if (!slots) return -1;
+        free(cache->slots);
+        cache->slots = slots;
+        cache->slot_capacity = slot_capacity;
+        for (size_t i = 0; i < cache->count; i++) {
+            *find_slot(cache, cache->entries[i].dev, cache->entries[i].ino) = (uint32_t)i + 1;
+        }
+    }
+    return 0;
+}
+
+// Add or replace the entry of e's inode
+static int cache_put(HashCache* cache, const HashCacheEntry* e, int used) {
+    if (grow(cache) != 0) return -1;
+    uint32_t* slot = find_slot(cache, e->dev, e->ino);
+    if (!*slot) {
+        *slot = (uint32_t)++cache->count;
+    } else if (same_fingerprint(&cache->entries[*slot - 1], e) &&
+               memcmp(cache->entries[*slot - 1].digest, e->digest, SHA256_BLOCK_SIZE) == 0) {
+        cache->used[*slot - 1] |= used;
+        return 0;
+    }
+    cache->entries[*slot - 1] = *e;
+    cache->used[*slot - 1] = used;
+    cache->dirty = 1;
+    return 0;
+}
+
+void hash_cache_load(HashCache* cache) {
+    memset(cache, 0, sizeof(*cache));
+    int fd = open(HASH_CACHE_PATH, O_RDONLY);
+    if (fd < 0) return;
+
+    HashCacheHeader hdr;
+    if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, HASH_CACHE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != HASH_CACHE_VERSION) {
+        close(fd);
+        return;
+    }
+    HashCacheEntry e;
+    size_t records = 0;
+    while (read(fd, &e, sizeof(e)) == (ssize_t)sizeof(e)) {
+        if (cache_put(cache, &e, 0) != 0) break;
+        records++;
+    }
+    close(fd);
+    // Rewrite on the next save if appends left superseded entries behind
+    cache->dirty = records != cache->count;
+}
+
+static void init_header(HashCacheHeader* hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, HASH_CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->version = HASH_CACHE_VERSION;
+}
+
+int hash_cache_append(const HashCachePending* pending) {
+    if (pending->count == 0) return 0;
+    int fd = open(HASH_CACHE_PATH, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    int ret = fstat(fd, &st) == 0 ? 0 : -1;
+    if (ret == 0 && st.st_size == 0) {
+        HashCacheHeader hdr;
+        init_header(&hdr);
+        ret = write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) ? 0 : -1;
+    }
+    size_t len = pending->count * sizeof(HashCacheEntry);
+    if (ret == 0 && write(fd, pending->entries, len) != (ssize_t)len) ret = -1;
+    close(fd);
+    return ret;
+}
+
+void hash_cache_free(HashCache* cache) {
+    free(cache->entries);
+    free(cache->used);
+    free(cache->slots);
+    memset(cache, 0, sizeof(*cache));
+}
+
+int hash_cache_save(HashCache* cache, int prune) {
+    size_t kept = 0;
+    for (size_t i = 0; i < cache->count; i++) {
+        if (!prune || cache->used[i]) kept++;
+    }
+    if (!cache->dirty && kept == cache->count) return 0;
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, PATH_MAX, "%s.%ld.tmp", HASH_CACHE_PATH, (long)getpid());
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f) {
+        fprintf(stderr, "Warning: Failed to write %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    HashCacheHeader hdr;
+    init_header(&hdr);
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    for (size_t i = 0; ok && i < cache->count; i++) {
+        if (prune && !cache->used[i]) continue;
+        ok = fwrite(&cache->entries[i], sizeof(HashCacheEntry), 1, f) == 1;
+    }
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp_path, HASH_CACHE_PATH) != 0) {
+        fprintf(stderr, "Warning: Failed to write %s\n", HASH_CACHE_PATH);
+        unlink(tmp_path);
+        return -1;
+    }
+    cache->dirty = 0;
+    return 0;
+}
+
+int hash_cache_lookup(const char* path, const struct stat* st, uint8_t digest[SHA256_BLOCK_SIZE], void* arg) {
+    (void)path;
+    HashCacheLookup* lookup = arg;
+    HashCache* cache = lookup->cache;
+    if (!cache || cache->count == 0) return -1;
+
+    HashCacheEntry want;
+    fingerprint(&want, st);
+    uint32_t* slot = find_slot(cache, want.dev, want.ino);
+    if (!*slot || !same_fingerprint(&cache->entries[*slot - 1], &want)) return -1;
+    memcpy(digest, cache->entries[*slot - 1].digest, SHA256_BLOCK_SIZE);
+    // Only ever set to 1, so concurrent lookups agree on the value
+    cache->used[*slot - 1] = 1;
+    lookup->hits++;
+    return 0;
+}
+
+void hash_cache_record(const char* path, const struct stat* st, const uint8_t digest[SHA256_BLOCK_SIZE], void* arg) {
+    (void)path;
+    HashCachePending* pending = arg;
+    if (pending->count == pending->capacity) {
+        size_t capacity = pending->capacity ? pending->capacity * 2 : 64;
+        HashCacheEntry* entries = realloc(pending->entries, capacity * sizeof(HashCacheEntry));
+        if (!entries) return;  // Only costs a re-hash next time
+        pending->entries = entries;
+        pending->capacity = capacity;
+    }
+    HashCacheEntry* e = &pending->entries[pending->count++];
+    fingerprint(e, st);
+    memcpy(e->digest, digest, SHA256_BLOCK_SIZE);
+}
+
+void hash_cache_commit(HashCache* cache, HashCachePending* pending) {
+    for (size_t i = 0; i < pending->count; i++) {
+        if (cache_put(cache, &pending->entries[i], 1) != 0) break;
+    }
+    pending->count = 0;
+}
+
+void hash_cache_pending_free(HashCachePending* pending) {
+    free(pending->entries);
+    memset(pending, 0, sizeof(*pending));
+}
@@ -0,0 +1,74 @@
+/*
+ * hash_cache.h - Contents digests of store files, keyed by stat fingerprint
+ */
+#ifndef HASH_CACHE_H
+#define HASH_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "sha256.h"
+
+// A file's digest is reused while its fingerprint (device, inode, size,
+// mtime and ctime) is unchanged. Store files are read-only, and any
+// change to a file, its mode or its links moves its ctime.
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint8_t digest[SHA256_BLOCK_SIZE];
+} HashCacheEntry;
+
+typedef struct {
+    HashCacheEntry* entries;
+    uint8_t* used;        // Per entry: looked up or recorded in this run
+    size_t count;
+    size_t capacity;
+    uint32_t* slots;      // Open addressing on (dev, ino): entry index + 1
+    size_t slot_capacity;  // Power of two
+    int dirty;
+} HashCache;
+
+// Digests recorded while hashing one store path, added to the cache only
+// once the path's hash has been checked
+typedef struct {
+    HashCacheEntry* entries;
+    size_t count;
+    size_t capacity;
+} HashCachePending;
+
+// Load .nix-db/hashcache; a missing or unreadable file gives an empty cache
+void hash_cache_load(HashCache* cache);
+void hash_cache_free(HashCache* cache);
+
+// Write the cache back if it changed. With prune, entries not used in
+// this run are dropped (after a walk over the whole store).
+int hash_cache_save(HashCache* cache, int prune);
+
+// Lookup state of one caller: the cache and how many digests it supplied
+typedef struct {
+    HashCache* cache;
+    size_t hits;
+} HashCacheLookup;
+
+// NarDigestLookup over a HashCacheLookup (arg). Safe to call from several
+// threads, each with its own HashCacheLookup, while nothing is added to
+// the cache.
+int hash_cache_lookup(const char* path, const struct stat* st, uint8_t digest[SHA256_BLOCK_SIZE], void* arg);
+
+// NarDigestRecord into a HashCachePending (arg)
+void hash_cache_record(const char* path, const struct stat* st, const uint8_t digest[SHA256_BLOCK_SIZE], void* arg);
+
+// Move pending digests into the cache
+void hash_cache_commit(HashCache* cache, HashCachePending* pending);
+
+// Add pending digests to the cache file without loading it (new paths)
+int hash_cache_append(const HashCachePending* pending);
+
+void hash_cache_pending_free(HashCachePending* pending);
+
+#endif
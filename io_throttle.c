@@ -0,0 +1,42 @@
+// pacing verification reads to a byte-rate budget
+#include "io_throttle.h"
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+static uint64_t throttle_rate;
+static uint64_t throttle_clock;  // Monotonic ns when the bytes charged so far are paid for
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void io_throttle_set(uint64_t bytes_per_sec) {
+    throttle_rate = bytes_per_sec;
+    throttle_clock = 0;
+}
+
+void io_throttle_charge(uint64_t bytes) {
+    if (!throttle_rate || !bytes) return;
+
+    pthread_mutex_lock(&throttle_lock);
+    uint64_t now = now_ns();
+    if (throttle_clock < now) throttle_clock = now;
+    throttle_clock += bytes * 1000000000ull / throttle_rate;
+    uint64_t wait = throttle_clock - now;
+    pthread_mutex_unlock(&throttle_lock);
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)(wait / 1000000000ull);
+    ts.tv_nsec = (long)(wait % 1000000000ull);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+void io_throttle_read(size_t bytes, void* arg) {
+    (void)arg;
+    io_throttle_charge(bytes);
+}
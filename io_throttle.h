@@ -0,0 +1,22 @@
+/*
+ * io_throttle.h - Pacing verification reads to a byte-rate budget
+ */
+#ifndef IO_THROTTLE_H
+#define IO_THROTTLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Budget for the file reads of verification, shared by all threads (bytes
+// per second, 0: unlimited). Set it before any worker thread starts.
+void io_throttle_set(uint64_t bytes_per_sec);
+
+// Account for bytes just read, sleeping as long as the budget needs.
+// Time spent idle is not saved up, so reads never burst above the rate.
+void io_throttle_charge(uint64_t bytes);
+
+// NarReadHook charging each piece read (at most 64 KiB), so verification
+// passes it to the hashing reads
+void io_throttle_read(size_t bytes, void* arg);
+
+#endif
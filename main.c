@@ -2,9 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include "nix_store.h"
 #include "nix_store_db.h"
 #include "qnix_config.h"
+#include "store_copy.h"
+#include "store_optimise.h"
+#include "io_throttle.h"
 
 // show help text
 void print_usage(void) {
@@ -16,11 +21,24 @@ void print_usage(void) {
     printf("  nix-store --add-with-deps <path> <name>   Add file/dir with auto-detected store dependencies\n");
     printf("  nix-store --add-with-explicit-deps <path> <name> <dep1> <dep2>...  Add file/dir with specified store dependencies\n");
     printf("  nix-store --add-boot-libs-bins                 Add all libraries from /proc/boot to store\n");
+    printf("    (--add, --add-recursively and --add-with-deps take [--ingest-mode copy|reflink|hardlink])\n");
     printf("  nix-store --install <store_path> [<profile>] Install package from store into profile (default: 'default')\n");
     printf("                                              Creates wrappers and symlinks for the package\n");
-    printf("  nix-store --verify <store_path>           Verify a store path\n");
+    printf("  nix-store --verify <store_path> [--deep] [--fail-fast] [--jobs N] [--repair [--from <dir>]]\n");
+    printf("                                            Verify a store path file by file and list damaged files\n");
+    printf("                                              (--deep: re-read every file, --repair: restore them)\n");
+    printf("  nix-store --dump <store_path> <file>      Write the canonical serialization of a store path to a file\n");
+    printf("  nix-store --verify-all [--jobs N] [--deep] Verify every registered path (N parallel jobs, default one per CPU)\n");
+    printf("    (--verify and --verify-all take [--io-limit MiB/s] [--low-priority] to run in the background;\n");
+    printf("     --verify-all --resume continues an interrupted run from its checkpoint)\n");
+    printf("  nix-store --verify-all --sample P [--sample-paths] [--seed S]\n");
+    printf("                                            Verify a random P%% of the files of each path (or of the paths)\n");
+    printf("                                              and report how far the result can be trusted\n");
     printf("  nix-store --gc                            Run garbage collection (removes paths not reachable from roots/profiles)\n");
+    printf("  nix-store --optimise                      Replace identical files in the store with hardlinks\n");
     printf("  nix-store --query-references <store_path> Show references (dependencies) of a store path\n");
+    printf("  nix-store --query-referrers <store_path>  Show store paths that reference a store path\n");
+    printf("  nix-store --query-referrers-closure <store_path> Show all store paths that depend on a store path, directly or indirectly\n");
     printf("  nix-store --add-root <store_path>         Register a store path as a GC root (prevents GC)\n");
     printf("  nix-store --remove-root <store_path>      Unregister a store path as a GC root (allows GC)\n");
     printf("  nix-store --create-profile <name>         Create a new profile\n");
@@ -31,6 +49,48 @@ void print_usage(void) {
     printf("  nix-store --switch-generation <profile> <timestamp> Switch to specific generation\n");
 }
 
+// apply --ingest-mode <mode> given after the add arguments
+static int apply_ingest_option(int argc, char* argv[], int first) {
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], "--ingest-mode") != 0) continue;
+        if (i + 1 >= argc || store_ingest_mode_parse(argv[i + 1]) < 0) {
+            fprintf(stderr, "Error: --ingest-mode takes copy, reflink or hardlink\n");
+            return -1;
+        }
+        QnixConfig* cfg = config_get();
+        free(cfg->store.ingest_mode);
+        cfg->store.ingest_mode = strdup(argv[++i]);
+    }
+    return 0;
+}
+
+// --io-limit <MiB/s> and --low-priority, so verification can run in the
+// background without starving realtime I/O. Returns 1 if argv[*i] was one
+// of them (consuming its value), 0 if not, -1 if it is invalid.
+static int apply_background_option(int argc, char* argv[], int* i) {
+    if (strcmp(argv[*i], "--io-limit") == 0) {
+        char* end = NULL;
+        double rate = *i + 1 < argc ? strtod(argv[*i + 1], &end) : 0;
+        if (*i + 1 >= argc || end == argv[*i + 1] || *end || rate <= 0) {
+            fprintf(stderr, "Error: --io-limit takes a rate in MiB per second\n");
+            return -1;
+        }
+        uint64_t bytes = (uint64_t)(rate * 1024 * 1024);
+        io_throttle_set(bytes > 0 ? bytes : 1);
+        (*i)++;
+        return 1;
+    }
+    if (strcmp(argv[*i], "--low-priority") == 0) {
+        // Worker threads started later inherit it
+        errno = 0;
+        if (nice(19) == -1 && errno != 0) {
+            fprintf(stderr, "Warning: Failed to lower priority: %s\n", strerror(errno));
+        }
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     // Load configuration first
     if (config_load(NULL) != 0) {
@@ -56,6 +116,7 @@ int main(int argc, char* argv[]) {
     else if (strcmp(argv[1], "--add") == 0) {
         // add single item
         if (argc < 4) { fprintf(stderr,"Error: Missing arguments for --add. Usage: --add <source_path> <base_name>\n"); return 1; }
+        if (apply_ingest_option(argc, argv, 4) != 0) return 1;
         if (add_to_store(argv[2], argv[3], 0) == 0) return 0;
         fprintf(stderr,"Failed to add '%s' to store.\n", argv[3]);
         return 1;
@@ -63,6 +124,7 @@ int main(int argc, char* argv[]) {
     else if (strcmp(argv[1], "--add-recursively") == 0) {
         // add dir recursively
         if (argc < 4) { fprintf(stderr,"Error: Missing arguments for --add-recursively. Usage: --add-recursively <source_dir> <base_name>\n"); return 1; }
+        if (apply_ingest_option(argc, argv, 4) != 0) return 1;
         if (add_to_store(argv[2], argv[3], 1) == 0) return 0;
         fprintf(stderr,"Failed to add '%s' recursively to store.\n", argv[3]);
         return 1;
@@ -70,6 +132,7 @@ int main(int argc, char* argv[]) {
     else if (strcmp(argv[1], "--add-with-deps") == 0) {
         // add with scanned deps
         if (argc < 4) { fprintf(stderr,"Error: Missing arguments for --add-with-deps. Usage: --add-with-deps <source_path> <base_name>\n"); return 1; }
+        if (apply_ingest_option(argc, argv, 4) != 0) return 1;
 
         char** deps = NULL;
         int deps_count = scan_dependencies(argv[2], &deps);
@@ -166,13 +229,100 @@ int main(int argc, char* argv[]) {
     else if (strcmp(argv[1], "--verify") == 0) {
         // verify store path
         if (argc < 3) { fprintf(stderr,"Error: Missing path for --verify\n"); return 1; }
-        int result = verify_store_path(argv[2]);
+        int flags = 0;
+        int jobs = 0;
+        const char* repair_from = NULL;
+        for (int i = 3; i < argc; i++) {
+            int background = apply_background_option(argc, argv, &i);
+            if (background < 0) return 1;
+            if (background) continue;
+            if (strcmp(argv[i], "--deep") == 0) {
+                flags |= STORE_VERIFY_DEEP;
+            } else if (strcmp(argv[i], "--fail-fast") == 0) {
+                flags |= STORE_VERIFY_FAIL_FAST;
+            } else if (strcmp(argv[i], "--repair") == 0) {
+                flags |= STORE_VERIFY_REPAIR;
+            } else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+                repair_from = argv[++i];
+            } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                jobs = atoi(argv[++i]);
+            } else {
+                repair_from = NULL;
+                flags = -1;
+                break;
+            }
+        }
+        if (flags < 0 || (repair_from && !(flags & STORE_VERIFY_REPAIR))) {
+            fprintf(stderr,"Error: Usage: --verify <store_path> [--deep] [--fail-fast] [--jobs N] [--repair [--from <dir>]] [--io-limit MiB/s] [--low-priority]\n");
+            return 1;
+        }
+        int result = verify_store_path(argv[2], flags, jobs, repair_from);
         return (result == 0) ? 0 : 1;
     }
+    else if (strcmp(argv[1], "--verify-all") == 0) {
+        // verify every registered path in parallel
+        int jobs = 0;
+        int flags = 0;
+        int sampling = 0;
+        // Without --seed a run picks its own, and prints it to repeat
+        VerifySample sample = { 0, (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32), 0 };
+        for (int i = 2; i < argc; i++) {
+            int background = apply_background_option(argc, argv, &i);
+            if (background < 0) return 1;
+            if (background) continue;
+            char* end = NULL;
+            if (strcmp(argv[i], "--deep") == 0) {
+                flags |= STORE_VERIFY_DEEP;
+            } else if (strcmp(argv[i], "--resume") == 0) {
+                flags |= STORE_VERIFY_RESUME;
+            } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                jobs = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc &&
+                       (sample.percent = strtod(argv[i + 1], &end)) > 0 && sample.percent <= 100 &&
+                       end != argv[i + 1] && !*end) {
+                sampling = 1;
+                i++;
+            } else if (strcmp(argv[i], "--sample-paths") == 0) {
+                sample.paths = 1;
+            } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc &&
+                       (sample.seed = strtoull(argv[i + 1], &end, 10), end != argv[i + 1] && !*end)) {
+                i++;
+            } else {
+                fprintf(stderr,"Error: Usage: --verify-all [--jobs N] [--deep] [--resume] [--io-limit MiB/s] [--low-priority]\n");
+                fprintf(stderr,"       --verify-all --sample P [--sample-paths] [--seed S] [--jobs N]  (0 < P <= 100)\n");
+                return 1;
+            }
+        }
+        if (!sampling && sample.paths) {
+            fprintf(stderr, "Error: --sample-paths needs --sample P\n");
+            return 1;
+        }
+        if (sampling && (flags & STORE_VERIFY_RESUME)) {
+            fprintf(stderr, "Error: --resume cannot be combined with --sample\n");
+            return 1;
+        }
+        return (verify_all_store_paths(jobs, flags, sampling ? &sample : NULL) == 0) ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "--dump") == 0) {
+        // export store path contents
+        if (argc < 4) { fprintf(stderr,"Error: Missing arguments for --dump. Usage: --dump <store_path> <file>\n"); return 1; }
+        return (dump_store_path(argv[2], argv[3]) == 0) ? 0 : 1;
+    }
     else if (strcmp(argv[1], "--gc") == 0) {
         // run garbage collection
         return (gc_collect_garbage() == 0) ? 0 : 1;
     }
+    else if (strcmp(argv[1], "--optimise") == 0) {
+        // deduplicate store files
+        OptimiseStats stats;
+        memset(&stats, 0, sizeof(stats));
+        int result = store_optimise(&stats);
+        printf("Optimised %llu store paths (%llu unchanged since the last run): linked %llu files, saved %llu bytes (%.1f MiB)\n",
+               (unsigned long long)stats.paths_scanned, (unsigned long long)stats.paths_skipped,
+               (unsigned long long)stats.files_linked, (unsigned long long)stats.bytes_saved,
+               stats.bytes_saved / (1024.0 * 1024.0));
+        return (result == 0) ? 0 : 1;
+    }
 
     //Query Operations
     else if (strcmp(argv[1], "--query-references") == 0) {
@@ -197,6 +347,27 @@ int main(int argc, char* argv[]) {
         fprintf(stderr,"Path %s not found in database or error retrieving references.\n", argv[2]);
         return 1;
     }
+    else if (strcmp(argv[1], "--query-referrers") == 0 || strcmp(argv[1], "--query-referrers-closure") == 0) {
+        // show dependents
+        int closure = strcmp(argv[1], "--query-referrers-closure") == 0;
+        if (argc < 3) { fprintf(stderr,"Error: Missing path for %s\n", argv[1]); return 1; }
+
+        char** referrers = closure ? db_get_referrers_closure(argv[2]) : db_get_referrers(argv[2]);
+        if (referrers) {
+            printf("%s for %s:\n", closure ? "Referrers closure" : "Referrers", argv[2]);
+            if (referrers[0] == NULL) {
+                printf("  (No referrers registered)\n");
+            }
+            for (int i = 0; referrers[i] != NULL; i++) {
+                printf("  %s\n", referrers[i]);
+                free(referrers[i]);
+            }
+            free(referrers);
+            return 0;
+        }
+        fprintf(stderr,"Error retrieving referrers of %s.\n", argv[2]);
+        return 1;
+    }
 
     //GC Root Management
     else if (strcmp(argv[1], "--add-root") == 0) {
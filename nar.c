@@ -0,0 +1,713 @@
+// canonical serialization of store path contents
+#include "nar.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define NAR_MAGIC "qnix-archive-1"
+#define NAR_COPY_BUFFER (64 * 1024)
+
+typedef struct {
+    NarSink sink;
+    void* arg;
+    int mode;
+    NarDigestLookup lookup;  // Digests known without reading the file, may be NULL
+    void* lookup_arg;
+    NarDigestRecord record;  // Told every regular file's digest, may be NULL
+    void* record_arg;
+    NarManifest* manifest;   // Nodes are appended as they are written, may be NULL
+    NarReadHook read;        // Told every read of file contents, may be NULL
+    void* read_arg;
+    size_t root_len;         // Length of the serialized path's own name in path
+    char path[PATH_MAX];  // Path of the node being written, extended while descending
+    size_t path_len;
+} NarWriter;
+
+// A directory entry, with its digest in NAR_DIGESTS mode
+typedef struct {
+    char* name;
+    struct stat st;
+    uint8_t digest[SHA256_BLOCK_SIZE];
+} NarEntry;
+
+static int nar_write(NarWriter* w, const void* data, size_t len) {
+    if (len == 0) return 0;
+    return w->sink(data, len, w->arg) == 0 ? 0 : -1;
+}
+
+// Numbers are 64-bit little endian
+static int nar_write_u64(NarWriter* w, uint64_t v) {
+    uint8_t buf[8];
+    for (int i = 0; i < 8; i++) buf[i] = (uint8_t)(v >> (i * 8));
+    return nar_write(w, buf, sizeof(buf));
+}
+
+// Zero padding up to the next multiple of 8 bytes
+static int nar_write_pad(NarWriter* w, uint64_t len) {
+    static const uint8_t zero[8];
+    return nar_write(w, zero, (8 - len % 8) % 8);
+}
+
+// A token: its length, its bytes, then padding
+static int nar_write_bytes(NarWriter* w, const void* data, size_t len) {
+    if (nar_write_u64(w, len) != 0 || nar_write(w, data, len) != 0) return -1;
+    return nar_write_pad(w, len);
+}
+
+static int nar_write_str(NarWriter* w, const char* s) {
+    return nar_write_bytes(w, s, strlen(s));
+}
+
+// Stream a regular file's contents as one token; the size written up
+// front must still hold at the end
+static int nar_write_contents(NarWriter* w, const struct stat* st) {
+    int fd = open(w->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", w->path, strerror(errno));
+        return -1;
+    }
+
+    uint8_t* buffer = malloc(NAR_COPY_BUFFER);
+    if (!buffer) {
+        fprintf(stderr, "Memory allocation failed\n");
+        close(fd);
+        return -1;
+    }
+
+    int ret = nar_write_u64(w, (uint64_t)st->st_size);
+    int changed = 0;
+    uint64_t total = 0;
+    while (ret == 0) {
+        ssize_t r = read(fd, buffer, NAR_COPY_BUFFER);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to read %s: %s\n", w->path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (r == 0) break;
+        if (total + r > (uint64_t)st->st_size) {
+            changed = 1;
+            break;
+        }
+        total += r;
+        ret = nar_write(w, buffer, r);
+    }
+    if (ret == 0 && (changed || total != (uint64_t)st->st_size)) {
+        fprintf(stderr, "File %s changed while it was being read\n", w->path);
+        ret = -1;
+    }
+
+    free(buffer);
+    close(fd);
+    return ret == 0 ? nar_write_pad(w, total) : -1;
+}
+
+static int nar_entry_cmp(const void* a, const void* b) {
+    return strcmp(((const NarEntry*)a)->name, ((const NarEntry*)b)->name);
+}
+
+static void nar_free_entries(NarEntry* entries, size_t count) {
+    for (size_t i = 0; i < count; i++) free(entries[i].name);
+    free(entries);
+}
+
+// Read, lstat and sort the entries of the directory at w->path. In
+// NAR_DIGESTS mode the regular files whose digest the lookup does not
+// know are hashed together in one batch.
+static int nar_read_dir(NarWriter* w, NarEntry** entries_out, size_t* count_out) {
+    DIR* dir = opendir(w->path);
+    if (!dir) {
+        fprintf(stderr, "Failed to open directory %s: %s\n", w->path, strerror(errno));
+        return -1;
+    }
+
+    NarEntry* entries = NULL;
+    size_t count = 0, capacity = 0;
+    int ret = 0;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 16;
+            NarEntry* grown = realloc(entries, new_capacity * sizeof(NarEntry));
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed\n");
+                ret = -1;
+                break;
+            }
+            entries = grown;
+            capacity = new_capacity;
+        }
+        if (!(entries[count].name = strdup(de->d_name))) {
+            fprintf(stderr, "Memory allocation failed\n");
+            ret = -1;
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+    if (ret != 0) {
+        nar_free_entries(entries, count);
+        return -1;
+    }
+
+    qsort(entries, count, sizeof(NarEntry), nar_entry_cmp);
+
+    char** files = NULL;
+    size_t* file_entry = NULL;
+    size_t file_count = 0;
+    if (w->mode == NAR_DIGESTS && count > 0) {
+        files = malloc(count * sizeof(char*));
+        file_entry = malloc(count * sizeof(size_t));
+        if (!files || !file_entry) {
+            fprintf(stderr, "Memory allocation failed\n");
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        char full_path[PATH_MAX];
+        if (snprintf(full_path, PATH_MAX, "%s/%s", w->path, entries[i].name) >= PATH_MAX) {
+            fprintf(stderr, "Path too long: %s/%s\n", w->path, entries[i].name);
+            ret = -1;
+        } else if (lstat(full_path, &entries[i].st) != 0) {
+            fprintf(stderr, "Failed to stat %s: %s\n", full_path, strerror(errno));
+            ret = -1;
+        } else if (files && S_ISREG(entries[i].st.st_mode)) {
+            if (w->lookup && w->lookup(full_path, &entries[i].st, entries[i].digest, w->lookup_arg) == 0) {
+                if (w->record) w->record(full_path, &entries[i].st, entries[i].digest, w->record_arg);
+                continue;
+            }
+            if (!(files[file_count] = strdup(full_path))) {
+                fprintf(stderr, "Memory allocation failed\n");
+                ret = -1;
+            } else {
+                file_entry[file_count++] = i;
+            }
+        }
+    }
+
+    if (ret == 0 && file_count > 0) {
+        uint8_t (*digests)[SHA256_BLOCK_SIZE] = malloc(file_count * SHA256_BLOCK_SIZE);
+        if (!digests || sha256_hash_files_with((const char* const*)files, file_count, digests,
+                                             w->read, w->read_arg) != 0) {
+            ret = -1;
+        } else {
+            for (size_t i = 0; i < file_count; i++) {
+                memcpy(entries[file_entry[i]].digest, digests[i], SHA256_BLOCK_SIZE);
+                if (w->record) w->record(files[i], &entries[file_entry[i]].st, digests[i], w->record_arg);
+            }
+        }
+        free(digests);
+    }
+
+    for (size_t i = 0; i < file_count; i++) free(files[i]);
+    free(files);
+    free(file_entry);
+
+    if (ret != 0) {
+        nar_free_entries(entries, count);
+        return -1;
+    }
+    *entries_out = entries;
+    *count_out = count;
+    return 0;
+}
+
+// Path of the node being written relative to the serialized one
+static const char* nar_rel_path(const NarWriter* w) {
+    return w->path_len > w->root_len ? w->path + w->root_len + 1 : "";
+}
+
+// Write the node at w->path; digest is its contents hash in NAR_DIGESTS mode
+static int nar_write_node(NarWriter* w, const struct stat* st, const uint8_t* digest) {
+    if (nar_write_str(w, "(") != 0 || nar_write_str(w, "type") != 0) return -1;
+
+    if (S_ISREG(st->st_mode)) {
+        if (w->manifest && nar_manifest_add(w->manifest, nar_rel_path(w), S_IFREG, (st->st_mode & 0111) != 0,
+                                            (uint64_t)st->st_size, digest, NULL) != 0) {
+            return -1;
+        }
+        if (nar_write_str(w, "regular") != 0) return -1;
+        if ((st->st_mode & 0111) && (nar_write_str(w, "executable") != 0 || nar_write_str(w, "") != 0)) {
+            return -1;
+        }
+        if (w->mode == NAR_DIGESTS) {
+            if (nar_write_str(w, "size") != 0 || nar_write_u64(w, (uint64_t)st->st_size) != 0 ||
+                nar_write_str(w, "sha256") != 0 || nar_write_bytes(w, digest, SHA256_BLOCK_SIZE) != 0) {
+                return -1;
+            }
+        } else if (nar_write_str(w, "contents") != 0 || nar_write_contents(w, st) != 0) {
+            return -1;
+        }
+    } else if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(w->path, target, sizeof(target) - 1);
+        if (len < 0) {
+            fprintf(stderr, "Failed to read symlink %s: %s\n", w->path, strerror(errno));
+            return -1;
+        }
+        target[len] = '\0';
+        if (w->manifest && nar_manifest_add(w->manifest, nar_rel_path(w), S_IFLNK, 0, 0, NULL, target) != 0) {
+            return -1;
+        }
+        if (nar_write_str(w, "symlink") != 0 || nar_write_str(w, "target") != 0 ||
+            nar_write_bytes(w, target, (size_t)len) != 0) {
+            return -1;
+        }
+    } else if (S_ISDIR(st->st_mode)) {
+        NarEntry* entries;
+        size_t count;
+        if (w->manifest && nar_manifest_add(w->manifest, nar_rel_path(w), S_IFDIR, 0, 0, NULL, NULL) != 0) {
+            return -1;
+        }
+        if (nar_write_str(w, "directory") != 0 || nar_read_dir(w, &entries, &count) != 0) return -1;
+
+        int ret = 0;
+        size_t dir_len = w->path_len;
+        for (size_t i = 0; ret == 0 && i < count; i++) {
+            size_t name_len = strlen(entries[i].name);
+            if (dir_len + 1 + name_len >= PATH_MAX) {
+                fprintf(stderr, "Path too long: %s/%s\n", w->path, entries[i].name);
+                ret = -1;
+                break;
+            }
+            w->path[dir_len] = '/';
+            memcpy(w->path + dir_len + 1, entries[i].name, name_len + 1);
+            w->path_len = dir_len + 1 + name_len;
+
+            if (nar_write_str(w, "entry") != 0 || nar_write_str(w, "(") != 0 ||
+                nar_write_str(w, "name") != 0 || nar_write_str(w, entries[i].name) != 0 ||
+                nar_write_str(w, "node") != 0 || nar_write_node(w, &entries[i].st, entries[i].digest) != 0 ||
+                nar_write_str(w, ")") != 0) {
+                ret = -1;
+            }
+            w->path[dir_len] = '\0';
+            w->path_len = dir_len;
+        }
+        nar_free_entries(entries, count);
+        if (ret != 0) return -1;
+    } else {
+        fprintf(stderr, "Unsupported file type: %s\n", w->path);
+        return -1;
+    }
+
+    return nar_write_str(w, ")");
+}
+
+static int nar_serialize_with(const char* path, int mode, NarSink sink, void* arg,
+                              NarDigestLookup lookup, void* lookup_arg,
+                              NarDigestRecord record, void* record_arg,
+                              NarReadHook read, void* read_arg, NarManifest* manifest) {
+    NarWriter w;
+    struct stat st;
+    uint8_t digest[SHA256_BLOCK_SIZE] = {0};
+
+    w.sink = sink;
+    w.arg = arg;
+    w.mode = mode;
+    w.lookup = lookup;
+    w.lookup_arg = lookup_arg;
+    w.record = record;
+    w.record_arg = record_arg;
+    w.manifest = manifest;
+    w.read = read;
+    w.read_arg = read_arg;
+    w.path_len = strlen(path);
+    if (w.path_len >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s\n", path);
+        return -1;
+    }
+    memcpy(w.path, path, w.path_len + 1);
+    while (w.path_len > 1 && w.path[w.path_len - 1] == '/') {
+        w.path[--w.path_len] = '\0';
+    }
+    w.root_len = w.path_len;
+
+    if (lstat(w.path, &st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", w.path, strerror(errno));
+        return -1;
+    }
+    if (mode == NAR_DIGESTS && S_ISREG(st.st_mode) && !(lookup && lookup(w.path, &st, digest, lookup_arg) == 0)) {
+        const char* files[1] = { w.path };
+        if (sha256_hash_files_with(files, 1, &digest, read, read_arg) != 0) return -1;
+    }
+    if (mode == NAR_DIGESTS && S_ISREG(st.st_mode) && record) record(w.path, &st, digest, record_arg);
+
+    if (nar_write_str(&w, NAR_MAGIC) != 0) return -1;
+    return nar_write_node(&w, &st, digest);
+}
+
+int nar_serialize(const char* path, int mode, NarSink sink, void* arg) {
+    return nar_serialize_with(path, mode, sink, arg, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+static int nar_hash_sink(const void* data, size_t len, void* arg) {
+    sha256_update((SHA256_CTX*)arg, data, len);
+    return 0;
+}
+
+static void nar_hex(const uint8_t hash[SHA256_BLOCK_SIZE], char hash_str[SHA256_DIGEST_STRING_LENGTH]) {
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        sprintf(hash_str + (i * 2), "%02x", hash[i]);
+    }
+    hash_str[SHA256_DIGEST_STRING_LENGTH - 1] = 0;
+}
+
+int nar_hash_path_manifest(const char* path, NarDigestLookup lookup, void* lookup_arg,
+                           NarDigestRecord record, void* record_arg,
+                           NarReadHook read, void* read_arg, NarManifest* manifest,
+                           char hash_str[SHA256_DIGEST_STRING_LENGTH]) {
+    SHA256_CTX ctx;
+    uint8_t hash[SHA256_BLOCK_SIZE];
+
+    sha256_init(&ctx);
+    if (nar_serialize_with(path, NAR_DIGESTS, nar_hash_sink, &ctx, lookup, lookup_arg,
+                           record, record_arg, read, read_arg, manifest) != 0) {
+        return -1;
+    }
+    sha256_final(&ctx, hash);
+    nar_hex(hash, hash_str);
+    return 0;
+}
+
+int nar_hash_path_cached(const char* path, NarDigestLookup lookup, void* lookup_arg,
+                         NarDigestRecord record, void* record_arg,
+                         char hash_str[SHA256_DIGEST_STRING_LENGTH]) {
+    return nar_hash_path_manifest(path, lookup, lookup_arg, record, record_arg, NULL, NULL, NULL, hash_str);
+}
+
+int nar_hash_path_with(const char* path, NarDigestLookup lookup, void* lookup_arg,
+                       char hash_str[SHA256_DIGEST_STRING_LENGTH]) {
+    return nar_hash_path_cached(path, lookup, lookup_arg, NULL, NULL, hash_str);
+}
+
+int nar_hash_path(const char* path, char hash_str[SHA256_DIGEST_STRING_LENGTH]) {
+    return nar_hash_path_with(path, NULL, NULL, hash_str);
+}
+
+int nar_hash_file_at(const char* file, const char* rel_path, mode_t mode,
+                     char hash_str[SHA256_DIGEST_STRING_LENGTH]) {
+    NarWriter w;
+    struct stat st;
+    uint8_t digest[SHA256_BLOCK_SIZE];
+    SHA256_CTX ctx;
+
+    w.sink = nar_hash_sink;
+    w.arg = &ctx;
+    w.mode = NAR_DIGESTS;
+    w.lookup = NULL;
+    w.lookup_arg = NULL;
+    w.record = NULL;
+    w.record_arg = NULL;
+    w.manifest = NULL;
+    w.read = NULL;
+    w.read_arg = NULL;
+    w.path_len = strlen(file);
+    if (w.path_len >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s\n", file);
+        return -1;
+    }
+    memcpy(w.path, file, w.path_len + 1);
+
+    if (lstat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Not a regular file: %s\n", file);
+        return -1;
+    }
+    st.st_mode = S_IFREG | (mode & 07777);
+    const char* files[1] = { file };
+    if (sha256_hash_files(files, 1, &digest) != 0) return -1;
+
+    sha256_init(&ctx);
+    int ret = nar_write_str(&w, NAR_MAGIC);
+
+    // One single-entry directory per leading component of rel_path
+    int depth = 0;
+    const char* component = rel_path;
+    const char* slash;
+    while (ret == 0 && (slash = strchr(component, '/')) != NULL) {
+        if (nar_write_str(&w, "(") != 0 || nar_write_str(&w, "type") != 0 ||
+            nar_write_str(&w, "directory") != 0 || nar_write_str(&w, "entry") != 0 ||
+            nar_write_str(&w, "(") != 0 || nar_write_str(&w, "name") != 0 ||
+            nar_write_bytes(&w, component, (size_t)(slash - component)) != 0 ||
+            nar_write_str(&w, "node") != 0) {
+            ret = -1;
+        }
+        depth++;
+        component = slash + 1;
+    }
+    if (ret == 0) {
+        if (nar_write_str(&w, "(") != 0 || nar_write_str(&w, "type") != 0 ||
+            nar_write_str(&w, "directory") != 0 || nar_write_str(&w, "entry") != 0 ||
+            nar_write_str(&w, "(") != 0 || nar_write_str(&w, "name") != 0 ||
+            nar_write_str(&w, component) != 0 || nar_write_str(&w, "node") != 0 ||
+            nar_write_node(&w, &st, digest) != 0) {
+            ret = -1;
+        }
+        depth++;
+    }
+    // Close each entry and its directory
+    while (ret == 0 && depth-- > 0) {
+        if (nar_write_str(&w, ")") != 0 || nar_write_str(&w, ")") != 0) ret = -1;
+    }
+    if (ret != 0) return -1;
+
+    uint8_t hash[SHA256_BLOCK_SIZE];
+    sha256_final(&ctx, hash);
+    nar_hex(hash, hash_str);
+    return 0;
+}
+
+int nar_manifest_add(NarManifest* manifest, const char* path, mode_t type, int executable,
+                     uint64_t size, const uint8_t* digest, const char* target) {
+    if (manifest->count == manifest->capacity) {
+        size_t capacity = manifest->capacity ? manifest->capacity * 2 : 64;
+        NarManifestEntry* entries = realloc(manifest->entries, capacity * sizeof(NarManifestEntry));
+        if (!entries) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+        manifest->entries = entries;
+        manifest->capacity = capacity;
+    }
+    NarManifestEntry* e = &manifest->entries[manifest->count];
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    e->executable = executable;
+    e->size = size;
+    if (digest) memcpy(e->digest, digest, SHA256_BLOCK_SIZE);
+    if (!(e->path = strdup(path)) || (target && !(e->target = strdup(target)))) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(e->path);
+        return -1;
+    }
+    manifest->count++;
+    return 0;
+}
+
+void nar_manifest_free(NarManifest* manifest) {
+    for (size_t i = 0; i < manifest->count; i++) {
+        free(manifest->entries[i].path);
+        free(manifest->entries[i].target);
+    }
+    free(manifest->entries);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+// Serialization order of two relative paths: component by component, so
+// a directory's entries come right after it ('/' sorts before any name byte)
+static int nar_path_cmp(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    unsigned ca = *a == '/' ? 1 : (unsigned char)*a ? (unsigned char)*a + 1u : 0;
+    unsigned cb = *b == '/' ? 1 : (unsigned char)*b ? (unsigned char)*b + 1u : 0;
+    return ca < cb ? -1 : ca > cb;
+}
+
+long nar_manifest_find(const NarManifest* manifest, const char* path) {
+    size_t lo = 0, hi = manifest->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = nar_path_cmp(manifest->entries[mid].path, path);
+        if (c == 0) return (long)mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+// Length of the directory part of a relative path ("a/b/c" -> 3, "a" -> 0)
+static size_t nar_parent_len(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? (size_t)(slash - path) : 0;
+}
+
+int nar_manifest_hash(const NarManifest* manifest, char hash_str[SHA256_DIGEST_STRING_LENGTH]) {
+    NarWriter w;
+    SHA256_CTX ctx;
+    memset(&w, 0, sizeof(w));
+    w.sink = nar_hash_sink;
+    w.arg = &ctx;
+    w.mode = NAR_DIGESTS;
+
+    const NarManifestEntry* e = manifest->entries;
+    if (manifest->count == 0 || e[0].path[0] != '\0') return -1;
+
+    // Directories still open, innermost last; their entries are not closed
+    size_t* open_dirs = malloc(manifest->count * sizeof(size_t));
+    if (!open_dirs) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    size_t depth = 0;
+
+    sha256_init(&ctx);
+    int ret = nar_write_str(&w, NAR_MAGIC);
+    for (size_t i = 0; ret == 0 && i < manifest->count; i++) {
+        if (i > 0) {
+            // Close directories until the innermost one is this entry's parent
+            size_t parent_len = nar_parent_len(e[i].path);
+            while (depth > 0) {
+                const char* dir = e[open_dirs[depth - 1]].path;
+                if (strlen(dir) == parent_len && strncmp(dir, e[i].path, parent_len) == 0) break;
+                depth--;
+                if (nar_write_str(&w, ")") != 0 || (depth > 0 && nar_write_str(&w, ")") != 0)) ret = -1;
+            }
+            // Entries must follow their parent in strictly increasing order
+            if (ret == 0 && (depth == 0 || nar_path_cmp(e[i - 1].path, e[i].path) >= 0)) ret = -1;
+            const char* name = e[i].path + parent_len + (parent_len > 0);
+            if (ret == 0 && (!*name || nar_write_str(&w, "entry") != 0 || nar_write_str(&w, "(") != 0 ||
+                             nar_write_str(&w, "name") != 0 || nar_write_str(&w, name) != 0 ||
+                             nar_write_str(&w, "node") != 0)) {
+                ret = -1;
+            }
+        }
+        if (ret != 0) break;
+
+        if (nar_write_str(&w, "(") != 0 || nar_write_str(&w, "type") != 0) {
+            ret = -1;
+        } else if (e[i].type == S_IFDIR) {
+            if (nar_write_str(&w, "directory") != 0) ret = -1;
+            open_dirs[depth++] = i;
+            continue;
+        } else if (e[i].type == S_IFREG) {
+            if (nar_write_str(&w, "regular") != 0 ||
+                (e[i].executable && (nar_write_str(&w, "executable") != 0 || nar_write_str(&w, "") != 0)) ||
+                nar_write_str(&w, "size") != 0 || nar_write_u64(&w, e[i].size) != 0 ||
+                nar_write_str(&w, "sha256") != 0 || nar_write_bytes(&w, e[i].digest, SHA256_BLOCK_SIZE) != 0) {
+                ret = -1;
+            }
+        } else if (e[i].type == S_IFLNK && e[i].target) {
+            if (nar_write_str(&w, "symlink") != 0 || nar_write_str(&w, "target") != 0 ||
+                nar_write_str(&w, e[i].target) != 0) {
+                ret = -1;
+            }
+        } else {
+            ret = -1;
+        }
+        // Close the node, and its entry unless it is the root
+        if (ret == 0 && (nar_write_str(&w, ")") != 0 || (i > 0 && nar_write_str(&w, ")") != 0))) ret = -1;
+    }
+    while (ret == 0 && depth > 0) {
+        depth--;
+        if (nar_write_str(&w, ")") != 0 || (depth > 0 && nar_write_str(&w, ")") != 0)) ret = -1;
+    }
+    free(open_dirs);
+    if (ret != 0) return -1;
+
+    uint8_t hash[SHA256_BLOCK_SIZE];
+    sha256_final(&ctx, hash);
+    nar_hex(hash, hash_str);
+    return 0;
+}
+
+// Relative paths of the regular files under a directory, for the legacy hash
+typedef struct {
+    char** items;
+    size_t count;
+    size_t capacity;
+} NarFileList;
+
+static int nar_legacy_collect(const char* root, const char* dir_path, NarFileList* list) {
+    DIR* dir = opendir(dir_path);
+    if (!dir) return 0;
+
+    int ret = 0;
+    struct dirent* entry;
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char full_path[PATH_MAX];
+        snprintf(full_path, PATH_MAX, "%s/%s", dir_path, entry->d_name);
+
+        struct stat st;
+        if (stat(full_path, &st) != 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            ret = nar_legacy_collect(root, full_path, list);
+        } else if (S_ISREG(st.st_mode)) {
+            if (list->count == list->capacity) {
+                size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+                char** grown = realloc(list->items, new_capacity * sizeof(char*));
+                if (!grown) {
+                    ret = -1;
+                    break;
+                }
+                list->items = grown;
+                list->capacity = new_capacity;
+            }
+            if (!(list->items[list->count] = strdup(full_path + strlen(root) + 1))) {
+                ret = -1;
+                break;
+            }
+            list->count++;
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+static int nar_str_cmp(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void nar_hash_file_into(SHA256_CTX* ctx, const char* path, NarReadHook read, void* read_arg) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return;
+    uint8_t buffer[4096];
+    size_t bytes;
+    while ((bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        if (read) read(bytes, read_arg);
+        sha256_update(ctx, buffer, bytes);
+    }
+    fclose(f);
+}
+
+int nar_hash_path_legacy(const char* path, NarReadHook read, void* read_arg,
+                         char hash_str[SHA256_DIGEST_STRING_LENGTH]) {
+    struct stat st;
+    SHA256_CTX ctx;
+    uint8_t hash[SHA256_BLOCK_SIZE];
+
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    sha256_init(&ctx);
+    if (S_ISDIR(st.st_mode)) {
+        NarFileList list = { NULL, 0, 0 };
+        if (nar_legacy_collect(path, path, &list) != 0) {
+            fprintf(stderr, "Memory allocation failed\n");
+            for (size_t i = 0; i < list.count; i++) free(list.items[i]);
+            free(list.items);
+            return -1;
+        }
+        qsort(list.items, list.count, sizeof(char*), nar_str_cmp);
+
+        for (size_t i = 0; i < list.count; i++) {
+            char full_path[PATH_MAX];
+            snprintf(full_path, PATH_MAX, "%s/%s", path, list.items[i]);
+            sha256_update(&ctx, (uint8_t*)list.items[i], strlen(list.items[i]));
+            nar_hash_file_into(&ctx, full_path, read, read_arg);
+            free(list.items[i]);
+        }
+        free(list.items);
+    } else {
+        nar_hash_file_into(&ctx, path, read, read_arg);
+    }
+
+    sha256_final(&ctx, hash);
+    nar_hex(hash, hash_str);
+    return 0;
+}
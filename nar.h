@@ -0,0 +1,105 @@
+/*
+ * nar.h - Canonical serialization and hashing of store path contents
+ */
+#ifndef NAR_H
+#define NAR_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include "sha256.h"
+
+// Receives the serialization in pieces, in order; return non-zero to stop
+typedef int (*NarSink)(const void* data, size_t len, void* arg);
+
+// Serialization modes
+#define NAR_CONTENTS 0  // Regular file contents inline (export)
+#define NAR_DIGESTS 1   // Each regular file's contents replaced by its SHA-256 (hashing)
+
+// Serialize the tree at path in canonical form: NAR-style length-framed
+// tokens, directory entries sorted by name, symlinks stored as their
+// target, regular files with their size and executable bit. Nothing else
+// (owners, times, other permission bits) is included. Returns 0, or -1 if
+// the tree could not be read or the sink stopped.
+int nar_serialize(const char* path, int mode, NarSink sink, void* arg);
+
+// Canonical hash of path as a hex string: SHA-256 of its NAR_DIGESTS
+// serialization. Files are hashed in batches with sha256_hash_files().
+int nar_hash_path(const char* path, char hash_str[SHA256_DIGEST_STRING_LENGTH]);
+
+// Supplies the contents digest of a regular file that is already known
+// (e.g. hashed while it was copied); returns 0 if it filled in digest,
+// non-zero to have the file read and hashed
+typedef int (*NarDigestLookup)(const char* path, const struct stat* st,
+                               uint8_t digest[SHA256_BLOCK_SIZE], void* arg);
+
+// nar_hash_path, taking file digests from lookup where it knows them
+int nar_hash_path_with(const char* path, NarDigestLookup lookup, void* lookup_arg,
+                       char hash_str[SHA256_DIGEST_STRING_LENGTH]);
+
+// nar_hash_path of a directory holding only file, at rel_path (e.g.
+// "bin/name") and with the given mode, without creating that tree
+int nar_hash_file_at(const char* file, const char* rel_path, mode_t mode,
+                     char hash_str[SHA256_DIGEST_STRING_LENGTH]);
+
+// Told the contents digest of each regular file nar_hash_path_cached
+// hashed or got from its lookup
+typedef void (*NarDigestRecord)(const char* path, const struct stat* st,
+                                const uint8_t digest[SHA256_BLOCK_SIZE], void* arg);
+
+// nar_hash_path_with, also passing every file's digest to record (e.g.
+// to remember them in a cache)
+int nar_hash_path_cached(const char* path, NarDigestLookup lookup, void* lookup_arg,
+                         NarDigestRecord record, void* record_arg,
+                         char hash_str[SHA256_DIGEST_STRING_LENGTH]);
+
+// One node of a store path, as it appears in the NAR_DIGESTS serialization
+typedef struct {
+    char* path;        // Relative to the store path; "" for the path itself
+    mode_t type;       // S_IFREG, S_IFDIR or S_IFLNK
+    int executable;    // Regular files
+    uint64_t size;     // Regular files
+    uint8_t digest[SHA256_BLOCK_SIZE];  // Regular files: contents SHA-256
+    char* target;      // Symlinks
+} NarManifestEntry;
+
+// Every node of a store path in serialization order: depth first, each
+// directory before its entries, entries sorted by name. It holds all the
+// serialization does, so the canonical hash can be computed from it alone.
+typedef struct {
+    NarManifestEntry* entries;
+    size_t count;
+    size_t capacity;
+} NarManifest;
+
+// Told the size of each piece of a file as it is read (e.g. to pace reads)
+typedef void (*NarReadHook)(size_t bytes, void* arg);
+
+// nar_hash_path_cached, passing every read of file contents to read (may
+// be NULL) and listing the nodes of the tree in manifest (may be NULL;
+// freed by the caller with nar_manifest_free, even on error)
+int nar_hash_path_manifest(const char* path, NarDigestLookup lookup, void* lookup_arg,
+                           NarDigestRecord record, void* record_arg,
+                           NarReadHook read, void* read_arg, NarManifest* manifest,
+                           char hash_str[SHA256_DIGEST_STRING_LENGTH]);
+
+// Canonical hash of the tree a manifest describes; -1 if the entries are
+// not a tree in serialization order
+int nar_manifest_hash(const NarManifest* manifest, char hash_str[SHA256_DIGEST_STRING_LENGTH]);
+
+// Append an entry (path and target are copied); -1 if out of memory
+int nar_manifest_add(NarManifest* manifest, const char* path, mode_t type, int executable,
+                     uint64_t size, const uint8_t* digest, const char* target);
+
+// Index of the entry for path (relative), -1 if there is none
+long nar_manifest_find(const NarManifest* manifest, const char* path);
+
+void nar_manifest_free(NarManifest* manifest);
+
+// Hash in the format stored before the canonical serialization existed:
+// the sorted relative paths and contents of all regular files (following
+// symlinks), or just the contents if path is a file. Only used to verify
+// hashes recorded in that format. read may be NULL.
+int nar_hash_path_legacy(const char* path, NarReadHook read, void* read_arg,
+                         char hash_str[SHA256_DIGEST_STRING_LENGTH]);
+
+#endif
@@ -9,6 +9,9 @@
 #include <errno.h>
 #include "nix_store.h"
 #include "nix_store_db.h"
+#include "store_copy.h"
+#include "store_optimise.h"
+#include "store_manifest.h"
 #include <sys/param.h> // for MAXPATHLEN if PATH_MAX is not defined
 
 #ifndef PATH_MAX
@@ -26,6 +29,7 @@ typedef struct PathRef {
 
 // forward declarations
 static void mark_path(PathRef* list, const char* path);
+static int mark_reference(const char* ref, void* arg);
 
 // add path to ref list
 static PathRef* add_path_ref(PathRef* list, const char* path) {
@@ -121,14 +125,13 @@ static void mark_path(PathRef* list, const char* path) {
     current->mark = 1;
 
     // Recursively mark all dependencies as reachable
-    char** refs = db_get_references(current->path);
-    if (refs) {
-        for (int i = 0; refs[i] != NULL; i++) {
-            mark_path(list, refs[i]);  // Recursive mark of each dependency
-            free(refs[i]);
-        }
-        free(refs);
-    }
+    db_foreach_reference(current->path, mark_reference, list);
+}
+
+// db_foreach_reference callback: recursive mark of each dependency
+static int mark_reference(const char* ref, void* arg) {
+    mark_path((PathRef*)arg, ref);
+    return 0;
 }
 
 // scan profile dir and mark store paths
@@ -207,7 +210,8 @@ int gc_collect_garbage(void) {
     while ((entry = readdir(store_dir)) != NULL) {
         if (strcmp(entry->d_name, ".") == 0 ||
             strcmp(entry->d_name, "..") == 0 ||
-            strcmp(entry->d_name, ".nix-db") == 0) { // ignore DB dir
+            strcmp(entry->d_name, ".nix-db") == 0 || // ignore DB dir
+            strcmp(entry->d_name, ".links") == 0) {  // and optimiser links
             continue;
         }
 
@@ -284,26 +288,64 @@ int gc_collect_garbage(void) {
     PathRef* current = paths;
     int removed_count = 0;
 
+    // paths deleted from the filesystem, dropped from the database in one batch
+    const char** removed = malloc((path_count > 0 ? path_count : 1) * sizeof(char*));
+    int* removed_locks = malloc((path_count > 0 ? path_count : 1) * sizeof(int));
+    if (!removed || !removed_locks) {
+        fprintf(stderr, "GC Error: Failed to allocate memory for removed path list.\n");
+        free(removed);
+        free(removed_locks);
+        free_path_refs(paths);
+        return -1;
+    }
+
     while (current) {
         if (!current->mark) {
+            // an add in progress holds the path's lock until it is registered;
+            // the lock is kept until the path is out of the database, so an
+            // add waiting for it cannot register it in between
+            int lock = store_path_lock(current->path, 0);
+            if (lock == -1) {
+                printf("Skipping %s, it is being added\n", current->path);
+                current = current->next;
+                continue;
+            }
             printf("Removing unused path: %s\n", current->path);
 
-            // recursive removal using system rm -rf
-            char cmd[PATH_MAX + 10];
-            snprintf(cmd, sizeof(cmd), "rm -rf %s", current->path);
-            int ret = system(cmd);
-            if (ret == 0) {
+            // recursive removal
+            if (store_remove_tree(current->path) == 0) {
                 // remove from database only if successfully deleted from filesystem
-                db_remove_path(current->path);
-                removed_count++;
+                removed_locks[removed_count] = lock;
+                removed[removed_count++] = current->path;
+                store_manifest_remove(current->path);
             } else {
-                fprintf(stderr, "Failed to remove path from filesystem: %s (system rm -rf returned %d)\n", current->path, ret);
+                fprintf(stderr, "Failed to remove path from filesystem: %s\n", current->path);
                 // do not remove from DB if filesystem removal failed
+                store_path_unlock(lock);
             }
         }
         current = current->next;
     }
 
+    if (db_remove_paths(removed, removed_count) != 0) {
+        fprintf(stderr, "GC Warning: Failed to remove %d deleted paths from the database\n", removed_count);
+    }
+    for (int i = 0; i < removed_count; i++) {
+        store_path_unlock(removed_locks[i]);
+    }
+    free(removed);
+    free(removed_locks);
+
+    // links of optimised files whose store paths are all gone
+    uint64_t links_removed, bytes_freed;
+    if (store_optimise_prune_links(&links_removed, &bytes_freed) != 0) {
+        fprintf(stderr, "GC Warning: Failed to remove some unused links\n");
+    }
+    if (links_removed > 0) {
+        printf("Removed %llu unused links, freeing %llu bytes.\n",
+               (unsigned long long)links_removed, (unsigned long long)bytes_freed);
+    }
+
     printf("Garbage collection complete. Removed %d unused paths.\n", removed_count);
 
     // free the path list
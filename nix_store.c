@@ -6,10 +6,19 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <nix_store_db.h>
+#include "elf_scan.h"
+#include "nar.h"
+#include "store_copy.h"
+#include "store_optimise.h"
+#include "hash_cache.h"
+#include "store_manifest.h"
+#include "io_throttle.h"
 #include <ctype.h>
 #include <sys/stat.h> // For mkdir, chmod
 #include <unistd.h>   // For symlink, execvp, chdir, unlink
 #include <libgen.h>   // For basename
+#include <pthread.h>
+#include <time.h>
 #include <sys/param.h> // For MAXPATHLEN if PATH_MAX is not defined
 
 #ifndef PATH_MAX
@@ -26,6 +35,27 @@ static int path_exists(const char* path) {
     return (stat(path, &st) == 0);
 }
 
+// Record the libraries a store path provides in the library index, so
+// find_store_path_for_boot_lib can resolve them without searching the
+// store. Files are added under bin/, directories may carry lib/ and bin/.
+static void register_provided_libraries(const char* store_path) {
+    const char* sub_dirs[] = {"lib", "bin", NULL};
+    for (const char** sub = sub_dirs; *sub; sub++) {
+        char dir_path[PATH_MAX];
+        snprintf(dir_path, PATH_MAX, "%s/%s", store_path, *sub);
+        DIR* dir = opendir(dir_path);
+        if (!dir) continue;
+
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.' && strstr(entry->d_name, ".so") != NULL) {
+                db_register_library(entry->d_name, store_path);
+            }
+        }
+        closedir(dir);
+    }
+}
+
 // Initialize the store directory structure
 int store_init(void) {
     // Load configuration first
@@ -125,6 +155,133 @@ char* compute_store_path(const char* name, const char* hash, const char** refere
 }
 
 
+// STORE_SEAL_* flags the configuration asks for
+static int store_seal_flags(void) {
+    QnixConfig* cfg = config_get();
+    int flags = 0;
+    if (cfg->store.enforce_readonly) flags |= STORE_SEAL_READONLY;
+    if (cfg->store.normalize_mtime) flags |= STORE_SEAL_MTIME;
+    return flags;
+}
+
+// Canonical hash of the store path that adding source_path produces: the
+// tree itself, or for a file the file at bin/<name> with mode 0755
+static int hash_store_contents(const char* source_path, const struct stat* st,
+                               char hash_str[SHA256_DIGEST_STRING_LENGTH]) {
+    if (S_ISDIR(st->st_mode)) return nar_hash_path(source_path, hash_str);
+
+    char source_copy[PATH_MAX];
+    char rel_path[PATH_MAX];
+    snprintf(source_copy, PATH_MAX, "%s", source_path);
+    if (snprintf(rel_path, PATH_MAX, "bin/%s", basename(source_copy)) >= PATH_MAX) return -1;
+    return nar_hash_file_at(source_path, rel_path, 0755, hash_str);
+}
+
+// Take the lock that serializes adding a store path with other adds of
+// it and with GC removing it, a file under .nix-db/locks named after the
+// path. Without wait, returns -1 at once if another process holds it.
+// Lock files are left in place: removing one while another process waits
+// on it would let a third lock a new file for the same path.
+int store_path_lock(const char* store_path, int wait) {
+    char name_buf[PATH_MAX], lock_path[PATH_MAX];
+    snprintf(name_buf, PATH_MAX, "%s", store_path);
+    if (snprintf(lock_path, PATH_MAX, "%s/%s", STORE_LOCKS_DIR, basename(name_buf)) >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s\n", store_path);
+        return -1;
+    }
+    if ((mkdir(NIX_STORE_PATH "/.nix-db", 0755) != 0 && errno != EEXIST) ||
+        (mkdir(STORE_LOCKS_DIR, 0755) != 0 && errno != EEXIST)) {
+        fprintf(stderr, "Failed to create %s: %s\n", STORE_LOCKS_DIR, strerror(errno));
+        return -1;
+    }
+    int fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open lock %s: %s\n", lock_path, strerror(errno));
+        return -1;
+    }
+    struct flock fl = {0};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) == -1) {
+        if (errno == EINTR) continue;
+        if (wait) fprintf(stderr, "Failed to lock %s: %s\n", lock_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void store_path_unlock(int fd) {
+    if (fd != -1) close(fd); // Closing releases the lock
+}
+
+// A batch of adds registered in one transaction (add_boot_libraries).
+// Each added path stays locked until the batch commits, or another add
+// would find its directory unregistered and remove it as stale; to bound
+// the open lock files, a full batch is committed and a new one begun.
+#define ADD_BATCH_MAX 256
+static struct {
+    int active;
+    int locks[ADD_BATCH_MAX];
+    int count;
+} add_batch;
+
+static int add_batch_begin(void) {
+    if (db_txn_begin() != 0) return -1;
+    add_batch.active = 1;
+    return 0;
+}
+
+static int add_batch_commit(void) {
+    int ret = db_txn_commit();
+    for (int i = 0; i < add_batch.count; i++) {
+        store_path_unlock(add_batch.locks[i]);
+    }
+    add_batch.count = 0;
+    add_batch.active = 0;
+    return ret;
+}
+
+// Start a new batch once this one is full
+static int add_batch_checkpoint(void) {
+    if (add_batch.count < ADD_BATCH_MAX) return 0;
+    if (add_batch_commit() != 0) return -1;
+    return add_batch_begin();
+}
+
+// Release the lock of a path just added, or keep it for the batch
+static void add_release_lock(int fd) {
+    if (add_batch.active && add_batch.count < ADD_BATCH_MAX) {
+        add_batch.locks[add_batch.count++] = fd;
+        return;
+    }
+    store_path_unlock(fd);
+}
+
+// Register a newly added path with its references and hash in one
+// transaction
+static int register_added_path(const char* store_path, const char** references, const char* hash_str) {
+    if (db_txn_begin() != 0) {
+        fprintf(stderr, "Failed to start a database transaction for %s\n", store_path);
+        return -1;
+    }
+    if (db_register_path(store_path, references) != 0) {
+        fprintf(stderr, "Failed to register %s in database\n", store_path);
+        db_txn_abort();
+        return -1;
+    }
+    if (db_store_hash(store_path, hash_str) != 0) {
+        fprintf(stderr, "Failed to store hash for %s\n", store_path);
+        db_txn_abort();
+        return -1;
+    }
+    if (db_txn_commit() != 0) {
+        fprintf(stderr, "Failed to commit database entry for %s\n", store_path);
+        return -1;
+    }
+    return 0;
+}
+
 // Add a file or directory to the store with explicit dependencies
 int add_to_store_with_deps(const char* source_path, const char* name, const char** deps, int deps_count) {
     struct stat st;
@@ -167,8 +324,21 @@ int add_to_store_with_deps(const char* source_path, const char* name, const char
         dep_store_paths[deps_count] = NULL; // NULL-terminate
     }
 
-    // Now compute the store path for this item, including references to dependencies
-    char* store_path = compute_store_path(name, NULL, (const char**)dep_store_paths);
+    // Now compute the store path for this item, including references to
+    // dependencies. Content-addressed paths hash the contents instead of
+    // the name, so unchanged inputs map to the path they were added as.
+    char content_hash[SHA256_DIGEST_STRING_LENGTH] = "";
+    int content_addressed = config_get()->store.content_addressed;
+    if (content_addressed && hash_store_contents(source_path, &st, content_hash) != 0) {
+        fprintf(stderr, "Failed to hash %s\n", source_path);
+        if (dep_store_paths) {
+            for (int i = 0; i < deps_count; i++) free(dep_store_paths[i]);
+            free(dep_store_paths);
+        }
+        return -1;
+    }
+    char* store_path = compute_store_path(name, content_addressed ? content_hash : NULL,
+                                          (const char**)dep_store_paths);
     if (!store_path) {
         if (dep_store_paths) {
             for (int i = 0; i < deps_count; i++) {
@@ -180,51 +350,68 @@ int add_to_store_with_deps(const char* source_path, const char* name, const char
         return -1;
     }
 
-    // Check if the path already exists in the store
+    // Adds of the same path run one at a time, so a directory found
+    // without its lock held is not being written by anyone
+    int path_lock = store_path_lock(store_path, 1);
+    if (path_lock == -1) {
+        free(store_path);
+        if (dep_store_paths) {
+            for (int i = 0; i < deps_count; i++) free(dep_store_paths[i]);
+            free(dep_store_paths);
+        }
+        return -1;
+    }
+
+    // A directory the database does not record was left by an add that
+    // was interrupted before it registered the path (possibly a whole
+    // batch, see add_boot_libraries). A content-addressed path only counts
+    // as present if it is recorded with the hash it is named after. Either
+    // way the directory is removed and the path added afresh.
     struct stat store_st;
+    const char* stale = NULL;
     if (stat(store_path, &store_st) == 0) {
-        printf("Path %s already exists in store.\n", store_path);
-
-        // Path exists but make sure it has a hash
-        char* existing_hash = db_get_hash(store_path);
-        if (!existing_hash) {
-            // No hash stored, compute and store it
-            SHA256_CTX ctx;
-            sha256_init(&ctx);
-            char hash_str[SHA256_DIGEST_STRING_LENGTH];
-            
-            // Compute hash for existing store path
-            if (S_ISDIR(store_st.st_mode)) {
-                // ... existing directory hash code ...
-            } else {
-                char bin_path[PATH_MAX];
-                snprintf(bin_path, PATH_MAX, "%s/bin/%s", store_path, basename((char*)source_path));
-                FILE* f = fopen(bin_path, "rb");
-                if (f) {
-                    // Hash contents
-                    uint8_t buffer[4096];
-                    size_t bytes;
-                    while ((bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-                        sha256_update(&ctx, buffer, bytes);
-                    }
-                    uint8_t hash[SHA256_BLOCK_SIZE];
-                    sha256_final(&ctx, hash);
-                    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
-                        sprintf(hash_str + (i * 2), "%02x", hash[i]);
-                    }
-                    hash_str[SHA256_DIGEST_STRING_LENGTH - 1] = 0;
-                    db_store_hash(store_path, hash_str);
-                    fclose(f);
-                }
+        if (!db_path_exists(store_path)) {
+            stale = "left incomplete by an interrupted add";
+        } else if (content_addressed) {
+            const char* recorded = db_peek_hash(store_path);
+            if (!recorded || strcmp(recorded, content_hash) != 0) stale = "not recorded with its contents' hash";
+        }
+    }
+    if (stale) {
+        printf("Removing %s, %s\n", store_path, stale);
+        store_manifest_remove(store_path);
+        if (store_remove_tree(store_path) != 0) {
+            fprintf(stderr, "Failed to remove store path %s\n", store_path);
+            store_path_unlock(path_lock);
+            free(store_path);
+            if (dep_store_paths) {
+                for (int i = 0; i < deps_count; i++) free(dep_store_paths[i]);
+                free(dep_store_paths);
             }
-        } else {
-            free(existing_hash);
+            return -1;
         }
+    }
+
+    // Check if the path already exists in the store
+    if (stat(store_path, &store_st) == 0) {
+        printf("Path %s already exists in store.\n", store_path);
 
-        // Just register dependencies for existing path
+        // Register dependencies for the existing path, and make sure it
+        // has a hash; both are committed together
+        int in_txn = db_txn_begin() == 0;
         if (deps_count > 0 && dep_store_paths != NULL) {
             db_register_path(store_path, (const char**)dep_store_paths);
         }
+        const char* existing_hash = db_peek_hash(store_path);
+        if (!existing_hash || !*existing_hash) {
+            char hash_str[SHA256_DIGEST_STRING_LENGTH];
+            if (nar_hash_path(store_path, hash_str) == 0) {
+                db_store_hash(store_path, hash_str);
+            }
+        }
+        if (in_txn) db_txn_commit();
+        add_release_lock(path_lock);
+        register_provided_libraries(store_path);
 
         free(store_path);
         if (dep_store_paths) {
@@ -240,6 +427,7 @@ int add_to_store_with_deps(const char* source_path, const char* name, const char
     if (mkdir(store_path, 0755) == -1) {
          if (errno != EEXIST) {
             fprintf(stderr, "Failed to create store directory %s: %s\n", store_path, strerror(errno));
+            store_path_unlock(path_lock);
             free(store_path);
             if (dep_store_paths) {
                 for (int i = 0; i < deps_count; i++) if(dep_store_paths[i]) free(dep_store_paths[i]);
@@ -250,257 +438,130 @@ int add_to_store_with_deps(const char* source_path, const char* name, const char
     }
 
 
-    // Copy the file/directory to the store
-    //char dest_path_in_store[PATH_MAX]; // Used for single file copy
-    int copy_len;
+    // Copy the file/directory to the store. Files are hashed as they are
+    // copied, so the store path is hashed without reading them back;
+    // reflinked and hardlinked files are hashed afterwards instead.
+    const char* ingest_name = config_get()->store.ingest_mode;
+    int ingest_mode = store_ingest_mode_parse(ingest_name);
+    if (ingest_mode < 0) ingest_mode = STORE_INGEST_COPY;
+    const char* ingest_verb = ingest_mode == STORE_INGEST_REFLINK ? "Reflinking" :
+                              ingest_mode == STORE_INGEST_HARDLINK ? "Hardlinking" : "Copying";
+    CopyDigests copied;
+    copy_digests_init(&copied);
+    int copy_ret;
+    // Hardlinked files must already be as sealing leaves them
+    mode_t seal_perms = config_get()->store.store_path_permissions;
+    int seal_flags = store_seal_flags();
 
     if (S_ISDIR(st.st_mode)) {
-        // Copy the directory content *into* the store path
-        char cmd[PATH_MAX * 3];
-        // Use cp -rP to copy recursively, preserving symlinks. Copy contents using trailing /.
-        // Check command length before executing
-        copy_len = snprintf(cmd, sizeof(cmd), "cp -rP %s/. %s/", source_path, store_path);
-        if(copy_len < 0 || copy_len >= sizeof(cmd)) {
-             fprintf(stderr, "Error: Copy command exceeds buffer size for source %s\n", source_path);
-             // Attempt cleanup before returning
-             rmdir(store_path); // May fail if not empty
-             free(store_path);
-             if (dep_store_paths) {
-                for (int i = 0; i < deps_count; i++) if(dep_store_paths[i]) free(dep_store_paths[i]);
-                free(dep_store_paths);
-             }
-             return -1;
-        }
-
-        printf("Executing: %s\n", cmd);
-        int ret = system(cmd);
-        if (ret != 0) {
-            fprintf(stderr, "Failed to copy directory contents %s to %s (system returned %d)\n", source_path, store_path, ret);
-            // Consider recursive remove on failure
-            char rm_cmd[PATH_MAX + 10];
-            snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", store_path);
-            system(rm_cmd); // Attempt cleanup
-            free(store_path);
-            if (dep_store_paths) {
-                 for (int i = 0; i < deps_count; i++) if(dep_store_paths[i]) free(dep_store_paths[i]);
-                 free(dep_store_paths);
-            }
-            return -1;
-        }
-    } else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
-        // Modified file handling
+        printf("%s %s/ to %s/\n", ingest_verb, source_path, store_path);
+        copy_ret = store_ingest_tree(source_path, store_path, &copied, ingest_mode, seal_perms, seal_flags);
+    } else if (S_ISREG(st.st_mode)) {
+        // Files go to bin/<name>
         char bin_dir[PATH_MAX];
         snprintf(bin_dir, PATH_MAX, "%s/bin", store_path);
-        mkdir(bin_dir, 0755);  // Create bin directory
-        
+        mkdir(bin_dir, 0755);
+
         char dest_path[PATH_MAX];
         int ret_val = snprintf(dest_path, PATH_MAX, "%s/bin/%s", store_path, basename((char*)source_path));
         if (ret_val < 0 || ret_val >= PATH_MAX) {
             fprintf(stderr, "Error: Destination path too long for %s\n", source_path);
-            rmdir(bin_dir);
-            rmdir(store_path);
-            free(store_path);
-            if (dep_store_paths) {
-                for (int i = 0; i < deps_count; i++) if(dep_store_paths[i]) free(dep_store_paths[i]);
-                free(dep_store_paths);
-            }
-            return -1;
-        }
-
-        // Special handling for files from /proc/boot
-        char cmd[PATH_MAX * 3];
-        if (strncmp(source_path, "/proc/boot/", 11) == 0) {
-            // Use dd for boot files to preserve all attributes
-            copy_len = snprintf(cmd, sizeof(cmd), 
-                    "dd if=%s of=%s bs=4096 conv=sync,noerror 2>/dev/null && chmod 755 %s", 
-                    source_path, dest_path, dest_path);
+            copy_ret = -1;
         } else {
-            // Normal file copy for other files
-            copy_len = snprintf(cmd, sizeof(cmd), "cp -P %s %s", source_path, dest_path);
-        }
-
-        if(copy_len < 0 || copy_len >= sizeof(cmd)) {
-            fprintf(stderr, "Error: Copy command exceeds buffer size for source %s\n", source_path);
-            rmdir(store_path);
-            free(store_path);
-            if (dep_store_paths) {
-                for (int i = 0; i < deps_count; i++) if(dep_store_paths[i]) free(dep_store_paths[i]);
-                free(dep_store_paths);
-            }
-            return -1;
-        }
-
-        printf("Executing: %s\n", cmd);
-        int ret = system(cmd);
-        if (ret != 0) {
-            fprintf(stderr, "Failed to copy file %s to %s (system returned %d)\n", 
-                    source_path, dest_path, ret);
-            char rm_cmd[PATH_MAX + 10];
-            snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", store_path);
-            system(rm_cmd);
-            free(store_path);
-            if (dep_store_paths) {
-                for (int i = 0; i < deps_count; i++) if(dep_store_paths[i]) free(dep_store_paths[i]);
-                free(dep_store_paths);
-            }
-            return -1;
+            printf("%s %s to %s\n", ingest_verb, source_path, dest_path);
+            copy_ret = store_ingest_file(source_path, dest_path, 0755, &copied, ingest_mode, seal_perms, seal_flags);
         }
-
-        // Verify the copied file exists and is executable
-        struct stat st_copy;
-        if (stat(dest_path, &st_copy) != 0 || !S_ISREG(st_copy.st_mode)) {
-            fprintf(stderr, "Failed to verify copied file %s\n", dest_path);
-            rmdir(store_path);
-            free(store_path);
-            if (dep_store_paths) {
-                for (int i = 0; i < deps_count; i++) if(dep_store_paths[i]) free(dep_store_paths[i]);
-                free(dep_store_paths);
-            }
-            return -1;
-        }
-
-        // Always ensure the file is executable
-        chmod(dest_path, 0755);
     } else {
-         fprintf(stderr, "Unsupported file type for source path: %s\n", source_path);
-         rmdir(store_path); // Simple cleanup attempt
-         free(store_path);
-         if (dep_store_paths) {
+        fprintf(stderr, "Unsupported file type for source path: %s\n", source_path);
+        copy_ret = -1;
+    }
+
+    // Make the store path read-only first; one left writable is not added
+    if (copy_ret != 0) {
+        fprintf(stderr, "Failed to copy %s to %s\n", source_path, store_path);
+    } else if (make_store_path_read_only(store_path) != 0) {
+        copy_ret = -1;
+    }
+    if (copy_ret != 0) {
+        copy_digests_free(&copied);
+        store_remove_tree(store_path); // Attempt cleanup
+        store_path_unlock(path_lock);
+        free(store_path);
+        if (dep_store_paths) {
             for (int i = 0; i < deps_count; i++) if(dep_store_paths[i]) free(dep_store_paths[i]);
             free(dep_store_paths);
-         }
-         return -1;
+        }
+        return -1;
     }
 
-    // Make the store path read-only first
-    make_store_path_read_only(store_path);
-
     // Compute and store hash
-    SHA256_CTX ctx;
-    sha256_init(&ctx);
     char hash_str[SHA256_DIGEST_STRING_LENGTH];
-    int hash_success = 0;
-
-    // For regular files, we need to hash bin/<name>
-    if (S_ISREG(st.st_mode)) {
-        char bin_path[PATH_MAX];
-        snprintf(bin_path, PATH_MAX, "%s/bin/%s", store_path, basename((char*)source_path));
-        FILE* f = fopen(bin_path, "rb");
-        if (f) {
-            // First hash the relative path for consistency
-            const char* rel_path = "bin/";
-            sha256_update(&ctx, (uint8_t*)rel_path, strlen(rel_path));
-            rel_path = basename((char*)source_path);
-            sha256_update(&ctx, (uint8_t*)rel_path, strlen(rel_path));
-
-            // Then hash file contents
-            uint8_t buffer[4096];
-            size_t bytes;
-            while ((bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-                sha256_update(&ctx, buffer, bytes);
-            }
-            uint8_t hash[SHA256_BLOCK_SIZE];
-            sha256_final(&ctx, hash);
-            for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
-                sprintf(hash_str + (i * 2), "%02x", hash[i]);
-            }
-            hash_str[SHA256_DIGEST_STRING_LENGTH - 1] = 0;
-            hash_success = 1;
-            fclose(f);
-        }
-    } else if (S_ISDIR(st.st_mode)) {
-        // For directories, first get sorted list of all files
-        char* file_list[1024];
-        int file_count = 0;
-        
-        // Helper to collect files recursively 
-        void collect_files(const char* dir_path) {
-            DIR* dir = opendir(dir_path);
-            if (!dir) return;
-            
-            struct dirent* entry;
-            while ((entry = readdir(dir)) != NULL && file_count < 1024) {
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                    continue;
-                    
-                char full_path[PATH_MAX];
-                snprintf(full_path, PATH_MAX, "%s/%s", dir_path, entry->d_name);
-                
-                struct stat st;
-                if (stat(full_path, &st) != 0) continue;
-                
-                if (S_ISDIR(st.st_mode)) {
-                    collect_files(full_path);
-                } else if (S_ISREG(st.st_mode)) {
-                    // Store relative path for consistent hashing
-                    file_list[file_count++] = strdup(full_path + strlen(store_path) + 1);
-                }
-            }
-            closedir(dir);
-        }
-        
-        // Get all file paths
-        collect_files(store_path);
-        
-        // Sort paths for consistent hash
-        for (int i = 0; i < file_count - 1; i++) {
-            for (int j = i + 1; j < file_count; j++) {
-                if (strcmp(file_list[i], file_list[j]) > 0) {
-                    char* temp = file_list[i];
-                    file_list[i] = file_list[j];
-                    file_list[j] = temp;
-                }
-            }
-        }
-        
-        // Hash each file in sorted order
-        for (int i = 0; i < file_count; i++) {
-            // Add relative path to hash
-            sha256_update(&ctx, (uint8_t*)file_list[i], strlen(file_list[i]));
-            
-            // Add file contents
-            char full_path[PATH_MAX];
-            snprintf(full_path, PATH_MAX, "%s/%s", store_path, file_list[i]);
-            
-            FILE* f = fopen(full_path, "rb");
-            if (f) {
-                uint8_t buffer[4096];
-                size_t bytes;
-                while ((bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-                    sha256_update(&ctx, buffer, bytes);
-                }
-                fclose(f);
-            }
-            free(file_list[i]);
+    HashCachePending hashed = {0};
+    NarManifest manifest = {0};
+    int hash_success = nar_hash_path_manifest(store_path, copy_digests_lookup, &copied,
+                                              hash_cache_record, &hashed, NULL, NULL, &manifest, hash_str) == 0;
+
+    // The copy must have the contents the path was named after
+    if (hash_success && content_addressed && strcmp(hash_str, content_hash) != 0) {
+        fprintf(stderr, "Error: %s changed while it was being added\n", source_path);
+        copy_digests_free(&copied);
+        hash_cache_pending_free(&hashed);
+        nar_manifest_free(&manifest);
+        store_remove_tree(store_path);
+        store_path_unlock(path_lock);
+        free(store_path);
+        if (dep_store_paths) {
+            for (int i = 0; i < deps_count; i++) free(dep_store_paths[i]);
+            free(dep_store_paths);
         }
-        
-        // Finalize hash
-        uint8_t hash[SHA256_BLOCK_SIZE];
-        sha256_final(&ctx, hash);
-        for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
-            sprintf(hash_str + (i * 2), "%02x", hash[i]);
+        return -1;
+    }
+
+    // Share identical files with the rest of the store, reusing the digests
+    if (hash_success && config_get()->store.auto_optimise) {
+        OptimiseStats stats;
+        memset(&stats, 0, sizeof(stats));
+        if (store_optimise_path(store_path, &copied, &stats) != 0) {
+            fprintf(stderr, "Warning: Failed to optimise %s\n", store_path);
+        } else if (stats.files_linked > 0) {
+            printf("Linked %llu files to identical ones in the store, saving %llu bytes\n",
+                   (unsigned long long)stats.files_linked, (unsigned long long)stats.bytes_saved);
         }
-        hash_str[SHA256_DIGEST_STRING_LENGTH - 1] = 0;
-        hash_success = 1;
     }
+    copy_digests_free(&copied);
 
-    // Register in database and store hash in one atomic operation
-    if (hash_success) {
+    // Register in database and store hash in one atomic operation. A path
+    // that cannot be registered must not stay behind, as nothing would
+    // record it.
+    if (!hash_success) {
+        fprintf(stderr, "Failed to hash %s\n", store_path);
+    } else {
         printf("Registering path and storing hash for %s: %s\n", store_path, hash_str);
-        
-        // First register the path
-        if (db_register_path(store_path, (const char**)dep_store_paths) != 0) {
-            fprintf(stderr, "Failed to register %s in database\n", store_path);
-            return -1;
+    }
+    if (!hash_success || register_added_path(store_path, (const char**)dep_store_paths, hash_str) != 0) {
+        hash_cache_pending_free(&hashed);
+        nar_manifest_free(&manifest);
+        store_remove_tree(store_path);
+        store_path_unlock(path_lock);
+        free(store_path);
+        if (dep_store_paths) {
+            for (int i = 0; i < deps_count; i++) free(dep_store_paths[i]);
+            free(dep_store_paths);
         }
+        return -1;
+    }
 
-        // Then immediately store its hash
-        if (db_store_hash(store_path, hash_str) != 0) {
-            fprintf(stderr, "Failed to store hash for %s\n", store_path);
-            return -1;
-        }
+    // Verify can trust these digests until the files change, and
+    // locate damaged files with the manifest
+    hash_cache_append(&hashed);
+    if (store_manifest_write(store_path, &manifest) != 0) {
+        fprintf(stderr, "Warning: Failed to write the manifest of %s\n", store_path);
     }
+    hash_cache_pending_free(&hashed);
+    nar_manifest_free(&manifest);
+    add_release_lock(path_lock);
 
+    register_provided_libraries(store_path);
     printf("Added %s to store (%s) with %d dependencies\n", name, store_path, deps_count);
 
     // Clean up
@@ -524,25 +585,23 @@ int add_to_store(const char* source_path, const char* name, int recursive) {
 }
 
 
-// Make a store path read-only (recursively)
+// Make a store path read-only (recursively); -1 if any entry could not
+// be sealed
 int make_store_path_read_only(const char* path) {
-    // Use system command `chmod -R a-w,a+rX` for simplicity and correctness
-    char cmd[PATH_MAX + 50];
-    int cmd_len = snprintf(cmd, sizeof(cmd), "chmod -R a-w,a+rX %s", path);
-     if (cmd_len < 0 || cmd_len >= sizeof(cmd)) {
-        fprintf(stderr, "Warning: Chmod command exceeds buffer size for path %s\n", path);
-        return 0; // Continue, but log warning
-    }
-    printf("Executing: %s\n", cmd);
-    int ret = system(cmd);
-    if (ret != 0) {
-         fprintf(stderr, "Warning: Failed to make path read-only %s (system returned %d)\n", path, ret);
+    int flags = store_seal_flags();
+    if (!flags) return 0;
+
+    if (store_seal_tree(path, config_get()->store.store_path_permissions, flags) != 0) {
+        fprintf(stderr, "Failed to seal store path %s\n", path);
+        return -1;
     }
-    return 0; // Indicate success even on chmod warning for now
+    return 0;
 }
 
-// Verify a store path
-int verify_store_path(const char* path) {
+// Verify a store path (flags: STORE_VERIFY_*). A path with a manifest is
+// checked file by file; others are hashed whole and given a manifest if
+// they match.
+int verify_store_path(const char* path, int flags, int jobs, const char* repair_from) {
     // Check if path exists and is in store
     struct stat st;
     if (stat(path, &st) == -1) {
@@ -564,16 +623,556 @@ int verify_store_path(const char* path) {
         return -1;
     }
 
+    const char* stored = db_peek_hash(path);
+    if (stored && *stored && db_get_hash_format(path) == DB_HASH_CANONICAL) {
+        char stored_hash[SHA256_DIGEST_STRING_LENGTH];
+        snprintf(stored_hash, sizeof(stored_hash), "%s", stored);
+        int result = store_manifest_verify(path, stored_hash, flags, jobs, repair_from);
+        if (result == STORE_MANIFEST_INTACT) {
+            printf("Path %s verified successfully.\n", path);
+            return 0;
+        }
+        if (result != STORE_MANIFEST_UNUSABLE) {
+            fprintf(stderr, "Verify failed: Path %s has damaged files.\n", path);
+            return -1;
+        }
+    }
+    if (flags & STORE_VERIFY_REPAIR) {
+        fprintf(stderr, "Warning: %s has no usable manifest, so damaged files cannot be located or repaired\n", path);
+    }
+
     // Verify path contents match stored hash
-    if (db_verify_path_hash(path) != 0) {
+    NarManifest manifest = {0};
+    if (db_verify_path_hash(path, flags & STORE_VERIFY_DEEP, &manifest) != 0) {
         fprintf(stderr, "Verify failed: Path %s contents do not match stored hash.\n", path);
+        nar_manifest_free(&manifest);
         return -1;
     }
+    // The next verify can then go file by file
+    if (manifest.count > 0 && store_manifest_write(path, &manifest) != 0) {
+        fprintf(stderr, "Warning: Failed to write the manifest of %s\n", path);
+    }
+    nar_manifest_free(&manifest);
 
     printf("Path %s verified successfully.\n", path);
     return 0;
 }
 
+// One registered path to verify, with its hash copied out of the database
+typedef struct {
+    char* path;
+    char hash[SHA256_DIGEST_STRING_LENGTH];
+    int format;
+    int ok;
+    char upgraded[SHA256_DIGEST_STRING_LENGTH];  // Canonical hash replacing a legacy one, or ""
+    HashCachePending pending;  // File digests, added to the cache if ok
+} VerifyJob;
+
+// Work shared by the verify-all workers; lock guards next, the counters
+// and output
+typedef struct {
+    VerifyJob* jobs;
+    size_t count;
+    size_t capacity;
+    size_t next;
+    size_t done;
+    size_t ok;
+    size_t failed;
+    size_t missing;
+    size_t unhashed;
+    size_t files;
+    size_t files_cached;
+    HashCache* cache;  // Only read while the workers run
+    int deep;
+    FILE* checkpoint;  // Each finished path is appended, may be NULL
+    char** resumed;    // Paths finished by an interrupted run, sorted
+    size_t resumed_count;
+    const VerifySample* sample;  // NULL: verify everything
+    size_t unsampled;       // Paths without a manifest to sample files from
+    size_t sampled;         // Files (or paths) the sample checked
+    size_t population;      // Files of the sampled paths (or all paths)
+    size_t sample_damaged;
+    pthread_mutex_t lock;
+} VerifyPool;
+
+#define VERIFY_MAX_JOBS 64
+#define VERIFY_THREAD_STACK (1024 * 1024)  // nar.c recursion keeps PATH_MAX buffers per level
+
+// Progress of a verify-all run, so an interrupted one can resume: a
+// header line, then "<status>\t<path>" for each path as it finishes.
+// Removed once a run completes.
+#define VERIFY_CHECKPOINT NIX_STORE_PATH "/.nix-db/verify-checkpoint"
+#define VERIFY_CHECKPOINT_MAGIC "qnix-verify-checkpoint 1"
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Read the checkpoint of an interrupted run, adding its results to the
+// pool's counters; pool->resumed lists its paths. A missing checkpoint
+// resumes nothing.
+static void load_verify_checkpoint(VerifyPool* pool) {
+    FILE* f = fopen(VERIFY_CHECKPOINT, "r");
+    if (!f) return;
+    char line[PATH_MAX + 32];
+    size_t capacity = 0;
+    int valid = fgets(line, sizeof(line), f) && strcmp(line, VERIFY_CHECKPOINT_MAGIC "\n") == 0;
+    while (valid && fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        char* tab = strchr(line, '\t');
+        // A line cut short by the interruption is not a result
+        if (len == 0 || line[len - 1] != '\n' || !tab) continue;
+        line[len - 1] = '\0';
+        *tab = '\0';
+        // Paths removed since are not counted
+        if (!db_path_exists(tab + 1)) continue;
+
+        if (pool->resumed_count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            char** grown = realloc(pool->resumed, capacity * sizeof(char*));
+            if (!grown) break;
+            pool->resumed = grown;
+        }
+        if (!(pool->resumed[pool->resumed_count] = strdup(tab + 1))) break;
+        pool->resumed_count++;
+        if (strcmp(line, "OK") == 0) pool->ok++;
+        else if (strcmp(line, "MISSING") == 0) pool->missing++;
+        else if (strcmp(line, "NO HASH") == 0) pool->unhashed++;
+        else pool->failed++;
+    }
+    fclose(f);
+    qsort(pool->resumed, pool->resumed_count, sizeof(char*), compare_paths);
+}
+
+static int collect_verify_job(const char* path, void* arg) {
+    VerifyPool* pool = arg;
+    if (pool->resumed_count > 0 &&
+        bsearch(&path, pool->resumed, pool->resumed_count, sizeof(char*), compare_paths)) {
+        return 0;
+    }
+    if (pool->count == pool->capacity) {
+        size_t capacity = pool->capacity ? pool->capacity * 2 : 256;
+        VerifyJob* jobs = realloc(pool->jobs, capacity * sizeof(VerifyJob));
+        if (!jobs) return -1;
+        pool->jobs = jobs;
+        pool->capacity = capacity;
+    }
+    VerifyJob* job = &pool->jobs[pool->count];
+    memset(job, 0, sizeof(*job));
+    if (!(job->path = strdup(path))) return -1;
+    const char* hash = db_peek_hash(path);
+    snprintf(job->hash, sizeof(job->hash), "%s", hash ? hash : "");
+    job->format = db_get_hash_format(path);
+    pool->count++;
+    return 0;
+}
+
+// One item of a sample and its rank; the lowest ranked are taken
+typedef struct {
+    uint64_t rank;
+    size_t index;
+} SampleItem;
+
+// Rank of a path in a sample: a keyed hash, so the same seed picks the
+// same paths and files whatever order they are visited in
+static uint64_t sample_rank(uint64_t seed, const char* path) {
+    uint64_t h = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+    for (; *path; path++) h = (h ^ (unsigned char)*path) * 0x100000001b3ull;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+static int compare_sample_items(const void* a, const void* b) {
+    const SampleItem* x = a;
+    const SampleItem* y = b;
+    if (x->rank != y->rank) return x->rank < y->rank ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int compare_indices(const void* a, const void* b) {
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Items a sample of percent takes from population: rounded up, so any
+// nonempty population gives at least one
+static size_t sample_size(size_t population, double percent) {
+    double exact = (double)population * percent / 100.0;
+    size_t n = (size_t)exact;
+    if ((double)n < exact) n++;
+    return n < population ? n : population;
+}
+
+// Files of one store path checked by sampling
+typedef struct {
+    const char** problems;  // Per manifest entry, set for damaged files
+    size_t sampled;
+    size_t files;
+    long damaged;
+} PathSample;
+
+// Check a sample of the regular files of job's path against its manifest,
+// which is only trusted while it matches the stored hash. Returns the
+// status to report.
+static const char* sample_path_files(const VerifySample* sample, const VerifyJob* job,
+                                     NarManifest* recorded, PathSample* out) {
+    char manifest_hash[SHA256_DIGEST_STRING_LENGTH];
+    if (job->format != DB_HASH_CANONICAL || store_manifest_load(job->path, recorded) != 0 ||
+        nar_manifest_hash(recorded, manifest_hash) != 0 || strcmp(manifest_hash, job->hash) != 0) {
+        return "UNSAMPLED";
+    }
+
+    size_t n = recorded->count ? recorded->count : 1;
+    SampleItem* items = malloc(n * sizeof(SampleItem));
+    size_t* entries = malloc(n * sizeof(size_t));
+    out->problems = calloc(n, sizeof(char*));
+    if (!items || !entries || !out->problems) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(items);
+        free(entries);
+        return "UNREADABLE";
+    }
+    for (size_t i = 0; i < recorded->count; i++) {
+        const NarManifestEntry* e = &recorded->entries[i];
+        char full[PATH_MAX];
+        if (e->type != S_IFREG) continue;
+        snprintf(full, PATH_MAX, "%s/%s", job->path, e->path);
+        items[out->files].rank = sample_rank(sample->seed, full);
+        items[out->files].index = i;
+        out->files++;
+    }
+    qsort(items, out->files, sizeof(SampleItem), compare_sample_items);
+    out->sampled = sample_size(out->files, sample->percent);
+    for (size_t i = 0; i < out->sampled; i++) entries[i] = items[i].index;
+    // Read in manifest order, which follows the directory tree
+    qsort(entries, out->sampled, sizeof(size_t), compare_indices);
+
+    out->damaged = store_manifest_check_files(job->path, recorded, entries, out->sampled, out->problems);
+    free(items);
+    free(entries);
+    return out->damaged < 0 ? "UNREADABLE" : out->damaged > 0 ? "FAILED" : "OK";
+}
+
+static void* verify_worker(void* arg) {
+    VerifyPool* pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next == pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        VerifyJob* job = &pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        const char* status;
+        struct stat st;
+        char current_hash[SHA256_DIGEST_STRING_LENGTH];
+        HashCacheLookup lookup = { pool->cache, 0 };
+        NarManifest current = {0}, recorded = {0};
+        PathSample sample = {0};
+        int canonical = job->format == DB_HASH_CANONICAL;
+        int sampling_files = pool->sample && !pool->sample->paths;
+        if (!job->hash[0]) {
+            status = "NO HASH";
+        } else if (lstat(job->path, &st) != 0) {
+            status = "MISSING";
+        } else if (sampling_files) {
+            status = sample_path_files(pool->sample, job, &recorded, &sample);
+        } else {
+            int ret = canonical
+                ? nar_hash_path_manifest(job->path, pool->deep ? NULL : hash_cache_lookup, &lookup,
+                                         hash_cache_record, &job->pending, io_throttle_read, NULL,
+                                         &current, current_hash)
+                : nar_hash_path_legacy(job->path, io_throttle_read, NULL, current_hash);
+            status = ret != 0 ? "UNREADABLE" : strcmp(current_hash, job->hash) == 0 ? "OK" : "FAILED";
+        }
+        job->ok = strcmp(status, "OK") == 0;
+
+        // A legacy hash that still matches gives way to the canonical one,
+        // stored once the workers are done, so the path is verified file
+        // by file from now on
+        if (job->ok && !canonical && !sampling_files &&
+            nar_hash_path_manifest(job->path, NULL, NULL, hash_cache_record, &job->pending,
+                                   io_throttle_read, NULL, &current, job->upgraded) != 0) {
+            job->upgraded[0] = '\0';
+        }
+
+        // The manifest names the damaged files of a failed path; an intact
+        // path without a usable one gets one
+        int have_manifest = 0;
+        if (!sampling_files && canonical && (job->ok || strcmp(status, "FAILED") == 0) &&
+            store_manifest_load(job->path, &recorded) == 0) {
+            char manifest_hash[SHA256_DIGEST_STRING_LENGTH];
+            have_manifest = nar_manifest_hash(&recorded, manifest_hash) == 0 &&
+                            strcmp(manifest_hash, job->hash) == 0;
+        }
+        if (!sampling_files && job->ok && (canonical || job->upgraded[0]) && !have_manifest) store_manifest_write(job->path, &current);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->files += job->pending.count;
+        pool->files_cached += lookup.hits;
+        pool->done++;
+        if (strcmp(status, "OK") == 0) pool->ok++;
+        else if (strcmp(status, "MISSING") == 0) pool->missing++;
+        else if (strcmp(status, "NO HASH") == 0) pool->unhashed++;
+        else if (strcmp(status, "UNSAMPLED") == 0) pool->unsampled++;
+        else pool->failed++;
+        pool->sampled += sample.sampled;
+        pool->population += sample.files;
+        if (sample.damaged > 0) pool->sample_damaged += (size_t)sample.damaged;
+        printf("[%zu/%zu] %-10s %s\n", pool->done, pool->count, status, job->path);
+        if (!job->ok && have_manifest) store_manifest_diff(&recorded, &current, "      ");
+        for (size_t i = 0; sample.problems && i < recorded.count; i++) {
+            const char* name = *recorded.entries[i].path ? recorded.entries[i].path : ".";
+            if (sample.problems[i]) printf("      %s: %s\n", name, sample.problems[i]);
+        }
+        fflush(stdout);
+        if (pool->checkpoint) {
+            fprintf(pool->checkpoint, "%s\t%s\n", status, job->path);
+            fflush(pool->checkpoint);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        free(sample.problems);
+        nar_manifest_free(&current);
+        nar_manifest_free(&recorded);
+    }
+    return NULL;
+}
+
+static int compare_job_paths(const void* a, const void* b) {
+    return strcmp(((const VerifyJob*)a)->path, ((const VerifyJob*)b)->path);
+}
+
+// Keep only a sample of the collected jobs, in path order
+static int sample_verify_jobs(VerifyPool* pool) {
+    size_t keep = sample_size(pool->count, pool->sample->percent);
+    SampleItem* items = malloc((pool->count ? pool->count : 1) * sizeof(SampleItem));
+    VerifyJob* kept = malloc((keep ? keep : 1) * sizeof(VerifyJob));
+    if (!items || !kept) {
+        free(items);
+        free(kept);
+        return -1;
+    }
+    for (size_t i = 0; i < pool->count; i++) {
+        items[i].rank = sample_rank(pool->sample->seed, pool->jobs[i].path);
+        items[i].index = i;
+    }
+    qsort(items, pool->count, sizeof(SampleItem), compare_sample_items);
+    for (size_t i = 0; i < pool->count; i++) {
+        if (i < keep) kept[i] = pool->jobs[items[i].index];
+        else free(pool->jobs[items[i].index].path);
+    }
+    qsort(kept, keep, sizeof(VerifyJob), compare_job_paths);
+    free(items);
+    free(pool->jobs);
+    pool->population = pool->count;
+    pool->sampled = keep;
+    pool->jobs = kept;
+    pool->count = pool->capacity = keep;
+    return 0;
+}
+
+// Print what a sample says about all the items it was drawn from. With no
+// damage found that is the 95% upper confidence bound: the most damaged
+// items a sample this size, drawn without replacement, would still miss
+// more than 5% of the time. Per-path file samples are treated as one draw
+// from all their files, which holds while damage is spread evenly.
+static void report_sample(size_t sampled, size_t population, size_t damaged, const char* what,
+                          uint64_t seed) {
+    printf("Sampled %zu of %zu %s (%.1f%%) with seed %llu\n", sampled, population, what,
+           population ? 100.0 * sampled / population : 0.0, (unsigned long long)seed);
+    if (sampled == 0) return;
+    if (damaged > 0) {
+        size_t estimate = (size_t)((double)damaged * population / sampled + 0.5);
+        printf("%zu damaged in the sample: an estimated %zu of %zu %s (%.1f%%) are damaged\n",
+               damaged, estimate, population, what, 100.0 * estimate / population);
+        return;
+    }
+    // miss: the chance that none of bound damaged items is in the sample
+    double miss = 1.0;
+    size_t bound = 0;
+    while (bound < population - sampled) {
+        double next = miss * (double)(population - sampled - bound) / (double)(population - bound);
+        if (next <= 0.05) break;
+        miss = next;
+        bound++;
+    }
+    printf("No damage found: with 95%% confidence at most %zu of %zu %s (%.1f%%) are damaged\n",
+           bound, population, what, 100.0 * bound / population);
+    printf("A single damaged one would have been found with probability %.1f%%\n",
+           100.0 * sampled / population);
+}
+
+// Verify every registered path against its stored hash on a pool of
+// worker threads (jobs <= 0: one per online CPU), printing each result as
+// it completes and a summary at the end. Flags: STORE_VERIFY_DEEP and
+// STORE_VERIFY_RESUME. With a sample (may be NULL) only part of the store
+// is read, always from disk: a share of the files of each path that has a
+// manifest, or a share of the paths, and how far the result can be
+// trusted is reported.
+int verify_all_store_paths(int jobs, int flags, const VerifySample* sample) {
+    VerifyPool pool;
+    memset(&pool, 0, sizeof(pool));
+    HashCache cache;
+    hash_cache_load(&cache);
+    pool.cache = &cache;
+    pool.sample = sample;
+    pool.deep = (flags & STORE_VERIFY_DEEP) || sample;
+    if ((flags & STORE_VERIFY_RESUME) && !sample) load_verify_checkpoint(&pool);
+
+    // Snapshot the paths and hashes first; only the workers' hashing
+    // runs in parallel, the database is not shared between threads
+    if (db_foreach_path(collect_verify_job, &pool) != 0 ||
+        (sample && sample->paths && sample_verify_jobs(&pool) != 0)) {
+        fprintf(stderr, "Failed to list registered store paths\n");
+        for (size_t i = 0; i < pool.count; i++) free(pool.jobs[i].path);
+        free(pool.jobs);
+        for (size_t i = 0; i < pool.resumed_count; i++) free(pool.resumed[i]);
+        free(pool.resumed);
+        hash_cache_free(&cache);
+        return -1;
+    }
+
+    // Start a new checkpoint, or keep adding to the one resumed from. A
+    // sample is quick to redo, so it keeps none.
+    if (!sample) {
+        pool.checkpoint = fopen(VERIFY_CHECKPOINT, pool.resumed_count > 0 ? "a" : "w");
+        if (!pool.checkpoint) {
+            fprintf(stderr, "Warning: Failed to open %s: %s\n", VERIFY_CHECKPOINT, strerror(errno));
+        } else if (pool.resumed_count == 0) {
+            fprintf(pool.checkpoint, "%s\n", VERIFY_CHECKPOINT_MAGIC);
+            fflush(pool.checkpoint);
+        }
+    }
+    if (pool.resumed_count > 0) {
+        printf("Resuming: %zu store paths were verified by an interrupted run (%zu ok)\n",
+               pool.resumed_count, pool.ok);
+    }
+
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if (jobs > VERIFY_MAX_JOBS) jobs = VERIFY_MAX_JOBS;
+    if ((size_t)jobs > pool.count) jobs = pool.count > 0 ? (int)pool.count : 1;
+
+    if (sample && sample->paths) {
+        printf("Sampling %g%% of the store paths with seed %llu\n", sample->percent,
+               (unsigned long long)sample->seed);
+    } else if (sample) {
+        printf("Sampling %g%% of the files of each store path with seed %llu\n", sample->percent,
+               (unsigned long long)sample->seed);
+    }
+    printf("Verifying %zu store paths with %d jobs\n", pool.count, jobs);
+    fflush(stdout);
+
+    // Pick the SHA-256 kernels before the workers share them
+    sha256_hash_many_lanes();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_t threads[VERIFY_MAX_JOBS];
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, VERIFY_THREAD_STACK);
+    int started = 0;
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[started], &attr, verify_worker, &pool) != 0) {
+            fprintf(stderr, "Warning: Failed to start verify worker %d\n", i + 1);
+            continue;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+    // Without any worker, verify on this thread
+    if (started == 0) verify_worker(&pool);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // The run is complete, so its checkpoint has served its purpose
+    if (pool.checkpoint) {
+        fclose(pool.checkpoint);
+        unlink(VERIFY_CHECKPOINT);
+    }
+
+    // Record the canonical hashes of the legacy paths that verified
+    size_t upgraded = 0;
+    int in_txn = db_txn_begin() == 0;
+    for (size_t i = 0; i < pool.count; i++) {
+        if (pool.jobs[i].upgraded[0] && db_store_hash(pool.jobs[i].path, pool.jobs[i].upgraded) == 0) upgraded++;
+    }
+    if (in_txn && db_txn_commit() != 0) upgraded = 0;
+
+    size_t total = pool.count + pool.resumed_count;
+    printf("Verified %zu store paths in %.1fs: %zu ok, %zu failed, %zu missing, %zu without a hash\n",
+           total, seconds, pool.ok, pool.failed, pool.missing, pool.unhashed);
+    if (sample && sample->paths) {
+        report_sample(pool.sampled, pool.population, pool.failed + pool.missing, "store paths", sample->seed);
+    } else if (sample) {
+        if (pool.unsampled > 0) {
+            printf("%zu store paths have no manifest to sample; a full --verify-all writes them\n",
+                   pool.unsampled);
+        }
+        report_sample(pool.sampled, pool.population, pool.sample_damaged, "files", sample->seed);
+    } else {
+        printf("Read %zu of %zu files; the rest were unchanged since last verified\n",
+               pool.files - pool.files_cached, pool.files);
+    }
+    if (upgraded > 0) printf("Upgraded %zu legacy hashes to the canonical format\n", upgraded);
+
+    // Remember the digests of the paths that checked out; if this run
+    // walked the whole store, entries of files that are gone are dropped
+    for (size_t i = 0; i < pool.count; i++) {
+        if (pool.jobs[i].ok) hash_cache_commit(&cache, &pool.jobs[i].pending);
+        hash_cache_pending_free(&pool.jobs[i].pending);
+        free(pool.jobs[i].path);
+    }
+    free(pool.jobs);
+    hash_cache_save(&cache, pool.resumed_count == 0 && !sample);
+    hash_cache_free(&cache);
+    for (size_t i = 0; i < pool.resumed_count; i++) free(pool.resumed[i]);
+    free(pool.resumed);
+    // Paths a file sample had to leave out were not found damaged either
+    return pool.ok + pool.unsampled == total ? 0 : -1;
+}
+
+static int dump_sink(const void* data, size_t len, void* arg) {
+    return fwrite(data, 1, len, (FILE*)arg) == len ? 0 : -1;
+}
+
+// Write the canonical serialization of a store path (the stream its hash
+// is computed from, with file contents inline) to output_file
+int dump_store_path(const char* path, const char* output_file) {
+    if (strncmp(path, NIX_STORE_PATH, strlen(NIX_STORE_PATH)) != 0 || strstr(path, "..") != NULL) {
+        fprintf(stderr, "Dump failed: Path %s is not within store or contains '..'.\n", path);
+        return -1;
+    }
+
+    FILE* f = fopen(output_file, "wb");
+    if (!f) {
+        fprintf(stderr, "Failed to create %s: %s\n", output_file, strerror(errno));
+        return -1;
+    }
+    int ret = nar_serialize(path, NAR_CONTENTS, dump_sink, f);
+    if (fclose(f) != 0) ret = -1;
+    if (ret != 0) {
+        fprintf(stderr, "Failed to dump %s to %s\n", path, output_file);
+        unlink(output_file);
+        return -1;
+    }
+
+    printf("Dumped %s to %s\n", path, output_file);
+    return 0;
+}
+
 
 // Helper function to find store path for a boot or system library
 static char* find_store_path_for_boot_lib(const char* lib_path) {
@@ -592,6 +1191,21 @@ static char* find_store_path_for_boot_lib(const char* lib_path) {
 
    printf("  Looking for library in store: %s\n", lib_name);
 
+   // Try the library index first; it only misses for libraries added
+   // before it existed, which the search below finds and records
+   const char* indexed = db_find_library(lib_name);
+   if (indexed) {
+       char lib_check_path[PATH_MAX];
+       char* check_dirs[] = {"lib", "bin", NULL};
+       for (char** dir = check_dirs; *dir; dir++) {
+           snprintf(lib_check_path, sizeof(lib_check_path), "%s/%s/%s", indexed, *dir, lib_name);
+           if (path_exists(lib_check_path)) {
+               printf("  Found library in store: %s\n", lib_check_path);
+               return strdup(indexed);
+           }
+       }
+   }
+
    DIR* dir = opendir(NIX_STORE_PATH);
    if (!dir) return NULL;
 
@@ -631,6 +1245,9 @@ static char* find_store_path_for_boot_lib(const char* lib_path) {
    }
 found:
    closedir(dir);
+   if (result) {
+       db_register_library(lib_name, result);
+   }
    
    if (!result) {
        printf("  Failed to find library in store: %s\n", lib_name);
@@ -645,7 +1262,237 @@ found:
    return result;
 }
 
-int scan_dependencies(const char* exec_path, char*** deps_out) {
+// Map a library the executable needs to its store path. Libraries
+// outside the store and the boot/system library directories are left to
+// the system and give NULL.
+static char* map_library_to_store(const char* lib_path) {
+   struct stat st;
+   if (lib_path[0] != '/' || stat(lib_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+       return NULL;
+   }
+
+   char* store_path = NULL;
+   if (strncmp(lib_path, NIX_STORE_PATH, strlen(NIX_STORE_PATH)) == 0) {
+       // Direct store path
+       store_path = strdup(lib_path);
+   } else if (strncmp(lib_path, "/proc/boot/", 11) == 0 ||
+              strncmp(lib_path, "/system/lib/", 12) == 0) {
+       // Boot or system library - find its store path
+       store_path = find_store_path_for_boot_lib(lib_path);
+   }
+
+   if (!store_path) {
+       printf("  Library not found in store, it will be used from system: %s\n", lib_path);
+       return NULL;
+   }
+
+   printf("  Found dependency mapping:\n");
+   printf("    From: %s\n", lib_path);
+   printf("    To:   %s\n", store_path);
+   return store_path;
+}
+
+// Append a store path to a dependency list unless it is already listed.
+// Takes ownership of store_path. Returns -1 only on allocation failure.
+static int add_store_dependency(char* store_path, char*** deps, int* dep_count, int* deps_capacity) {
+   for (int i = 0; i < *dep_count; i++) {
+       if (strcmp((*deps)[i], store_path) == 0) {
+           free(store_path);
+           return 0;
+       }
+   }
+
+   // Add to dependencies array
+   if (*dep_count >= *deps_capacity) {
+       int new_capacity = (*deps_capacity == 0) ? 8 : *deps_capacity * 2;
+       char** new_deps = realloc(*deps, (new_capacity + 1) * sizeof(char*));
+       if (!new_deps) {
+           free(store_path);
+           fprintf(stderr, "Memory allocation failed during dependency scan\n");
+           return -1;
+       }
+       *deps = new_deps;
+       *deps_capacity = new_capacity;
+   }
+   (*deps)[*dep_count] = store_path;
+   printf("  Found store dependency: %s\n", store_path);
+   (*dep_count)++;
+   return 0;
+}
+
+// Map a library to its store path and append that to the dependency list
+static int add_dependency_mapping(const char* lib_path, char*** deps, int* dep_count, int* deps_capacity) {
+   char* store_path = map_library_to_store(lib_path);
+   if (!store_path) {
+       return 0;
+   }
+   return add_store_dependency(store_path, deps, dep_count, deps_capacity);
+}
+
+// Per-file results of the ELF scanner, kept for the life of the process
+// so a shared library is scanned and mapped once however many binaries
+// need it (e.g. over a whole add_boot_libraries run)
+typedef struct DepCacheEntry {
+   char* path;
+   char** needed;        // Resolved direct dependencies, NULL if not a dynamic ELF file
+   int needed_count;
+   char* store_path;     // Store path the file maps to, NULL if none
+   int mapped;           // store_path has been looked up
+   unsigned visit;       // Last scan that reached this entry
+   struct DepCacheEntry* next;
+} DepCacheEntry;
+
+#define DEP_CACHE_BUCKETS 1024
+static DepCacheEntry* dep_cache[DEP_CACHE_BUCKETS];
+static unsigned dep_cache_visit;
+
+static unsigned dep_cache_bucket(const char* path) {
+   unsigned h = 5381;
+   for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+       h = h * 33 + *p;
+   }
+   return h % DEP_CACHE_BUCKETS;
+}
+
+// Cached scan result of a file, scanning it on first use
+static DepCacheEntry* dep_cache_get(const char* path) {
+   unsigned bucket = dep_cache_bucket(path);
+   for (DepCacheEntry* e = dep_cache[bucket]; e; e = e->next) {
+       if (strcmp(e->path, path) == 0) {
+           return e;
+       }
+   }
+
+   DepCacheEntry* e = calloc(1, sizeof(DepCacheEntry));
+   if (!e || !(e->path = strdup(path))) {
+       fprintf(stderr, "Memory allocation failed for dependency cache\n");
+       free(e);
+       return NULL;
+   }
+   e->needed_count = elf_scan_dependencies(path, config_get()->dependencies.extra_lib_paths, &e->needed);
+   e->next = dep_cache[bucket];
+   dep_cache[bucket] = e;
+   return e;
+}
+
+// Forget all cached scan results
+static void dep_cache_clear(void) {
+   for (int i = 0; i < DEP_CACHE_BUCKETS; i++) {
+       DepCacheEntry* e = dep_cache[i];
+       while (e) {
+           DepCacheEntry* next = e->next;
+           for (int j = 0; j < e->needed_count; j++) free(e->needed[j]);
+           free(e->needed);
+           free(e->store_path);
+           free(e->path);
+           free(e);
+           e = next;
+       }
+       dep_cache[i] = NULL;
+   }
+}
+
+// NULL-terminate a dependency list, allocating an empty one if needed
+static int finish_dependency_list(char** deps, int dep_count, char*** deps_out) {
+   if (deps) {
+       deps[dep_count] = NULL;
+   } else {
+       // Ensure deps_out is NULL if no dependencies were found/added
+       deps = malloc(sizeof(char*));
+       if(deps) deps[0] = NULL;
+       else {
+           fprintf(stderr, "Memory allocation failed for empty dependency array\n");
+           *deps_out = NULL;
+           return -1;
+       }
+   }
+
+   *deps_out = deps;
+   return dep_count;
+}
+
+// Dependency scan by reading DT_NEEDED, DT_RPATH and DT_RUNPATH straight
+// from the ELF file. Follows the library graph breadth first up to
+// dependencies.max_depth levels, so the result is the full set of
+// libraries the executable loads, like ldd reports. Returns -1 if the file
+// is not a dynamic ELF file.
+static int scan_dependencies_elf(const char* exec_path, char*** deps_out) {
+   *deps_out = NULL;
+   DepCacheEntry* root = dep_cache_get(exec_path);
+   if (!root || root->needed_count < 0) {
+       return -1;
+   }
+
+   printf("Scanning dependencies for %s using the ELF dynamic section\n", exec_path);
+
+   int max_depth = config_get()->dependencies.max_depth;
+   unsigned visit = ++dep_cache_visit;
+   root->visit = visit;
+
+   // Breadth-first walk; queue holds the entries of the current level
+   DepCacheEntry** queue = NULL;
+   int queue_len = 0, queue_capacity = 0;
+   DepCacheEntry** level = malloc(sizeof(DepCacheEntry*));
+   int level_len = 0;
+   if (!level) return -1;
+   level[level_len++] = root;
+
+   int ret = 0;
+   for (int depth = 1; depth <= max_depth && level_len > 0 && ret == 0; depth++) {
+       int next_start = queue_len;
+       for (int i = 0; i < level_len && ret == 0; i++) {
+           for (int j = 0; j < level[i]->needed_count; j++) {
+               DepCacheEntry* lib = dep_cache_get(level[i]->needed[j]);
+               if (!lib) { ret = -1; break; }
+               if (lib->visit == visit) continue;
+               lib->visit = visit;
+               if (queue_len == queue_capacity) {
+                   queue_capacity = queue_capacity ? queue_capacity * 2 : 16;
+                   DepCacheEntry** new_queue = realloc(queue, queue_capacity * sizeof(DepCacheEntry*));
+                   if (!new_queue) { ret = -1; break; }
+                   queue = new_queue;
+               }
+               queue[queue_len++] = lib;
+           }
+       }
+       // The libraries found at this depth form the next level
+       free(level);
+       level_len = queue_len - next_start;
+       level = malloc((level_len > 0 ? level_len : 1) * sizeof(DepCacheEntry*));
+       if (!level) { ret = -1; break; }
+       memcpy(level, queue + next_start, level_len * sizeof(DepCacheEntry*));
+   }
+   free(level);
+
+   // Map every library reached to its store path
+   char** deps = NULL;
+   int dep_count = 0;
+   int deps_capacity = 0;
+   for (int i = 0; i < queue_len && ret == 0; i++) {
+       DepCacheEntry* lib = queue[i];
+       if (!lib->mapped) {
+           lib->store_path = map_library_to_store(lib->path);
+           lib->mapped = 1;
+       }
+       if (lib->store_path) {
+           char* store_path = strdup(lib->store_path);
+           ret = store_path ? add_store_dependency(store_path, &deps, &dep_count, &deps_capacity) : -1;
+       }
+   }
+   free(queue);
+
+   if (ret != 0) {
+       fprintf(stderr, "Memory allocation failed during dependency scan\n");
+       for (int k = 0; k < dep_count; k++) free(deps[k]);
+       free(deps);
+       return -1;
+   }
+   return finish_dependency_list(deps, dep_count, deps_out);
+}
+
+// Dependency scan by running ldd and parsing its output. ldd reports the
+// whole set of loaded libraries itself, so max_depth does not apply.
+static int scan_dependencies_ldd(const char* exec_path, char*** deps_out) {
    FILE* pipe;
    char cmd[PATH_MAX + 4];
    char buffer[1024];
@@ -693,45 +1540,12 @@ int scan_dependencies(const char* exec_path, char*** deps_out) {
 
                // Handle only absolute paths
                if (extracted_path[0] == '/') {
-                   struct stat st;
-                   if (stat(extracted_path, &st) == 0 && S_ISREG(st.st_mode)) {
-                       char* store_path = NULL;
-
-                       if (strncmp(extracted_path, NIX_STORE_PATH, strlen(NIX_STORE_PATH)) == 0) {
-                           // Direct store path
-                           store_path = strdup(extracted_path);
-                       } else if (strncmp(extracted_path, "/proc/boot/", 11) == 0 ||
-                                strncmp(extracted_path, "/system/lib/", 12) == 0) {
-                           // Boot or system library - find its store path
-                           store_path = find_store_path_for_boot_lib(extracted_path);
-                       }
-
-                       if (store_path) {
-                           printf("  Found dependency mapping:\n");
-                           printf("    From: %s\n", extracted_path);
-                           printf("    To:   %s\n", store_path);
-
-                           // Add to dependencies array
-                           if (dep_count >= deps_capacity) {
-                               deps_capacity = (deps_capacity == 0) ? 8 : deps_capacity * 2;
-                               char** new_deps = realloc(deps, (deps_capacity + 1) * sizeof(char*));
-                               if (!new_deps) {
-                                   free(store_path);
-                                   fprintf(stderr, "Memory allocation failed during dependency scan\n");
-                                   for (int k = 0; k < dep_count; k++) free(deps[k]);
-                                   free(deps);
-                                   pclose(pipe);
-                                   *deps_out = NULL;
-                                   return -1;
-                               }
-                               deps = new_deps;
-                           }
-                           deps[dep_count] = store_path;
-                           printf("  Found store dependency: %s\n", deps[dep_count]);
-                           dep_count++;
-                       } else {
-                           printf("  Library not found in store, it will be used from system: %s\n", extracted_path);
-                       }
+                   if (add_dependency_mapping(extracted_path, &deps, &dep_count, &deps_capacity) != 0) {
+                       for (int k = 0; k < dep_count; k++) free(deps[k]);
+                       free(deps);
+                       pclose(pipe);
+                       *deps_out = NULL;
+                       return -1;
                    }
                }
            }
@@ -745,22 +1559,23 @@ int scan_dependencies(const char* exec_path, char*** deps_out) {
        fprintf(stderr, "Warning: ldd command exited with status %d\n", WEXITSTATUS(status));
    }
 
-   // Add NULL terminator to the deps array
-   if (deps) {
-       deps[dep_count] = NULL;
-   } else {
-       // Ensure deps_out is NULL if no dependencies were found/added
-       deps = malloc(sizeof(char*));
-       if(deps) deps[0] = NULL;
-       else {
-           fprintf(stderr, "Memory allocation failed for empty dependency array\n");
-           *deps_out = NULL;
-           return -1;
+   return finish_dependency_list(deps, dep_count, deps_out);
+}
+
+// Scan the libraries an executable needs and map them to store paths.
+// dependencies.scanner selects the scanner: "elf" reads the ELF file
+// directly, "ldd" runs ldd; files the ELF reader cannot handle fall back
+// to ldd.
+int scan_dependencies(const char* exec_path, char*** deps_out) {
+   const char* scanner = config_get()->dependencies.scanner;
+   if (scanner && strcmp(scanner, "elf") == 0) {
+       int dep_count = scan_dependencies_elf(exec_path, deps_out);
+       if (dep_count >= 0) {
+           return dep_count;
        }
+       printf("  %s is not a dynamically linked ELF file, falling back to ldd\n", exec_path);
    }
-
-   *deps_out = deps;
-   return dep_count;
+   return scan_dependencies_ldd(exec_path, deps_out);
 }
 
 
@@ -771,6 +1586,13 @@ int add_boot_libraries(void) {
     const char* bin_paths[] = {"/system/bin", "/proc/boot", NULL};
     int total_count = 0;
 
+    // Register everything in batches of one transaction each. If the run
+    // is cut short, the next add of each path in the open batch finds its
+    // directory unregistered and adds it afresh.
+    if (add_batch_begin() != 0) {
+        return -1;
+    }
+
     // First pass: Add all libraries from /proc/boot and /system/lib
     printf("First pass: Adding libraries...\n");
     for (const char** sys_path = system_paths; *sys_path != NULL; sys_path++) {
@@ -804,6 +1626,11 @@ int add_boot_libraries(void) {
                 } else {
                     fprintf(stderr, "  Failed to add %s to store.\n", path);
                 }
+                if (add_batch_checkpoint() != 0) {
+                    fprintf(stderr, "Failed to commit boot libraries to the database\n");
+                    closedir(dir);
+                    return -1;
+                }
             }
         }
         closedir(dir);
@@ -861,6 +1688,14 @@ int add_boot_libraries(void) {
                 } else {
                     fprintf(stderr, "  Failed to add %s with dependencies\n", entry->d_name);
                 }
+                if (add_batch_checkpoint() != 0) {
+                    fprintf(stderr, "Failed to commit boot binaries to the database\n");
+                    for (int i = 0; i < deps_count; i++) free(deps[i]);
+                    free(deps);
+                    closedir(dir);
+                    dep_cache_clear();
+                    return -1;
+                }
                 
                 // Clean up deps
                 if (deps) {
@@ -878,6 +1713,12 @@ int add_boot_libraries(void) {
         total_count += bin_count;
     }
 
+    dep_cache_clear();
+    if (add_batch_commit() != 0) {
+        fprintf(stderr, "Failed to commit boot libraries to the database\n");
+        return -1;
+    }
+
     printf("Added total %d items to the store.\n", total_count);
     return total_count;
 }
@@ -1070,14 +1911,12 @@ int install_to_profile(const char* store_path, const char* profile_name) {
     struct stat st;
     if (stat(profile_path, &st) == 0) {
         // Profile exists, recursively copy to backup
-        char cp_cmd[PATH_MAX * 3];
-        snprintf(cp_cmd, sizeof(cp_cmd), "cp -rP %s/. %s/", profile_path, backup_path);
         if (mkdir(backup_path, 0755) == -1 && errno != EEXIST) {
             fprintf(stderr, "Failed to create backup directory: %s\n", strerror(errno));
             return -1;
         }
-        if (system(cp_cmd) != 0) {
-            fprintf(stderr, "Failed to create backup of profile: %s\n", strerror(errno));
+        if (store_copy_tree(profile_path, backup_path, NULL) != 0) {
+            fprintf(stderr, "Failed to create backup of profile %s\n", profile_name);
             return -1;
         }
         printf("Created generation: %s\n", backup_path);
@@ -1197,14 +2036,12 @@ int install_to_profile(const char* store_path, const char* profile_name) {
     }
     char postgen_path[PATH_MAX];
     snprintf(postgen_path, PATH_MAX, "/data/nix/profiles/%s-%ld", profile_name, post_time);
-    char cp_cmd[PATH_MAX * 3];
-    snprintf(cp_cmd, sizeof(cp_cmd), "cp -rP %s/. %s/", profile_path, postgen_path);
     if (mkdir(postgen_path, 0755) == -1 && errno != EEXIST) {
         fprintf(stderr, "Failed to create post-modification generation directory: %s\n", strerror(errno));
         // Not fatal, continue
     } else {
-        if (system(cp_cmd) != 0) {
-            fprintf(stderr, "Failed to create post-modification generation: %s\n", strerror(errno));
+        if (store_copy_tree(profile_path, postgen_path, NULL) != 0) {
+            fprintf(stderr, "Failed to create post-modification generation %s\n", postgen_path);
         } else {
             printf("Created generation (after modification): %s\n", postgen_path);
         }
@@ -1291,10 +2128,7 @@ void cleanup_old_generations(const char* profile_name) {
         snprintf(gen_path, PATH_MAX, "/data/nix/profiles/%s-%ld", profile_name, timestamps[i]);
         
         printf("  Removing old generation: %s\n", gen_path);
-        char rm_cmd[PATH_MAX + 10];
-        snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", gen_path);
-        
-        if (system(rm_cmd) != 0) {
+        if (store_remove_tree(gen_path) != 0) {
             fprintf(stderr, "Warning: Failed to remove old generation: %s\n", gen_path);
         }
     }
@@ -1582,17 +2416,13 @@ int rollback_profile(const char* profile_name) {
    strftime(timestamp_str, sizeof(timestamp_str), "%Y-%m-%d %H:%M:%S", tm_info);
 
    // Remove current profile
-   char rm_cmd[PATH_MAX + 10];
-   snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", profile_path);
-   if (system(rm_cmd) != 0) {
+   if (store_remove_tree(profile_path) != 0) {
        fprintf(stderr, "Failed to remove current profile\n");
        return -1;
    }
 
    // Copy previous generation to main profile
-   char cp_cmd[PATH_MAX * 3];
-   snprintf(cp_cmd, sizeof(cp_cmd), "cp -rP %s/. %s/", latest_path, profile_path);
-   if (system(cp_cmd) != 0) {
+   if (store_copy_dir(latest_path, profile_path) != 0) {
        fprintf(stderr, "Failed to rollback to generation %s\n", latest_path);
        return -1;
    }
@@ -1699,31 +2529,25 @@ int switch_profile_generation(const char* profile_name, time_t timestamp) {
 
    // Create backup of current profile if it exists
    if (stat(profile_path, &st) == 0) {
-       char cp_cmd[PATH_MAX * 3];
-       snprintf(cp_cmd, sizeof(cp_cmd), "cp -rP %s/. %s/", profile_path, backup_path);
-       if (system(cp_cmd) != 0) {
+       if (store_copy_dir(profile_path, backup_path) != 0) {
            fprintf(stderr, "Failed to create backup before switching generations\n");
            return -1;
        }
    }
 
    // Remove current profile
-   char rm_cmd[PATH_MAX + 10];
-   snprintf(rm_cmd, sizeof(rm_cmd), "rm -rf %s", profile_path);
-   if (system(rm_cmd) != 0) {
+   if (store_remove_tree(profile_path) != 0) {
        fprintf(stderr, "Failed to remove current profile\n");
        return -1;
    }
 
    // Copy generation to profile path
-   char cp_cmd[PATH_MAX * 3];
-   snprintf(cp_cmd, sizeof(cp_cmd), "cp -rP %s/. %s/", gen_path, profile_path);
-   if (system(cp_cmd) != 0) {
+   if (store_copy_dir(gen_path, profile_path) != 0) {
        fprintf(stderr, "Failed to switch to generation %ld\n", timestamp);
        // Try to restore backup
        if (stat(backup_path, &st) == 0) {
-           snprintf(cp_cmd, sizeof(cp_cmd), "cp -rP %s/. %s/", backup_path, profile_path);
-           system(cp_cmd);
+           store_remove_tree(profile_path);
+           store_copy_dir(backup_path, profile_path);
        }
        return -1;
    }
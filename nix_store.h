@@ -22,6 +22,7 @@
 
 // Define the base store path
 #define NIX_STORE_PATH "/data/nix/store"
+#define STORE_LOCKS_DIR NIX_STORE_PATH "/.nix-db/locks"  // Per-path locks, see store_path_lock
 
 // Structure to represent a store path
 typedef struct {
@@ -38,7 +39,23 @@ char* compute_store_path(const char* name, const char* hash, const char** refere
 int add_to_store(const char* source_path, const char* name, int recursive);
 int add_to_store_with_deps(const char* source_path, const char* name, const char** deps, int deps_count);
 int make_store_path_read_only(const char* path);
-int verify_store_path(const char* path);
+int store_path_lock(const char* store_path, int wait);
+void store_path_unlock(int fd);
+// verify_store_path flags
+#define STORE_VERIFY_DEEP 1       // Read every file, ignoring the hash cache
+#define STORE_VERIFY_FAIL_FAST 2  // Stop at the first damaged file
+#define STORE_VERIFY_REPAIR 4     // Restore damaged files, then check again
+#define STORE_VERIFY_RESUME 8     // verify-all: skip paths an interrupted run checked
+int verify_store_path(const char* path, int flags, int jobs, const char* repair_from);
+// Sampling for verify_all_store_paths: percent of the files of each store
+// path, or of the store paths, chosen reproducibly from seed
+typedef struct {
+    double percent;
+    uint64_t seed;
+    int paths;  // Sample store paths rather than files
+} VerifySample;
+int verify_all_store_paths(int jobs, int flags, const VerifySample* sample);
+int dump_store_path(const char* path, const char* output_file);
 int gc_collect_garbage(void);
 int scan_dependencies(const char* exec_path, char*** deps_out);
 int add_boot_libraries(void);
@@ -9,24 +9,172 @@
 #include <sys/mman.h>
 #include <time.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <dirent.h>
 #include "nix_store.h" // For NIX_STORE_PATH definition
 #include "nix_store_db.h"
 #include "sha256.h" // For SHA256 functions
-
+#include "nar.h"
+#include "hash_cache.h"
+#include "io_throttle.h"
 // Define the database file paths
 #define DB_PATH NIX_STORE_PATH "/.nix-db/db"
+#define INDEX_PATH NIX_STORE_PATH "/.nix-db/index"
+#define JOURNAL_PATH NIX_STORE_PATH "/.nix-db/journal"
+#define LOCK_PATH NIX_STORE_PATH "/.nix-db/lock"
+#define LEGACY_BACKUP_PATH NIX_STORE_PATH "/.nix-db/db.v1"
 #define ROOTS_PATH NIX_STORE_PATH "/.nix-db/roots"
+#define LIBS_PATH NIX_STORE_PATH "/.nix-db/libs"
 #define TEMP_SUFFIX ".tmp" // Suffix for temporary files
 
-// Structure for database entries
+// Database file format (version 2)
+//
+// The file starts with a DBFileHeader followed by variable-length records.
+// Every record begins with a DBRecordHeader and is padded to 8 bytes.
+// Strings (paths and references) are interned once as STRING records and
+// referred to by the byte offset of that record. A PATH record holds the
+// registration data for one store path and any number of references.
+#define DB_MAGIC "QNIXDB\n"  // 8 bytes including the terminating NUL
+#define DB_FORMAT_VERSION 2
+#define DB_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t generation;  // Bumped by every compaction
+} DBFileHeader;
+
+#define DB_REC_STRING 1
+#define DB_REC_PATH 2
+// Record flags. The file is only ever rewritten whole, with one PATH record
+// per live path, so records are never marked superseded; bit 0x0001 is
+// unused.
+#define DB_REC_HASH_CANONICAL 0x0002  // PATH record: hash is in DB_HASH_CANONICAL format
+
+typedef struct {
+    uint32_t size;   // Total size including this header, 8-byte aligned
+    uint16_t type;
+    uint16_t flags;
+} DBRecordHeader;
+
+typedef struct {
+    DBRecordHeader rec;
+    uint32_t path;          // Offset of the interned path string
+    uint32_t ref_count;
+    int64_t creation_time;
+    char hash[SHA256_DIGEST_STRING_LENGTH];
+    // Followed by ref_count offsets of interned reference strings
+} DBPathRecord;
+
+#define DB_PATH_REFS(rec) ((const uint32_t*)((const char*)(rec) + sizeof(DBPathRecord)))
+
+// Fixed-size entry layout of format version 1, only read for conversion
 typedef struct {
     char path[PATH_MAX];
     char references[10][PATH_MAX];  // Up to 10 references per entry
     int ref_count;
     time_t creation_time;
-    char hash[SHA256_DIGEST_STRING_LENGTH];  // Add hash field
-} DBEntry;
+    char hash[SHA256_DIGEST_STRING_LENGTH];
+} DBLegacyEntry;
+
+// On-disk index: an open addressing hash table keyed by a hash of each
+// interned string. A slot gives the string's record and, when the string
+// is a registered store path, its live PATH record. Slots of strings that
+// are referenced by paths also point at a referrers list stored after the
+// slot array: a count followed by the PATH record offsets of the referrers.
+#define DB_INDEX_MAGIC 0x58444951u  // "QIDX"
+#define DB_INDEX_VERSION 3
+#define DB_INDEX_MIN_CAPACITY 1024  // Must be a power of two
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;  // Number of slots (power of two)
+    uint32_t count;     // Number of occupied slots
+    uint64_t db_size;   // Size of the DB file the index describes
+    uint64_t db_ino;    // Inode of that DB file
+} DBIndexHeader;
+
+typedef struct {
+    uint64_t key;     // String hash, 0 marks an empty slot
+    uint32_t string;  // Offset of the STRING record
+    uint32_t path;    // Offset of the live PATH record, 0 if none
+    uint32_t referrers;  // Index file offset of the referrers list, 0 if none
+    uint32_t reserved;
+} DBIndexSlot;
+
+// A reference from a PATH record to a string, collected while building
+// an index to produce the referrers lists
+typedef struct {
+    uint64_t key;     // Hash of the referenced string
+    uint32_t string;  // Offset of the referenced STRING record
+    uint32_t path;    // Offset of the referring PATH record
+} DBReferrerEdge;
+
+typedef struct {
+    DBReferrerEdge* items;
+    size_t count;
+    size_t capacity;
+} DBEdgeList;
+
+// Journal
+//
+// The database file is never modified in place. Mutations are appended to
+// the journal as entries, and a COMMIT entry closes each group; a group is
+// written with one write and one fsync. Readers replay the journal over
+// the database into an in-memory overlay and ignore a trailing group that
+// has no COMMIT entry (a write cut short by a crash). Once the journal
+// grows past DB_JOURNAL_COMPACT_BYTES it is merged into a new database
+// file and started afresh.
+//
+// The journal header names the database generation it applies to. A
+// journal left behind by a compaction that crashed before resetting it is
+// already contained in the newer database and is ignored.
+#define DB_JOURNAL_MAGIC "QNIXJNL"  // 8 bytes including the terminating NUL
+#define DB_JOURNAL_VERSION 1
+
+#define DB_OP_REGISTER 1  // path, references: (re)register with this reference list
+#define DB_OP_SET_HASH 2  // path, hash; count is the hash format
+#define DB_OP_REMOVE 3    // path
+#define DB_OP_COMMIT 4    // closes a group of count entries
+
+#define DB_TXN_MAX_DEPTH 8                                   // Nesting limit of db_txn_begin
+#define DB_JOURNAL_COMPACT_BYTES (256 * 1024)                // Compact in the background past this
+#define DB_JOURNAL_MAX_BYTES (8 * DB_JOURNAL_COMPACT_BYTES)  // Compact inline past this
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t generation;  // Generation of the database the entries apply to
+} DBJournalHeader;
+
+typedef struct {
+    uint32_t size;      // Total size including this header, 8-byte aligned
+    uint16_t op;
+    uint16_t reserved;
+    uint32_t count;     // REGISTER: number of references, SET_HASH: hash format, COMMIT: entries in the group
+    uint32_t checksum;  // FNV-1a over the whole entry with this field zeroed
+    int64_t time;       // REGISTER: creation time for new paths
+    // Followed by NUL-terminated strings: the path, then references or hash
+} DBJournalEntry;
+
+// State of a path as changed by the journal
+typedef struct {
+    char* path;
+    char** refs;
+    uint32_t ref_count;
+    int64_t creation_time;
+    char hash[SHA256_DIGEST_STRING_LENGTH];
+    int hash_format;
+    int removed;
+} DBOverlayEntry;
+
+// A registered path, either from the mapped database or from the overlay
+typedef struct {
+    const DBPathRecord* rec;
+    const DBOverlayEntry* entry;
+} DBPathView;
 
 // Helper function to ensure the DB directory exists
 static int ensure_db_dir_exists(void) {
@@ -34,24 +182,1488 @@ static int ensure_db_dir_exists(void) {
     char dir[PATH_MAX];
     snprintf(dir, PATH_MAX, NIX_STORE_PATH "/.nix-db");
 
-    if (stat(dir, &st) == -1) {
-        if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
-            fprintf(stderr, "Failed to create database directory %s: %s\n", dir, strerror(errno));
+    if (stat(dir, &st) == -1) {
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create database directory %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+    } else if (!S_ISDIR(st.st_mode)) {
+         fprintf(stderr, "Error: %s exists but is not a directory.\n", dir);
+         return -1;
+    }
+    return 0;
+}
+
+// Temporary name for rewriting path. It includes the pid, so two
+// processes never write the same temporary file.
+static void db_temp_path(char temp_path[PATH_MAX], const char* path) {
+    snprintf(temp_path, PATH_MAX, "%s.%ld%s", path, (long)getpid(), TEMP_SUFFIX);
+}
+
+// 64-bit FNV-1a hash of a string, used as the index key
+static uint64_t db_string_key(const char* str) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char* p = (const unsigned char*)str; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    return h ? h : 1; // 0 is reserved for empty slots
+}
+
+// Insert a slot into an in-memory slot array using linear probing.
+// Returns the slot number used.
+static uint32_t index_slots_insert(DBIndexSlot* slots, uint32_t capacity, const DBIndexSlot* slot) {
+    uint32_t mask = capacity - 1;
+    uint32_t i = (uint32_t)slot->key & mask;
+    while (slots[i].key != 0) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = *slot;
+    return i;
+}
+
+// Find the slot of an interned string in an in-memory slot array
+static DBIndexSlot* index_slots_find(DBIndexSlot* slots, uint32_t capacity, uint64_t key, uint32_t string) {
+    uint32_t mask = capacity - 1;
+    for (uint32_t i = (uint32_t)key & mask; slots[i].key != 0; i = (i + 1) & mask) {
+        if (slots[i].key == key && slots[i].string == string) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+static int edges_push(DBEdgeList* edges, uint64_t key, uint32_t string, uint32_t path) {
+    if (edges->count == edges->capacity) {
+        size_t capacity = edges->capacity ? edges->capacity * 2 : 1024;
+        DBReferrerEdge* items = realloc(edges->items, capacity * sizeof(DBReferrerEdge));
+        if (!items) return -1;
+        edges->items = items;
+        edges->capacity = capacity;
+    }
+    DBReferrerEdge* e = &edges->items[edges->count++];
+    e->key = key;
+    e->string = string;
+    e->path = path;
+    return 0;
+}
+
+static int compare_edges(const void* a, const void* b) {
+    const DBReferrerEdge* x = a;
+    const DBReferrerEdge* y = b;
+    if (x->string != y->string) return x->string < y->string ? -1 : 1;
+    if (x->path != y->path) return x->path < y->path ? -1 : 1;
+    return 0;
+}
+
+// Turn the collected edges into referrers lists and point the slots of
+// the referenced strings at them. The lists are returned in *area_out,
+// laid out as they follow the slot array in the index file.
+static int index_build_referrers(DBIndexSlot* slots, uint32_t capacity, DBEdgeList* edges,
+                                 uint32_t** area_out, size_t* words_out) {
+    *area_out = NULL;
+    *words_out = 0;
+    if (edges->count == 0) return 0;
+
+    qsort(edges->items, edges->count, sizeof(DBReferrerEdge), compare_edges);
+    uint32_t* area = malloc((edges->count * 2) * sizeof(uint32_t));
+    if (!area) return -1;
+
+    size_t base = sizeof(DBIndexHeader) + (size_t)capacity * sizeof(DBIndexSlot);
+    size_t words = 0;
+    for (size_t i = 0; i < edges->count; ) {
+        const DBReferrerEdge* first = &edges->items[i];
+        DBIndexSlot* slot = index_slots_find(slots, capacity, first->key, first->string);
+        size_t count_at = words++;
+        area[count_at] = 0;
+        for (; i < edges->count && edges->items[i].string == first->string; i++) {
+            if (area[count_at] > 0 && area[words - 1] == edges->items[i].path) continue; // Listed twice
+            area[words++] = edges->items[i].path;
+            area[count_at]++;
+        }
+        if (slot && base + count_at * sizeof(uint32_t) <= UINT32_MAX) {
+            slot->referrers = (uint32_t)(base + count_at * sizeof(uint32_t));
+        }
+    }
+    *area_out = area;
+    *words_out = words;
+    return 0;
+}
+
+// Write a complete index to disk, replacing the old one atomically
+static int db_index_write(const DBIndexHeader* hdr, const DBIndexSlot* slots, const uint32_t* referrers, size_t words) {
+    char temp_path[PATH_MAX];
+    db_temp_path(temp_path, INDEX_PATH);
+
+    FILE* f = fopen(temp_path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to create index file %s: %s\n", temp_path, strerror(errno));
+        return -1;
+    }
+    if (fwrite(hdr, sizeof(*hdr), 1, f) != 1 ||
+        fwrite(slots, sizeof(*slots), hdr->capacity, f) != hdr->capacity ||
+        (words > 0 && fwrite(referrers, sizeof(uint32_t), words, f) != words)) {
+        fprintf(stderr, "Failed to write index file %s\n", temp_path);
+        fclose(f);
+        remove(temp_path);
+        return -1;
+    }
+    if (fclose(f) != 0 || rename(temp_path, INDEX_PATH) == -1) {
+        fprintf(stderr, "Failed to install index file %s: %s\n", INDEX_PATH, strerror(errno));
+        remove(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Map a file read-only. Returns NULL with *size_out set to 0 if the file
+// does not exist or is empty.
+static const char* db_map_file(const char* path, size_t* size_out) {
+    *size_out = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    *size_out = (size_t)st.st_size;
+    return map;
+}
+
+static void db_unmap_file(const char* map, size_t size) {
+    if (map) munmap((void*)map, size);
+}
+
+// Return the record at an offset of a mapped database, or NULL if the
+// offset does not point at a well-formed record
+static const DBRecordHeader* db_record_at(const char* buf, size_t size, uint32_t off) {
+    if (off < sizeof(DBFileHeader) || off % 8 != 0 || (size_t)off + sizeof(DBRecordHeader) > size) {
+        return NULL;
+    }
+    const DBRecordHeader* rec = (const DBRecordHeader*)(buf + off);
+    if (rec->size < sizeof(DBRecordHeader) || rec->size % 8 != 0 || (size_t)off + rec->size > size) {
+        return NULL;
+    }
+    return rec;
+}
+
+// Contents of a STRING record, or NULL if rec is not a valid string
+static const char* db_record_string(const DBRecordHeader* rec) {
+    if (!rec || rec->type != DB_REC_STRING) return NULL;
+    const char* str = (const char*)(rec + 1);
+    if (!memchr(str, '\0', rec->size - sizeof(DBRecordHeader))) return NULL;
+    return str;
+}
+
+// A PATH record, or NULL if rec is not a valid path record
+static const DBPathRecord* db_record_path(const DBRecordHeader* rec) {
+    if (!rec || rec->type != DB_REC_PATH || rec->size < sizeof(DBPathRecord)) return NULL;
+    const DBPathRecord* prec = (const DBPathRecord*)rec;
+    if (prec->ref_count > (rec->size - sizeof(DBPathRecord)) / sizeof(uint32_t)) return NULL;
+    return prec;
+}
+
+static int record_hash_format(const DBPathRecord* prec) {
+    return (prec->rec.flags & DB_REC_HASH_CANONICAL) ? DB_HASH_CANONICAL : DB_HASH_LEGACY;
+}
+
+// Rebuild the index from a full scan of the database file
+static int db_index_rebuild(void) {
+    size_t size;
+    const char* buf = db_map_file(DB_PATH, &size);
+
+    DBIndexHeader hdr = {0};
+    hdr.magic = DB_INDEX_MAGIC;
+    hdr.version = DB_INDEX_VERSION;
+
+    struct stat st;
+    if (stat(DB_PATH, &st) == 0) {
+        hdr.db_size = (uint64_t)st.st_size;
+        hdr.db_ino = (uint64_t)st.st_ino;
+    }
+
+    // Count the strings so the table starts at or below half full
+    uint32_t strings = 0;
+    uint32_t off;
+    const DBRecordHeader* rec;
+    for (off = sizeof(DBFileHeader); (rec = db_record_at(buf, size, off)) != NULL; off += rec->size) {
+        if (rec->type == DB_REC_STRING) strings++;
+    }
+    hdr.capacity = DB_INDEX_MIN_CAPACITY;
+    while (hdr.capacity < strings * 2) {
+        hdr.capacity *= 2;
+    }
+
+    DBIndexSlot* slots = calloc(hdr.capacity, sizeof(DBIndexSlot));
+    if (!slots) {
+        fprintf(stderr, "Memory allocation failed for database index\n");
+        db_unmap_file(buf, size);
+        return -1;
+    }
+
+    for (off = sizeof(DBFileHeader); (rec = db_record_at(buf, size, off)) != NULL; off += rec->size) {
+        const char* str = db_record_string(rec);
+        if (str) {
+            DBIndexSlot slot = { db_string_key(str), off, 0, 0, 0 };
+            index_slots_insert(slots, hdr.capacity, &slot);
+            hdr.count++;
+        }
+    }
+    DBEdgeList edges = {0};
+    int ret = 0;
+    for (off = sizeof(DBFileHeader); (rec = db_record_at(buf, size, off)) != NULL; off += rec->size) {
+        const DBPathRecord* prec = db_record_path(rec);
+        if (!prec) continue;
+        const char* path = db_record_string(db_record_at(buf, size, prec->path));
+        if (!path) continue;
+        DBIndexSlot* slot = index_slots_find(slots, hdr.capacity, db_string_key(path), prec->path);
+        if (slot) slot->path = off;
+
+        for (uint32_t i = 0; i < prec->ref_count && ret == 0; i++) {
+            const char* ref = db_record_string(db_record_at(buf, size, DB_PATH_REFS(prec)[i]));
+            if (ref) ret = edges_push(&edges, db_string_key(ref), DB_PATH_REFS(prec)[i], off);
+        }
+    }
+
+    uint32_t* referrers = NULL;
+    size_t words = 0;
+    if (ret == 0) ret = index_build_referrers(slots, hdr.capacity, &edges, &referrers, &words);
+    if (ret == 0) {
+        ret = db_index_write(&hdr, slots, referrers, words);
+    } else {
+        fprintf(stderr, "Memory allocation failed for database index\n");
+    }
+    free(referrers);
+    free(edges.items);
+    free(slots);
+    db_unmap_file(buf, size);
+    return ret;
+}
+
+// Writer that produces a complete database file from scratch, interning
+// strings as it goes and building the matching index in memory. Used for
+// converting legacy databases and for compacting the journal.
+typedef struct {
+    FILE* f;
+    uint32_t offset;
+    DBIndexHeader idx;
+    DBIndexSlot* slots;
+    char** strings;  // String of each occupied slot, for collision checks
+    DBEdgeList edges;
+} DBWriter;
+
+static int dbw_open(DBWriter* w, uint32_t generation) {
+    char temp_path[PATH_MAX];
+    db_temp_path(temp_path, DB_PATH);
+
+    memset(w, 0, sizeof(*w));
+    w->idx.magic = DB_INDEX_MAGIC;
+    w->idx.version = DB_INDEX_VERSION;
+    w->idx.capacity = DB_INDEX_MIN_CAPACITY;
+    w->slots = calloc(w->idx.capacity, sizeof(DBIndexSlot));
+    w->strings = calloc(w->idx.capacity, sizeof(char*));
+    w->f = fopen(temp_path, "w");
+    if (!w->slots || !w->strings || !w->f) {
+        fprintf(stderr, "Failed to open temporary db file %s: %s\n", temp_path, strerror(errno));
+        if (w->f) fclose(w->f);
+        free(w->slots);
+        free(w->strings);
+        return -1;
+    }
+
+    DBFileHeader hdr = {0};
+    memcpy(hdr.magic, DB_MAGIC, sizeof(hdr.magic));
+    hdr.version = DB_FORMAT_VERSION;
+    hdr.generation = generation;
+    if (fwrite(&hdr, sizeof(hdr), 1, w->f) != 1) {
+        fprintf(stderr, "Failed to write temporary db file %s\n", temp_path);
+        fclose(w->f);
+        remove(temp_path);
+        free(w->slots);
+        free(w->strings);
+        return -1;
+    }
+    w->offset = sizeof(hdr);
+    return 0;
+}
+
+// Double the writer's slot table
+static int dbw_grow(DBWriter* w) {
+    uint32_t capacity = w->idx.capacity * 2;
+    DBIndexSlot* slots = calloc(capacity, sizeof(DBIndexSlot));
+    char** strings = calloc(capacity, sizeof(char*));
+    if (!slots || !strings) {
+        free(slots);
+        free(strings);
+        return -1;
+    }
+    for (uint32_t i = 0; i < w->idx.capacity; i++) {
+        if (w->slots[i].key != 0) {
+            uint32_t j = index_slots_insert(slots, capacity, &w->slots[i]);
+            strings[j] = w->strings[i];
+        }
+    }
+    free(w->slots);
+    free(w->strings);
+    w->slots = slots;
+    w->strings = strings;
+    w->idx.capacity = capacity;
+    return 0;
+}
+
+// Intern a string, writing a STRING record the first time it is seen.
+// Returns the record offset (0 on error) and its slot number.
+static uint32_t dbw_intern(DBWriter* w, const char* str, uint32_t* slot_out) {
+    uint64_t key = db_string_key(str);
+    uint32_t mask = w->idx.capacity - 1;
+    for (uint32_t i = (uint32_t)key & mask; w->slots[i].key != 0; i = (i + 1) & mask) {
+        if (w->slots[i].key == key && strcmp(w->strings[i], str) == 0) {
+            if (slot_out) *slot_out = i;
+            return w->slots[i].string;
+        }
+    }
+
+    if ((w->idx.count + 1) * 2 > w->idx.capacity && dbw_grow(w) != 0) {
+        return 0;
+    }
+
+    size_t len = strlen(str) + 1;
+    DBRecordHeader rec = { (uint32_t)DB_ALIGN(sizeof(DBRecordHeader) + len), DB_REC_STRING, 0 };
+    static const char padding[8];
+    if (fwrite(&rec, sizeof(rec), 1, w->f) != 1 ||
+        fwrite(str, 1, len, w->f) != len ||
+        fwrite(padding, 1, rec.size - sizeof(rec) - len, w->f) != rec.size - sizeof(rec) - len) {
+        return 0;
+    }
+
+    char* copy = strdup(str);
+    if (!copy) return 0;
+    DBIndexSlot slot = { key, w->offset, 0, 0, 0 };
+    uint32_t i = index_slots_insert(w->slots, w->idx.capacity, &slot);
+    w->strings[i] = copy;
+    w->idx.count++;
+    w->offset += rec.size;
+    if (slot_out) *slot_out = i;
+    return slot.string;
+}
+
+// Append a PATH record. Paths that were already added are skipped, so the
+// first registration of a path wins as it did with linear scans.
+static int dbw_add_path(DBWriter* w, const char* path, const char* const* refs, uint32_t ref_count,
+                        int64_t creation_time, const char* hash, int hash_format) {
+    size_t size = DB_ALIGN(sizeof(DBPathRecord) + (size_t)ref_count * sizeof(uint32_t));
+    DBPathRecord* prec = calloc(1, size);
+    if (!prec) return -1;
+
+    uint32_t* ref_offsets = (uint32_t*)((char*)prec + sizeof(DBPathRecord));
+    for (uint32_t i = 0; i < ref_count; i++) {
+        ref_offsets[i] = dbw_intern(w, refs[i], NULL);
+        if (ref_offsets[i] == 0) {
+            free(prec);
+            return -1;
+        }
+    }
+
+    uint32_t slot;
+    prec->path = dbw_intern(w, path, &slot);
+    if (prec->path == 0) {
+        free(prec);
+        return -1;
+    }
+    if (w->slots[slot].path != 0) {
+        free(prec);
+        return 0;
+    }
+
+    prec->rec.size = (uint32_t)size;
+    prec->rec.type = DB_REC_PATH;
+    prec->rec.flags = hash_format == DB_HASH_CANONICAL ? DB_REC_HASH_CANONICAL : 0;
+    prec->ref_count = ref_count;
+    prec->creation_time = creation_time;
+    if (hash) {
+        strncpy(prec->hash, hash, SHA256_DIGEST_STRING_LENGTH - 1);
+    }
+
+    if (fwrite(prec, size, 1, w->f) != 1) {
+        free(prec);
+        return -1;
+    }
+    for (uint32_t i = 0; i < ref_count; i++) {
+        if (edges_push(&w->edges, db_string_key(refs[i]), ref_offsets[i], w->offset) != 0) {
+            free(prec);
+            return -1;
+        }
+    }
+    free(prec);
+    w->slots[slot].path = w->offset;
+    w->offset += (uint32_t)size;
+    return 0;
+}
+
+// Finish a rewrite. With commit set, the new file is synced to disk and
+// replaces the database and its index is installed; otherwise the
+// temporary file is discarded.
+static int dbw_finish(DBWriter* w, int commit) {
+    char temp_path[PATH_MAX];
+    db_temp_path(temp_path, DB_PATH);
+
+    int ret = 0;
+    if (commit && (fflush(w->f) != 0 || fsync(fileno(w->f)) != 0)) {
+        fprintf(stderr, "Failed to sync temporary db file %s: %s\n", temp_path, strerror(errno));
+        ret = -1;
+    }
+    if (fclose(w->f) != 0) {
+        fprintf(stderr, "Failed to close temporary db file %s: %s\n", temp_path, strerror(errno));
+        ret = -1;
+    }
+    if (ret == 0 && commit) {
+        struct stat st;
+        if (rename(temp_path, DB_PATH) == -1 || stat(DB_PATH, &st) != 0) {
+            fprintf(stderr, "Failed to update database %s: %s\n", DB_PATH, strerror(errno));
+            ret = -1;
+        } else {
+            w->idx.db_size = (uint64_t)st.st_size;
+            w->idx.db_ino = (uint64_t)st.st_ino;
+            uint32_t* referrers = NULL;
+            size_t words = 0;
+            if (index_build_referrers(w->slots, w->idx.capacity, &w->edges, &referrers, &words) != 0 ||
+                db_index_write(&w->idx, w->slots, referrers, words) != 0) {
+                unlink(INDEX_PATH); // A stale index would be rebuilt anyway
+            }
+            free(referrers);
+        }
+    }
+    if (ret != 0 || !commit) {
+        remove(temp_path);
+    }
+
+    for (uint32_t i = 0; i < w->idx.capacity; i++) {
+        free(w->strings[i]);
+    }
+    free(w->strings);
+    free(w->slots);
+    free(w->edges.items);
+    return ret;
+}
+
+// Database lock state, see db_lock
+static struct {
+    int fd;
+    int depth;  // Times taken by this process
+} db_lock_state = { -1, 0 };
+static int db_lock(int wait);
+static void db_unlock(int fd);
+
+// Convert a version 1 database of fixed-size DBLegacyEntry records into
+// the current format. The original file is kept as db.v1.
+static int db_convert_legacy(int fd, off_t size) {
+    printf("Converting store database to format version %d...\n", DB_FORMAT_VERSION);
+
+    DBWriter w;
+    if (dbw_open(&w, 1) != 0) {
+        return -1;
+    }
+
+    DBLegacyEntry* entry = malloc(sizeof(DBLegacyEntry));
+    if (!entry) {
+        dbw_finish(&w, 0);
+        return -1;
+    }
+
+    uint32_t converted = 0;
+    int ret = 0;
+    for (off_t off = 0; off + (off_t)sizeof(DBLegacyEntry) <= size; off += sizeof(DBLegacyEntry)) {
+        if (pread(fd, entry, sizeof(DBLegacyEntry), off) != sizeof(DBLegacyEntry)) {
+            ret = -1;
+            break;
+        }
+        entry->path[PATH_MAX - 1] = '\0';
+        entry->hash[SHA256_DIGEST_STRING_LENGTH - 1] = '\0';
+        if (entry->path[0] == '\0') continue;
+
+        const char* refs[10];
+        uint32_t ref_count = 0;
+        for (int i = 0; i < entry->ref_count && i < 10; i++) {
+            entry->references[i][PATH_MAX - 1] = '\0';
+            refs[ref_count++] = entry->references[i];
+        }
+        if (dbw_add_path(&w, entry->path, refs, ref_count, (int64_t)entry->creation_time, entry->hash,
+                         DB_HASH_LEGACY) != 0) {
+            ret = -1;
+            break;
+        }
+        converted++;
+    }
+    free(entry);
+
+    if (ret != 0) {
+        fprintf(stderr, "Failed to convert legacy store database\n");
+        dbw_finish(&w, 0);
+        return -1;
+    }
+
+    // The backup is a second name for the original, so the database file
+    // never goes missing for readers while the new one is renamed over it
+    uint32_t new_size = w.offset;
+    unlink(LEGACY_BACKUP_PATH); // Left by an interrupted conversion
+    if (link(DB_PATH, LEGACY_BACKUP_PATH) == -1) {
+        fprintf(stderr, "Failed to back up legacy database to %s: %s\n", LEGACY_BACKUP_PATH, strerror(errno));
+        dbw_finish(&w, 0);
+        return -1;
+    }
+    if (dbw_finish(&w, 1) != 0) {
+        unlink(LEGACY_BACKUP_PATH); // The original is still in place
+        return -1;
+    }
+
+    printf("Converted %u entries (%lld -> %u bytes), legacy database kept as %s\n",
+           converted, (long long)size, new_size, LEGACY_BACKUP_PATH);
+    return 0;
+}
+
+// Format of the database file open at fd: 0 if it is current (or empty),
+// 1 if it is a legacy database of *size bytes, -1 if it is unsupported
+static int db_file_format(int fd, off_t* size) {
+    struct stat st;
+    DBFileHeader hdr;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        return 0;
+    }
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        memcmp(hdr.magic, DB_MAGIC, sizeof(hdr.magic)) == 0) {
+        if (hdr.version != DB_FORMAT_VERSION) {
+            fprintf(stderr, "Unsupported store database version %u\n", hdr.version);
+            return -1;
+        }
+        return 0;
+    }
+    *size = st.st_size;
+    return 1;
+}
+
+// Make sure the database directory exists and the database file, if any,
+// is in the current format
+static int db_prepare(void) {
+    if (ensure_db_dir_exists() != 0) {
+        return -1;
+    }
+
+    int fd = open(DB_PATH, O_RDONLY);
+    if (fd == -1) {
+        return 0; // Created by the first compaction
+    }
+    off_t size = 0;
+    int ret = db_file_format(fd, &size);
+    close(fd);
+    if (ret != 1) {
+        return ret;
+    }
+
+    // Convert under the lock, and look again once it is held: another
+    // process may have converted the database while this one waited
+    int lock = db_lock(1);
+    if (lock == -1) {
+        fprintf(stderr, "Failed to lock the store database for conversion\n");
+        return -1;
+    }
+    fd = open(DB_PATH, O_RDONLY);
+    ret = fd == -1 ? 0 : db_file_format(fd, &size);
+    if (ret == 1) {
+        ret = db_convert_legacy(fd, size);
+    }
+    if (fd != -1) close(fd);
+    db_unlock(lock);
+    return ret;
+}
+
+// Read-only mapping of the database and its index, shared by all queries
+// in the process, plus the overlay of journal entries not yet compacted.
+// Queries resolve paths, hashes and references through pointers into the
+// mapping or the overlay instead of copying records.
+static struct {
+    const char* db;
+    size_t db_size;
+    uint64_t db_ino;
+    uint32_t generation;
+    const char* idx;
+    size_t idx_size;
+} db_map;
+
+static struct {
+    DBOverlayEntry** slots;  // Open addressing table keyed by path
+    uint32_t capacity;
+    uint32_t count;
+    uint64_t journal_ino;    // Journal the overlay was replayed from
+    uint64_t journal_size;   // Bytes of complete groups replayed
+    uint64_t seen_ino;       // Journal file as last looked at, to skip
+    uint64_t seen_size;      // refreshing while nothing changed
+    char* pending;           // Entries not yet committed to the journal
+    size_t pending_size;
+    size_t pending_capacity;
+    uint32_t pending_ops;
+    int exit_hook;           // Flush and compaction registered with atexit
+    int pinned;              // Reference walks in progress; no refresh while set
+    int dropped;             // An abort while pinned left its changes in the overlay
+    int txn_depth;           // Open transactions; nothing is committed while set
+    size_t txn_mark[DB_TXN_MAX_DEPTH];      // Pending bytes when each began
+    uint32_t txn_ops_mark[DB_TXN_MAX_DEPTH];
+} db_journal;
+
+static int db_refresh(void);
+static int db_sync_locked(void);
+
+static void db_map_release(void) {
+    db_unmap_file(db_map.db, db_map.db_size);
+    db_unmap_file(db_map.idx, db_map.idx_size);
+    memset(&db_map, 0, sizeof(db_map));
+}
+
+// Map the index, if the one on disk matches the mapped database
+static int db_map_index(void) {
+    db_map.idx = db_map_file(INDEX_PATH, &db_map.idx_size);
+    const DBIndexHeader* hdr = (const DBIndexHeader*)db_map.idx;
+    if (hdr && db_map.idx_size >= sizeof(*hdr) &&
+        hdr->magic == DB_INDEX_MAGIC && hdr->version == DB_INDEX_VERSION &&
+        db_map.idx_size >= sizeof(*hdr) + (size_t)hdr->capacity * sizeof(DBIndexSlot) &&
+        hdr->db_size == db_map.db_size && hdr->db_ino == db_map.db_ino) {
+        return 0;
+    }
+    db_unmap_file(db_map.idx, db_map.idx_size);
+    db_map.idx = NULL;
+    db_map.idx_size = 0;
+    return -1;
+}
+
+// Map the database and a matching index. Returns 0 on success, including
+// when there is no database yet, and -1 on error.
+static int db_map_load(void) {
+    int lock = -1;
+    int ret = -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        db_map_release();
+        if (db_prepare() != 0) {
+            db_unlock(lock);
+            return -1;
+        }
+
+        struct stat st;
+        db_map.db = db_map_file(DB_PATH, &db_map.db_size);
+        if (!db_map.db) {
+            ret = 0;
+            break;
+        }
+        const DBFileHeader* fhdr = (const DBFileHeader*)db_map.db;
+        if (db_map.db_size < sizeof(*fhdr) || stat(DB_PATH, &st) != 0) {
+            db_map_release();
+            db_unlock(lock);
+            return -1;
+        }
+        db_map.db_ino = (uint64_t)st.st_ino;
+        db_map.generation = fhdr->generation;
+
+        if (db_map_index() == 0) {
+            ret = 0;
+            break;
+        }
+        if (lock != -1) {
+            // Compaction installs the index under the lock too, so
+            // nothing else writes it now
+            printf("Building store database index...\n");
+            if (db_index_rebuild() == 0 && db_map_index() == 0) ret = 0;
+            break;
+        }
+        // Rebuild under the lock. Waiting for it gives a compaction the
+        // time to replace the database, so everything is mapped again
+        // once it is held, and the index may then be current already.
+        if ((lock = db_lock(1)) == -1) break;
+    }
+    db_unlock(lock);
+
+    if (ret != 0) {
+        fprintf(stderr, "Failed to open store database index %s\n", INDEX_PATH);
+        db_map_release();
+    }
+    return ret;
+}
+
+// Find the mapped index slot of a string
+static const DBIndexSlot* db_map_find(const char* str) {
+    const DBIndexHeader* hdr = (const DBIndexHeader*)db_map.idx;
+    if (!hdr) return NULL;
+    const DBIndexSlot* slots = (const DBIndexSlot*)(hdr + 1);
+    uint64_t key = db_string_key(str);
+    uint32_t mask = hdr->capacity - 1;
+
+    for (uint32_t probe = 0, i = (uint32_t)key & mask; probe < hdr->capacity; probe++, i = (i + 1) & mask) {
+        if (slots[i].key == 0) {
+            break; // Empty slot ends the probe sequence
+        }
+        if (slots[i].key != key) {
+            continue;
+        }
+        const char* candidate = db_record_string(db_record_at(db_map.db, db_map.db_size, slots[i].string));
+        if (candidate && strcmp(candidate, str) == 0) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+// Live PATH record of a path in the mapped database, ignoring the overlay
+static const DBPathRecord* db_map_lookup_path(const char* path) {
+    const DBIndexSlot* slot = db_map_find(path);
+    if (!slot || slot->path == 0) {
+        return NULL;
+    }
+    return db_record_path(db_record_at(db_map.db, db_map.db_size, slot->path));
+}
+
+static const char* db_map_string(uint32_t off) {
+    return db_record_string(db_record_at(db_map.db, db_map.db_size, off));
+}
+
+// Find the overlay entry of a path
+static DBOverlayEntry* overlay_find(const char* path) {
+    if (db_journal.capacity == 0) return NULL;
+    uint32_t mask = db_journal.capacity - 1;
+    for (uint32_t i = (uint32_t)db_string_key(path) & mask; db_journal.slots[i]; i = (i + 1) & mask) {
+        if (strcmp(db_journal.slots[i]->path, path) == 0) {
+            return db_journal.slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void overlay_entry_clear_refs(DBOverlayEntry* entry) {
+    for (uint32_t i = 0; i < entry->ref_count; i++) {
+        free(entry->refs[i]);
+    }
+    free(entry->refs);
+    entry->refs = NULL;
+    entry->ref_count = 0;
+}
+
+// Find the overlay entry of a path, adding a removed placeholder if there
+// is none yet
+static DBOverlayEntry* overlay_get(const char* path) {
+    DBOverlayEntry* entry = overlay_find(path);
+    if (entry) return entry;
+
+    if ((db_journal.count + 1) * 2 > db_journal.capacity) {
+        uint32_t capacity = db_journal.capacity ? db_journal.capacity * 2 : 256;
+        DBOverlayEntry** slots = calloc(capacity, sizeof(DBOverlayEntry*));
+        if (!slots) return NULL;
+        for (uint32_t i = 0; i < db_journal.capacity; i++) {
+            DBOverlayEntry* e = db_journal.slots[i];
+            if (!e) continue;
+            uint32_t j = (uint32_t)db_string_key(e->path) & (capacity - 1);
+            while (slots[j]) j = (j + 1) & (capacity - 1);
+            slots[j] = e;
+        }
+        free(db_journal.slots);
+        db_journal.slots = slots;
+        db_journal.capacity = capacity;
+    }
+
+    entry = calloc(1, sizeof(DBOverlayEntry));
+    if (!entry || !(entry->path = strdup(path))) {
+        free(entry);
+        return NULL;
+    }
+    entry->removed = 1;
+
+    uint32_t mask = db_journal.capacity - 1;
+    uint32_t i = (uint32_t)db_string_key(path) & mask;
+    while (db_journal.slots[i]) i = (i + 1) & mask;
+    db_journal.slots[i] = entry;
+    db_journal.count++;
+    return entry;
+}
+
+static void overlay_clear(void) {
+    for (uint32_t i = 0; i < db_journal.capacity; i++) {
+        DBOverlayEntry* entry = db_journal.slots[i];
+        if (!entry) continue;
+        overlay_entry_clear_refs(entry);
+        free(entry->path);
+        free(entry);
+    }
+    free(db_journal.slots);
+    db_journal.slots = NULL;
+    db_journal.capacity = 0;
+    db_journal.count = 0;
+}
+
+// Look up a registered path, overlay first. Returns 1 if found.
+static int db_lookup(const char* path, DBPathView* view) {
+    view->rec = NULL;
+    view->entry = NULL;
+    if (db_refresh() != 0) {
+        return 0;
+    }
+    const DBOverlayEntry* entry = overlay_find(path);
+    if (entry) {
+        if (entry->removed) return 0;
+        view->entry = entry;
+        return 1;
+    }
+    view->rec = db_map_lookup_path(path);
+    return view->rec != NULL;
+}
+
+static uint32_t view_ref_count(const DBPathView* view) {
+    return view->entry ? view->entry->ref_count : view->rec->ref_count;
+}
+
+// Reference i of a path, or NULL if it points at a damaged record
+static const char* view_ref(const DBPathView* view, uint32_t i) {
+    return view->entry ? view->entry->refs[i] : db_map_string(DB_PATH_REFS(view->rec)[i]);
+}
+
+static const char* view_hash(const DBPathView* view) {
+    const char* hash = view->entry ? view->entry->hash : view->rec->hash;
+    return memchr(hash, '\0', SHA256_DIGEST_STRING_LENGTH) ? hash : NULL;
+}
+
+static int view_hash_format(const DBPathView* view) {
+    return view->entry ? view->entry->hash_format : record_hash_format(view->rec);
+}
+
+// Copy the mapped state of a path into its overlay entry
+static void overlay_entry_load(DBOverlayEntry* entry, const DBPathRecord* prec) {
+    entry->creation_time = prec->creation_time;
+    memcpy(entry->hash, prec->hash, sizeof(entry->hash));
+    entry->hash[SHA256_DIGEST_STRING_LENGTH - 1] = '\0';
+    entry->hash_format = record_hash_format(prec);
+    entry->refs = calloc(prec->ref_count ? prec->ref_count : 1, sizeof(char*));
+    for (uint32_t i = 0; entry->refs && i < prec->ref_count; i++) {
+        const char* ref = db_map_string(DB_PATH_REFS(prec)[i]);
+        if (ref && (entry->refs[entry->ref_count] = strdup(ref)) != NULL) {
+            entry->ref_count++;
+        }
+    }
+}
+
+// Checksum of a journal entry, computed with its checksum field zeroed
+static uint32_t journal_checksum(const DBJournalEntry* e) {
+    DBJournalEntry hdr = *e;
+    hdr.checksum = 0;
+    uint32_t h = 2166136261u;
+    const unsigned char* p = (const unsigned char*)&hdr;
+    for (size_t i = 0; i < sizeof(hdr); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    p = (const unsigned char*)(e + 1);
+    for (size_t i = 0; i < e->size - sizeof(hdr); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Split the payload of an entry into n NUL-terminated strings. Returns 0
+// if the payload holds them all.
+static int journal_strings(const DBJournalEntry* e, const char** out, uint32_t n) {
+    const char* p = (const char*)(e + 1);
+    const char* end = (const char*)e + e->size;
+    for (uint32_t i = 0; i < n; i++) {
+        const char* nul = memchr(p, '\0', (size_t)(end - p));
+        if (!nul) return -1;
+        out[i] = p;
+        p = nul + 1;
+    }
+    return 0;
+}
+
+// Apply one journal entry to the overlay
+static void journal_apply_entry(const DBJournalEntry* e) {
+    const char* path;
+    if (journal_strings(e, &path, 1) != 0) return;
+
+    DBOverlayEntry* entry;
+    switch (e->op) {
+    case DB_OP_REGISTER: {
+        const char** strs = malloc((e->count + 1) * sizeof(char*));
+        if (!strs || journal_strings(e, strs, e->count + 1) != 0) {
+            free(strs);
+            return;
+        }
+        entry = overlay_find(path);
+        if (!entry) {
+            // First change to this path: start from the mapped record, if any
+            const DBPathRecord* prec = db_map_lookup_path(path);
+            if (!(entry = overlay_get(path))) {
+                free(strs);
+                return;
+            }
+            if (prec) {
+                overlay_entry_load(entry, prec);
+                entry->removed = 0;
+            }
+        }
+        if (entry->removed) {
+            // A new registration; an existing one keeps its time and hash
+            entry->creation_time = e->time;
+            memset(entry->hash, 0, sizeof(entry->hash));
+            entry->hash_format = DB_HASH_LEGACY;
+        }
+        overlay_entry_clear_refs(entry);
+        entry->refs = calloc(e->count ? e->count : 1, sizeof(char*));
+        for (uint32_t i = 0; entry->refs && i < e->count; i++) {
+            if ((entry->refs[entry->ref_count] = strdup(strs[i + 1])) != NULL) {
+                entry->ref_count++;
+            }
+        }
+        entry->removed = 0;
+        free(strs);
+        break;
+    }
+    case DB_OP_SET_HASH: {
+        const char* strs[2];
+        if (journal_strings(e, strs, 2) != 0) return;
+        entry = overlay_find(path);
+        if (!entry) {
+            const DBPathRecord* prec = db_map_lookup_path(path);
+            if (!prec || !(entry = overlay_get(path))) return;
+            overlay_entry_load(entry, prec);
+            entry->removed = 0;
+        }
+        if (entry->removed) return;
+        memset(entry->hash, 0, sizeof(entry->hash));
+        strncpy(entry->hash, strs[1], SHA256_DIGEST_STRING_LENGTH - 1);
+        entry->hash_format = (int)e->count;
+        break;
+    }
+    case DB_OP_REMOVE:
+        entry = overlay_get(path);
+        if (!entry) return;
+        overlay_entry_clear_refs(entry);
+        entry->creation_time = 0;
+        memset(entry->hash, 0, sizeof(entry->hash));
+        entry->hash_format = DB_HASH_LEGACY;
+        entry->removed = 1;
+        break;
+    }
+}
+
+// Validate the journal entry at buf + off. Returns it or NULL.
+static const DBJournalEntry* journal_entry_at(const char* buf, size_t size, size_t off) {
+    if (off + sizeof(DBJournalEntry) > size) return NULL;
+    const DBJournalEntry* e = (const DBJournalEntry*)(buf + off);
+    if (e->size < sizeof(DBJournalEntry) || e->size % 8 != 0 || off + e->size > size ||
+        journal_checksum(e) != e->checksum) {
+        return NULL;
+    }
+    return e;
+}
+
+// Find the complete groups in a journal buffer, applying them to the
+// overlay if apply is set. Returns the number of bytes they take up;
+// anything after that is an unfinished or damaged group.
+static size_t journal_scan(const char* buf, size_t size, int apply) {
+    size_t consumed = 0;
+    size_t off = 0;
+    uint32_t ops = 0;
+    const DBJournalEntry* e;
+    while ((e = journal_entry_at(buf, size, off)) != NULL) {
+        off += e->size;
+        if (e->op != DB_OP_COMMIT) {
+            ops++;
+            continue;
+        }
+        if (e->count != ops) break;
+        for (size_t pos = consumed; apply && pos < off - e->size; pos += ((const DBJournalEntry*)(buf + pos))->size) {
+            journal_apply_entry((const DBJournalEntry*)(buf + pos));
+        }
+        consumed = off;
+        ops = 0;
+    }
+    return consumed;
+}
+
+// Re-apply entries that are not committed yet, so they stay on top of
+// whatever other processes committed in the meantime
+static void journal_apply_pending(void) {
+    const DBJournalEntry* e;
+    for (size_t off = 0; (e = journal_entry_at(db_journal.pending, db_journal.pending_size, off)) != NULL; off += e->size) {
+        journal_apply_entry(e);
+    }
+}
+
+// Catch up with the journal on disk. Reloads everything if the journal or
+// database was replaced by a compaction.
+static int journal_refresh(int reload) {
+    int fd = open(JOURNAL_PATH, O_RDONLY);
+    struct stat st = {0};
+    if (fd != -1 && fstat(fd, &st) != 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    DBJournalHeader jhdr;
+    int usable = fd != -1 && st.st_size >= (off_t)sizeof(jhdr) &&
+                 pread(fd, &jhdr, sizeof(jhdr), 0) == sizeof(jhdr) &&
+                 memcmp(jhdr.magic, DB_JOURNAL_MAGIC, sizeof(jhdr.magic)) == 0 &&
+                 jhdr.version == DB_JOURNAL_VERSION && jhdr.generation == db_map.generation;
+    uint64_t ino = usable ? (uint64_t)st.st_ino : 0;
+    db_journal.seen_ino = (uint64_t)st.st_ino;
+    db_journal.seen_size = (uint64_t)st.st_size;
+
+    if (reload || ino != db_journal.journal_ino || (uint64_t)st.st_size < db_journal.journal_size) {
+        overlay_clear();
+        db_journal.journal_ino = ino;
+        db_journal.journal_size = usable ? sizeof(jhdr) : 0;
+        reload = 1;
+    }
+
+    int applied = 0;
+    if (usable && (uint64_t)st.st_size > db_journal.journal_size) {
+        size_t len = (size_t)((uint64_t)st.st_size - db_journal.journal_size);
+        char* buf = malloc(len);
+        if (buf && pread(fd, buf, len, (off_t)db_journal.journal_size) == (ssize_t)len) {
+            size_t consumed = journal_scan(buf, len, 1);
+            db_journal.journal_size += consumed;
+            applied = consumed > 0;
+        }
+        free(buf);
+    }
+    if (fd != -1) close(fd);
+
+    if ((reload || applied) && db_journal.pending_ops > 0) {
+        journal_apply_pending();
+    }
+    return 0;
+}
+
+// Bring the mapping and the overlay up to date with the files on disk.
+// Skipped while a reference walk holds pointers into them.
+static int db_refresh(void) {
+    if (db_journal.pinned > 0) {
+        return 0;
+    }
+    struct stat st;
+    int have_db = stat(DB_PATH, &st) == 0;
+    if (!db_journal.dropped &&
+        (have_db ? (db_map.db && (size_t)st.st_size == db_map.db_size && (uint64_t)st.st_ino == db_map.db_ino) : !db_map.db)) {
+        struct stat jst = {0};
+        if (stat(JOURNAL_PATH, &jst) != 0) memset(&jst, 0, sizeof(jst));
+        if ((uint64_t)jst.st_ino == db_journal.seen_ino && (uint64_t)jst.st_size == db_journal.seen_size) {
+            return 0; // Nothing changed since the last refresh
+        }
+    }
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        have_db = stat(DB_PATH, &st) == 0;
+        int reload = 0;
+        if (!have_db ? db_map.db != NULL :
+            (!db_map.db || (size_t)st.st_size != db_map.db_size || (uint64_t)st.st_ino != db_map.db_ino)) {
+            if (db_map_load() != 0) return -1;
+            reload = 1;
+        }
+        // Rebuilding the overlay also drops the changes of aborted transactions
+        journal_refresh(reload || db_journal.dropped);
+        db_journal.dropped = 0;
+
+        // A compaction may have swapped the database while the journal
+        // was being read; start over if so
+        have_db = stat(DB_PATH, &st) == 0;
+        if (have_db ? (db_map.db && (uint64_t)st.st_ino == db_map.db_ino) : !db_map.db) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Take the database lock. Writers, compaction and rebuilding the index
+// serialize on it; readers never need it. It can be taken again while
+// held: closing any descriptor of the lock file would drop the process's
+// lock, so the file stays open until the outermost db_unlock.
+static int db_lock(int wait) {
+    if (db_lock_state.depth > 0) {
+        db_lock_state.depth++;
+        return db_lock_state.fd;
+    }
+    if (ensure_db_dir_exists() != 0) return -1;
+    int fd = open(LOCK_PATH, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open database lock %s: %s\n", LOCK_PATH, strerror(errno));
+        return -1;
+    }
+    struct flock fl = {0};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) == -1) {
+        if (errno == EINTR) continue;
+        close(fd);
+        return -1;
+    }
+    db_lock_state.fd = fd;
+    db_lock_state.depth = 1;
+    return fd;
+}
+
+static void db_unlock(int fd) {
+    if (fd == -1 || fd != db_lock_state.fd || db_lock_state.depth == 0) return;
+    if (--db_lock_state.depth == 0) {
+        close(fd); // Closing releases the lock
+        db_lock_state.fd = -1;
+    }
+}
+
+// Merge the journal into a new database file. Caller holds the lock and
+// has committed all pending entries.
+static int db_compact_locked(void) {
+    if (db_refresh() != 0) return -1;
+
+    DBWriter w;
+    if (dbw_open(&w, db_map.generation + 1) != 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    const char** refs = NULL;
+    uint32_t refs_capacity = 0;
+    const DBRecordHeader* rec;
+    for (uint32_t off = sizeof(DBFileHeader); ret == 0 && (rec = db_record_at(db_map.db, db_map.db_size, off)) != NULL; off += rec->size) {
+        const DBPathRecord* prec = db_record_path(rec);
+        if (!prec) continue;
+        const char* path = db_map_string(prec->path);
+        if (!path || overlay_find(path)) continue; // Overlay state wins
+
+        if (prec->ref_count > refs_capacity) {
+            const char** new_refs = realloc(refs, prec->ref_count * sizeof(char*));
+            if (!new_refs) {
+                ret = -1;
+                break;
+            }
+            refs = new_refs;
+            refs_capacity = prec->ref_count;
+        }
+        uint32_t ref_count = 0;
+        for (uint32_t i = 0; i < prec->ref_count; i++) {
+            const char* ref = db_map_string(DB_PATH_REFS(prec)[i]);
+            if (ref) refs[ref_count++] = ref;
+        }
+        ret = dbw_add_path(&w, path, refs, ref_count, prec->creation_time, prec->hash, record_hash_format(prec));
+    }
+    free(refs);
+
+    for (uint32_t i = 0; ret == 0 && i < db_journal.capacity; i++) {
+        const DBOverlayEntry* entry = db_journal.slots[i];
+        if (!entry || entry->removed) continue;
+        ret = dbw_add_path(&w, entry->path, (const char* const*)entry->refs, entry->ref_count,
+                           entry->creation_time, entry->hash, entry->hash_format);
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "Failed to write compacted database\n");
+        dbw_finish(&w, 0);
+        return -1;
+    }
+    if (dbw_finish(&w, 1) != 0) {
+        return -1;
+    }
+
+    // The new database holds everything; a journal of the old generation
+    // is ignored from here on, so removing it cannot lose entries
+    unlink(JOURNAL_PATH);
+    return db_refresh();
+}
+
+// Generation of the database file on disk. The mapping can be older while
+// a reference walk pins it. 0 if there is no database yet.
+static int db_disk_generation(uint32_t* generation) {
+    *generation = 0;
+    int fd = open(DB_PATH, O_RDONLY);
+    if (fd == -1) return errno == ENOENT ? 0 : -1;
+    DBFileHeader fhdr;
+    int ok = pread(fd, &fhdr, sizeof(fhdr), 0) == sizeof(fhdr) &&
+             memcmp(fhdr.magic, DB_MAGIC, sizeof(fhdr.magic)) == 0;
+    close(fd);
+    if (!ok) return -1;
+    *generation = fhdr.generation;
+    return 0;
+}
+
+// End of the last complete group in the journal open at fd, read from the
+// file itself: 0 if it has no header for generation, so a new journal has
+// to be started; -1 if it cannot be read
+static off_t journal_committed_end(int fd, uint32_t generation) {
+    struct stat st;
+    DBJournalHeader jhdr;
+    if (fstat(fd, &st) != 0) return -1;
+    if (st.st_size < (off_t)sizeof(jhdr)) return 0;
+    if (pread(fd, &jhdr, sizeof(jhdr), 0) != sizeof(jhdr)) return -1;
+    if (memcmp(jhdr.magic, DB_JOURNAL_MAGIC, sizeof(jhdr.magic)) != 0 ||
+        jhdr.version != DB_JOURNAL_VERSION || jhdr.generation != generation) {
+        return 0;
+    }
+    size_t len = (size_t)st.st_size - sizeof(jhdr);
+    char* buf = malloc(len ? len : 1);
+    if (!buf) return -1;
+    off_t end = -1;
+    if (pread(fd, buf, len, sizeof(jhdr)) == (ssize_t)len) {
+        end = (off_t)(sizeof(jhdr) + journal_scan(buf, len, 0));
+    }
+    free(buf);
+    return end;
+}
+
+// Commit the pending entries as one group: a single append of all
+// entries plus a COMMIT entry, followed by one fsync. Caller holds the
+// lock.
+static int db_sync_locked(void) {
+    if (db_journal.pending_ops == 0) return 0;
+
+    // Pick up groups committed by others, so the local overlay matches
+    // the order the entries end up in on disk. While a walk pins the
+    // overlay this does nothing, and the cached journal size may be behind.
+    if (db_refresh() != 0) {
+        fprintf(stderr, "Failed to read the store database before committing\n");
+        return -1;
+    }
+
+    uint32_t generation;
+    if (db_disk_generation(&generation) != 0) {
+        fprintf(stderr, "Failed to read database header %s\n", DB_PATH);
+        return -1;
+    }
+    int fd = open(JOURNAL_PATH, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open journal %s: %s\n", JOURNAL_PATH, strerror(errno));
+        return -1;
+    }
+
+    // Where to append comes from the journal on disk, never from the
+    // cached size, so groups others committed are never cut off
+    struct stat st;
+    off_t end = journal_committed_end(fd, generation);
+    if (end < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to read journal %s: %s\n", JOURNAL_PATH, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    // Whether the overlay has replayed everything before this group
+    int caught_up = db_journal.journal_ino == (uint64_t)st.st_ino && (off_t)db_journal.journal_size == end;
+
+    // Start a new journal, or cut off a group left unfinished by a crash
+    if (end == 0) {
+        DBJournalHeader jhdr = {0};
+        memcpy(jhdr.magic, DB_JOURNAL_MAGIC, sizeof(jhdr.magic));
+        jhdr.version = DB_JOURNAL_VERSION;
+        jhdr.generation = generation;
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, &jhdr, sizeof(jhdr), 0) != sizeof(jhdr) || fstat(fd, &st) != 0) {
+            fprintf(stderr, "Failed to initialize journal %s: %s\n", JOURNAL_PATH, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        end = sizeof(jhdr);
+        // Entries of an old generation are in the database already
+        db_journal.journal_ino = (uint64_t)st.st_ino;
+        db_journal.journal_size = (uint64_t)end;
+        caught_up = 1;
+    } else if (st.st_size > end && ftruncate(fd, end) != 0) {
+        fprintf(stderr, "Failed to truncate journal %s: %s\n", JOURNAL_PATH, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    DBJournalEntry commit = {0};
+    commit.size = sizeof(commit);
+    commit.op = DB_OP_COMMIT;
+    commit.count = db_journal.pending_ops;
+    commit.checksum = journal_checksum(&commit);
+
+    size_t len = db_journal.pending_size + sizeof(commit);
+    char* group = malloc(len);
+    if (!group) {
+        close(fd);
+        return -1;
+    }
+    memcpy(group, db_journal.pending, db_journal.pending_size);
+    memcpy(group + db_journal.pending_size, &commit, sizeof(commit));
+
+    int ret = 0;
+    if (pwrite(fd, group, len, end) != (ssize_t)len || fsync(fd) != 0) {
+        fprintf(stderr, "Failed to write journal %s: %s\n", JOURNAL_PATH, strerror(errno));
+        ftruncate(fd, end);
+        ret = -1;
+    }
+    free(group);
+    close(fd);
+
+    if (ret == 0) {
+        // Otherwise the next refresh replays the missed groups and this one
+        if (caught_up) db_journal.journal_size = (uint64_t)end + len;
+        db_journal.pending_size = 0;
+        db_journal.pending_ops = 0;
+    }
+    return ret;
+}
+
+// Commit buffered database changes to the journal. Inside a transaction
+// this waits for the outermost db_txn_commit.
+int db_sync(void) {
+    if (db_journal.pending_ops == 0 || db_journal.txn_depth > 0) return 0;
+    int lock = db_lock(1);
+    if (lock == -1) return -1;
+    int ret = db_sync_locked();
+    // Compaction writes out the overlay, which must not be behind the
+    // journal; a pinned one may be
+    if (ret == 0 && db_journal.pinned == 0 && db_journal.journal_size > DB_JOURNAL_MAX_BYTES) {
+        ret = db_compact_locked();
+    }
+    db_unlock(lock);
+    return ret;
+}
+
+// Run at exit: commit what is buffered, then compact a large journal in
+// a background child so the command itself does not wait for it
+static void db_exit_hook(void) {
+    // No reference walk resumes after exit, so the overlay may be rebuilt
+    db_journal.pinned = 0;
+    // Transactions left open are dropped, not committed half done
+    while (db_journal.txn_depth > 0) {
+        db_txn_abort();
+    }
+    if (db_sync() != 0) {
+        fprintf(stderr, "Warning: Failed to commit pending database changes\n");
+    }
+    if (db_journal.journal_size <= DB_JOURNAL_COMPACT_BYTES) {
+        return;
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid > 0) {
+        return;
+    }
+    int lock = db_lock(0); // Skip if another process is at it
+    if (lock != -1) {
+        db_compact_locked();
+        db_unlock(lock);
+    }
+    if (pid == 0) {
+        _exit(0);
+    }
+}
+
+// Rebuild the overlay from the journal and what is still pending, after
+// pending entries were dropped. A reference walk holds pointers into it,
+// so then the next refresh does it once the walk is done; compaction
+// refreshes first, so it never writes out the dropped changes.
+static void journal_drop_overlay(void) {
+    if (db_journal.pinned == 0) {
+        journal_refresh(1);
+    } else {
+        db_journal.dropped = 1;
+    }
+}
+
+// Buffer a journal entry built from strs and apply it to the overlay.
+// Outside a transaction it is committed (and synced) before returning,
+// so a change is on disk once the caller reports it; batch changes in a
+// transaction to share one group and one fsync.
+static int db_journal_append(uint16_t op, uint32_t count, int64_t time, const char** strs, uint32_t nstrs) {
+    size_t payload = 0;
+    for (uint32_t i = 0; i < nstrs; i++) {
+        payload += strlen(strs[i]) + 1;
+    }
+    size_t size = DB_ALIGN(sizeof(DBJournalEntry) + payload);
+    if (size > UINT32_MAX) return -1;
+
+    if (db_journal.pending_size + size > db_journal.pending_capacity) {
+        size_t capacity = db_journal.pending_capacity ? db_journal.pending_capacity : 4096;
+        while (capacity < db_journal.pending_size + size) capacity *= 2;
+        char* pending = realloc(db_journal.pending, capacity);
+        if (!pending) {
+            fprintf(stderr, "Memory allocation failed for journal entry\n");
             return -1;
         }
-    } else if (!S_ISDIR(st.st_mode)) {
-         fprintf(stderr, "Error: %s exists but is not a directory.\n", dir);
-         return -1;
+        db_journal.pending = pending;
+        db_journal.pending_capacity = capacity;
+    }
+
+    DBJournalEntry* e = (DBJournalEntry*)(db_journal.pending + db_journal.pending_size);
+    memset(e, 0, size);
+    e->size = (uint32_t)size;
+    e->op = op;
+    e->count = count;
+    e->time = time;
+    char* p = (char*)(e + 1);
+    for (uint32_t i = 0; i < nstrs; i++) {
+        size_t len = strlen(strs[i]) + 1;
+        memcpy(p, strs[i], len);
+        p += len;
+    }
+    e->checksum = journal_checksum(e);
+
+    db_journal.pending_size += size;
+    db_journal.pending_ops++;
+    journal_apply_entry(e);
+
+    if (!db_journal.exit_hook) {
+        atexit(db_exit_hook);
+        db_journal.exit_hook = 1;
     }
+    if (db_journal.txn_depth > 0) {
+        return 0;
+    }
+    int ret = db_sync();
+    if (ret != 0 && db_journal.pending_ops > 0) {
+        // Not on disk, so it must not be committed later either
+        db_journal.pending_size -= size;
+        db_journal.pending_ops--;
+        journal_drop_overlay();
+    }
+    return ret;
+}
+
+// Start a transaction. Until the matching db_txn_commit, changes are only
+// buffered and applied to the overlay; the outermost commit writes all of
+// them as a single journal group, so they land together or not at all.
+// Transactions nest, and aborting an inner one keeps the outer one.
+int db_txn_begin(void) {
+    if (db_journal.txn_depth >= DB_TXN_MAX_DEPTH) {
+        fprintf(stderr, "Database transactions nested too deeply\n");
+        return -1;
+    }
+    db_journal.txn_mark[db_journal.txn_depth] = db_journal.pending_size;
+    db_journal.txn_ops_mark[db_journal.txn_depth] = db_journal.pending_ops;
+    db_journal.txn_depth++;
     return 0;
 }
 
-// Open the database file
-static FILE* open_db(const char* mode) {
-    if (ensure_db_dir_exists() != 0) {
-        return NULL;
+// Commit the innermost transaction
+int db_txn_commit(void) {
+    if (db_journal.txn_depth == 0) {
+        fprintf(stderr, "No database transaction to commit\n");
+        return -1;
+    }
+    if (--db_journal.txn_depth > 0) {
+        return 0; // Part of the enclosing transaction now
+    }
+    return db_sync();
+}
+
+// Drop the changes of the innermost transaction
+void db_txn_abort(void) {
+    if (db_journal.txn_depth == 0) {
+        return;
     }
-    return fopen(DB_PATH, mode);
+    db_journal.txn_depth--;
+    db_journal.pending_size = db_journal.txn_mark[db_journal.txn_depth];
+    db_journal.pending_ops = db_journal.txn_ops_mark[db_journal.txn_depth];
+
+    journal_drop_overlay();
 }
 
 // Register a new path in the database
@@ -62,150 +1674,294 @@ int db_register_path(const char* path, const char** references) {
         return -1;
     }
 
-    // First check if database exists
-    FILE* db = open_db("a+");
-    if (!db) {
+    if (ensure_db_dir_exists() != 0) {
         fprintf(stderr, "Failed to open database for registration\n");
         return -1;
     }
 
     // Check if path already exists
-    rewind(db);
-    DBEntry existing;
-    while (fread(&existing, sizeof(existing), 1, db) == 1) {
-        if (strcmp(existing.path, path) == 0) {
-            // Only update references if provided
-            if (references) {
-                // Update references
-                memset(existing.references, 0, sizeof(existing.references));
-                existing.ref_count = 0;
-                for (int i = 0; references[i] != NULL && i < 10; i++) {
-                    strncpy(existing.references[i], references[i], PATH_MAX - 1);
-                    existing.references[i][PATH_MAX - 1] = '\0';
-                    existing.ref_count++;
-                }
-                
-                // Seek back and write updated entry
-                fseek(db, -(long)sizeof(existing), SEEK_CUR);
-                if (fwrite(&existing, sizeof(existing), 1, db) != 1) {
-                    fprintf(stderr, "Failed to update references for %s\n", path);
-                    fclose(db);
-                    return -1;
-                }
-            }
-            fclose(db);
-            return 0; // Path already registered
-        }
+    DBPathView view;
+    int exists = db_lookup(path, &view);
+    uint32_t ref_count = 0;
+    while (references && references[ref_count] != NULL) {
+        ref_count++;
     }
-
-    // Create new entry
-    DBEntry entry;
-    memset(&entry, 0, sizeof(entry)); // Zero everything including hash
-    
-    // Copy path
-    strncpy(entry.path, path, PATH_MAX - 1);
-    entry.path[PATH_MAX - 1] = '\0';
-
-    // Add references if provided
-    entry.ref_count = 0;
-    if (references) {
-        for (int i = 0; references[i] != NULL && i < 10; i++) {
-            strncpy(entry.references[i], references[i], PATH_MAX - 1);
-            entry.references[i][PATH_MAX - 1] = '\0';
-            entry.ref_count++;
+    if (exists) {
+        if (!references) {
+            return 0; // Path already registered, nothing to update
         }
+        // Skip the write if the reference list is unchanged
+        int same = view_ref_count(&view) == ref_count;
+        for (uint32_t i = 0; same && i < ref_count; i++) {
+            const char* ref = view_ref(&view, i);
+            same = ref && strcmp(ref, references[i]) == 0;
+        }
+        if (same) return 0;
     }
 
-    // Set creation time
-    entry.creation_time = time(NULL);
+    const char** strs = malloc((ref_count + 1) * sizeof(char*));
+    if (!strs) {
+        fprintf(stderr, "Memory allocation failed for registration of %s\n", path);
+        return -1;
+    }
+    strs[0] = path;
+    for (uint32_t i = 0; i < ref_count; i++) {
+        strs[i + 1] = references[i];
+    }
+    int ret = db_journal_append(DB_OP_REGISTER, ref_count, time(NULL), strs, ref_count + 1);
+    free(strs);
 
-    // Write the new entry at end of file
-    fseek(db, 0, SEEK_END);
-    if (fwrite(&entry, sizeof(entry), 1, db) != 1) {
+    if (ret != 0) {
         fprintf(stderr, "Failed to write entry for %s to database\n", path);
-        fclose(db);
         return -1;
     }
-
-    // Ensure write is flushed to disk
-    fflush(db);
-    fclose(db);
-
-    printf("Successfully registered %s in database\n", path);
+    if (!exists) {
+        printf("Successfully registered %s in database\n", path);
+    }
     return 0;
 }
 
 // Check if a path exists in the database
 int db_path_exists(const char* path) {
-    FILE* db = open_db("r");
-    if (!db) {
-        return 0;  // Database doesn't exist or can't be opened
-    }
+    DBPathView view;
+    return db_lookup(path, &view);
+}
 
-    DBEntry entry;
-    while (fread(&entry, sizeof(entry), 1, db) == 1) {
-        if (strcmp(entry.path, path) == 0) {
-            fclose(db);
-            return 1;
-        }
+// Call fn for each reference of a path, passing pointers into the mapped
+// database. Stops early and returns fn's value if it is non-zero.
+int db_foreach_reference(const char* path, int (*fn)(const char* ref, void* arg), void* arg) {
+    DBPathView view;
+    if (!db_lookup(path, &view)) {
+        return -1; // Path not found
     }
 
-    fclose(db);
-    return 0;
+    // fn may query the database again, e.g. to walk the closure; keep the
+    // current mapping and overlay in place until the walk is done
+    int ret = 0;
+    uint32_t ref_count = view_ref_count(&view);
+    db_journal.pinned++;
+    for (uint32_t i = 0; i < ref_count && ret == 0; i++) {
+        const char* ref = view_ref(&view, i);
+        if (!ref) continue; // Skip references to damaged records
+        ret = fn(ref, arg);
+    }
+    db_journal.pinned--;
+    return ret;
 }
 
 // Get all references for a path
 char** db_get_references(const char* path) {
-    FILE* db = open_db("r");
-    if (!db) {
-        return NULL;
+    DBPathView view;
+    if (!db_lookup(path, &view)) {
+        return NULL; // Path not found
     }
 
-    DBEntry entry;
-    while (fread(&entry, sizeof(entry), 1, db) == 1) {
-        if (strcmp(entry.path, path) == 0) {
-            // Found the entry, create a return array
-            if (entry.ref_count <= 0) { // Handle case with 0 references
-                 fclose(db);
-                 char** refs = malloc(sizeof(char*)); // Allocate space for NULL terminator
-                 if (refs) refs[0] = NULL;
-                 return refs;
-            }
+    uint32_t ref_count = view_ref_count(&view);
+    char** refs = malloc((ref_count + 1) * sizeof(char*));
+    if (!refs) {
+        return NULL; // Allocation failure
+    }
 
-            char** refs = malloc((entry.ref_count + 1) * sizeof(char*));
-            if (!refs) {
-                fclose(db);
-                return NULL; // Allocation failure
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < ref_count; i++) {
+        const char* ref = view_ref(&view, i);
+        if (!ref) continue; // Skip references to damaged records
+        refs[count] = strdup(ref);
+        if (!refs[count]) {
+            // Memory allocation failed, free allocated memory so far
+            fprintf(stderr, "Memory allocation failed for reference string\n");
+            for (uint32_t j = 0; j < count; j++) {
+                free(refs[j]);
             }
+            free(refs);
+            return NULL;
+        }
+        count++;
+    }
+    refs[count] = NULL;  // Null-terminate the array
+
+    return refs;
+}
+
+// Referrers list of a string in the mapped index: a count followed by
+// PATH record offsets. NULL if nothing in the mapped database refers to it.
+static const uint32_t* db_map_referrers(const char* str) {
+    const DBIndexSlot* slot = db_map_find(str);
+    if (!slot || slot->referrers == 0 || slot->referrers % sizeof(uint32_t) != 0 ||
+        (size_t)slot->referrers + sizeof(uint32_t) > db_map.idx_size) {
+        return NULL;
+    }
+    const uint32_t* list = (const uint32_t*)(db_map.idx + slot->referrers);
+    if (list[0] > (db_map.idx_size - slot->referrers) / sizeof(uint32_t) - 1) {
+        return NULL;
+    }
+    return list;
+}
+
+// Call fn for each registered path that references path. Referrers in
+// the mapped database come from the index; paths changed since the last
+// compaction are checked in the overlay. Stops early and returns fn's
+// value if it is non-zero.
+int db_foreach_referrer(const char* path, int (*fn)(const char* referrer, void* arg), void* arg) {
+    if (db_refresh() != 0) {
+        return -1;
+    }
 
-            int allocated_count = 0;
-            for (int i = 0; i < entry.ref_count; i++) {
-                refs[i] = strdup(entry.references[i]);
-                if (!refs[i]) {
-                    // Memory allocation failed, free allocated memory so far
-                    fprintf(stderr, "Memory allocation failed for reference string\n");
-                    for (int j = 0; j < i; j++) {
-                        free(refs[j]);
-                    }
-                    free(refs);
-                    fclose(db);
-                    return NULL;
-                }
-                 allocated_count++;
+    int ret = 0;
+    db_journal.pinned++;
+    const uint32_t* list = db_map_referrers(path);
+    for (uint32_t i = 0; list && i < list[0] && ret == 0; i++) {
+        const DBPathRecord* prec = db_record_path(db_record_at(db_map.db, db_map.db_size, list[i + 1]));
+        const char* referrer = prec ? db_map_string(prec->path) : NULL;
+        if (!referrer || overlay_find(referrer)) continue; // Overlay state wins
+        ret = fn(referrer, arg);
+    }
+    for (uint32_t i = 0; i < db_journal.capacity && ret == 0; i++) {
+        const DBOverlayEntry* entry = db_journal.slots[i];
+        if (!entry || entry->removed) continue;
+        for (uint32_t j = 0; j < entry->ref_count; j++) {
+            if (strcmp(entry->refs[j], path) == 0) {
+                ret = fn(entry->path, arg);
+                break;
             }
-            refs[allocated_count] = NULL;  // Null-terminate the array
+        }
+    }
+    db_journal.pinned--;
+    return ret;
+}
+
+// Call fn for every registered path. fn may query the database but not
+// modify it. Stops early and returns fn's value if it is non-zero.
+int db_foreach_path(int (*fn)(const char* path, void* arg), void* arg) {
+    if (db_refresh() != 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    db_journal.pinned++;
+    const DBRecordHeader* rec;
+    for (uint32_t off = sizeof(DBFileHeader); ret == 0 && (rec = db_record_at(db_map.db, db_map.db_size, off)) != NULL; off += rec->size) {
+        const DBPathRecord* prec = db_record_path(rec);
+        if (!prec) continue;
+        const char* path = db_map_string(prec->path);
+        if (!path || overlay_find(path)) continue; // Overlay state wins
+        ret = fn(path, arg);
+    }
+    for (uint32_t i = 0; i < db_journal.capacity && ret == 0; i++) {
+        const DBOverlayEntry* entry = db_journal.slots[i];
+        if (!entry || entry->removed) continue;
+        ret = fn(entry->path, arg);
+    }
+    db_journal.pinned--;
+    return ret;
+}
+
+// Growable NULL-terminated list of strings with a hash set to skip
+// duplicates, used to collect query results
+typedef struct {
+    char** items;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* set;       // Open addressing table of item numbers + 1
+    uint32_t set_capacity;
+} DBPathList;
+
+static void path_list_free(DBPathList* list) {
+    for (uint32_t i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    free(list->set);
+}
 
-            fclose(db);
-            return refs;
+// Add a copy of str unless it is already listed. Returns 1 if added, 0 if
+// already present, -1 on allocation failure.
+static int path_list_add(DBPathList* list, const char* str) {
+    if ((list->count + 1) * 2 > list->set_capacity) {
+        uint32_t set_capacity = list->set_capacity ? list->set_capacity * 2 : 64;
+        uint32_t* set = calloc(set_capacity, sizeof(uint32_t));
+        if (!set) return -1;
+        for (uint32_t i = 0; i < list->count; i++) {
+            uint32_t j = (uint32_t)db_string_key(list->items[i]) & (set_capacity - 1);
+            while (set[j]) j = (j + 1) & (set_capacity - 1);
+            set[j] = i + 1;
         }
+        free(list->set);
+        list->set = set;
+        list->set_capacity = set_capacity;
     }
 
-    fclose(db);
-    return NULL; // Path not found
+    uint32_t mask = list->set_capacity - 1;
+    uint32_t j = (uint32_t)db_string_key(str) & mask;
+    for (; list->set[j]; j = (j + 1) & mask) {
+        if (strcmp(list->items[list->set[j] - 1], str) == 0) return 0;
+    }
+
+    if (list->count + 2 > list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+        char** items = realloc(list->items, capacity * sizeof(char*));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    char* copy = strdup(str);
+    if (!copy) return -1;
+    list->items[list->count] = copy;
+    list->set[j] = ++list->count;
+    list->items[list->count] = NULL;
+    return 1;
 }
 
-// Helper function for removing lines from text files (like roots)
-static int remove_line_from_file(const char* filepath, const char* line_to_remove) {
+static int collect_referrer(const char* referrer, void* arg) {
+    return path_list_add((DBPathList*)arg, referrer) < 0 ? -1 : 0;
+}
+
+// Hand the collected strings to the caller as a NULL-terminated array
+static char** path_list_take(DBPathList* list) {
+    char** items = list->items;
+    if (!items) {
+        items = calloc(1, sizeof(char*));
+    }
+    free(list->set);
+    return items;
+}
+
+// Get all paths that reference path
+char** db_get_referrers(const char* path) {
+    DBPathList list = {0};
+    if (db_foreach_referrer(path, collect_referrer, &list) != 0) {
+        path_list_free(&list);
+        return NULL;
+    }
+    return path_list_take(&list);
+}
+
+// Get path and every path that references it, directly or indirectly
+char** db_get_referrers_closure(const char* path) {
+    DBPathList list = {0};
+    if (path_list_add(&list, path) < 0) {
+        path_list_free(&list);
+        return NULL;
+    }
+    // The list doubles as the work queue: each entry is expanded once
+    for (uint32_t i = 0; i < list.count; i++) {
+        char* current = list.items[i];
+        if (db_foreach_referrer(current, collect_referrer, &list) != 0) {
+            path_list_free(&list);
+            return NULL;
+        }
+    }
+    return path_list_take(&list);
+}
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// Helper function for removing lines from text files (like roots). Every
+// line equal to one of the n given strings is dropped in a single
+// rewrite. Returns the number of lines removed, or -1 on error.
+static int remove_lines_from_file(const char* filepath, const char** lines_to_remove, int n) {
     char temp_path[PATH_MAX];
     snprintf(temp_path, PATH_MAX, "%s%s", filepath, TEMP_SUFFIX);
 
@@ -215,39 +1971,51 @@ static int remove_line_from_file(const char* filepath, const char* line_to_remov
         return 0; 
     }
 
+    // Sorted copy of the lines for binary search
+    const char** sorted = malloc((n > 0 ? n : 1) * sizeof(char*));
+    if (!sorted) {
+        fclose(original);
+        return -1;
+    }
+    memcpy(sorted, lines_to_remove, n * sizeof(char*));
+    qsort(sorted, n, sizeof(char*), compare_strings);
+
     FILE* temp = fopen(temp_path, "w");
     if (!temp) {
         fprintf(stderr, "Failed to open temporary file %s: %s\n", temp_path, strerror(errno));
-        if (original) fclose(original);
+        fclose(original);
+        free(sorted);
         return -1;
     }
 
     int found = 0;
-    if (original) { // Only read if original file was opened
-        char line[PATH_MAX];
-        while (fgets(line, PATH_MAX, original)) {
-            // Remove newline if present for comparison
-            size_t len = strlen(line);
-            if (len > 0 && line[len-1] == '\n') {
-                line[len-1] = '\0';
-            }
+    char line[PATH_MAX];
+    while (fgets(line, PATH_MAX, original)) {
+        // Remove newline if present for comparison
+        size_t len = strlen(line);
+        int had_newline = len > 0 && line[len-1] == '\n';
+        if (had_newline) {
+            line[len-1] = '\0';
+        }
 
-            if (strcmp(line, line_to_remove) == 0) {
-                found = 1; // Found the line, don't write it to temp
-            } else {
-                 // Write back the original line with newline
-                 line[len-1] = '\n'; // Put newline back if removed
-                 if (fputs(line, temp) == EOF) {
-                     fprintf(stderr, "Failed to write to temporary file %s\n", temp_path);
-                     fclose(original);
-                     fclose(temp);
-                     remove(temp_path); // Attempt cleanup
-                     return -1;
-                 }
-            }
+        const char* key = line;
+        if (bsearch(&key, sorted, n, sizeof(char*), compare_strings)) {
+            found++; // Found the line, don't write it to temp
+            continue;
+        }
+        // Write back the original line with newline
+        if (had_newline) line[len-1] = '\n';
+        if (fputs(line, temp) == EOF) {
+            fprintf(stderr, "Failed to write to temporary file %s\n", temp_path);
+            fclose(original);
+            fclose(temp);
+            free(sorted);
+            remove(temp_path); // Attempt cleanup
+            return -1;
         }
-        fclose(original);
     }
+    fclose(original);
+    free(sorted);
 
     if (fclose(temp) != 0) {
         fprintf(stderr, "Failed to close temporary file %s: %s\n", temp_path, strerror(errno));
@@ -255,6 +2023,12 @@ static int remove_line_from_file(const char* filepath, const char* line_to_remov
         return -1;
     }
 
+    // Leave the file untouched if nothing matched
+    if (!found) {
+        remove(temp_path);
+        return 0;
+    }
+
     // Replace the old file with the new one
     if (rename(temp_path, filepath) == -1) {
         fprintf(stderr, "Failed to rename %s to %s: %s\n", temp_path, filepath, strerror(errno));
@@ -262,70 +2036,300 @@ static int remove_line_from_file(const char* filepath, const char* line_to_remov
         return -1;
     }
 
-    // Return 1 if removed, 0 if not found (but no error)
-    return found ? 1 : 0;
+    return found;
 }
 
-// Remove a path from the database (called by GC)
-int db_remove_path(const char* path) {
-    // Check if the path exists in the database
-    FILE* db = open_db("r");
-    // If db doesn't exist, nothing to remove
-    if (!db) return 0;
-
-    char temp_db_path[PATH_MAX];
-    snprintf(temp_db_path, PATH_MAX, "%s%s", DB_PATH, TEMP_SUFFIX);
-
-    FILE* temp_db = fopen(temp_db_path, "w");
-    if (!temp_db) {
-        fprintf(stderr, "Failed to open temporary db file %s: %s\n", temp_db_path, strerror(errno));
-        fclose(db);
-        return -1;
-    }
-
-    // Copy all entries except the one to remove
-    DBEntry entry;
-    int found_in_db = 0;
-    while (fread(&entry, sizeof(entry), 1, db) == 1) {
-        if (strcmp(entry.path, path) != 0) {
-            if (fwrite(&entry, sizeof(entry), 1, temp_db) != 1) {
-                fprintf(stderr, "Failed to write to temporary db file %s\n", temp_db_path);
-                 fclose(db);
-                 fclose(temp_db);
-                 remove(temp_db_path);
-                 return -1;
+// Remove a single line. Returns 1 if removed, 0 if not found (but no
+// error), -1 on error.
+static int remove_line_from_file(const char* filepath, const char* line_to_remove) {
+    int ret = remove_lines_from_file(filepath, &line_to_remove, 1);
+    return ret > 0 ? 1 : ret;
+}
+
+// Library index: maps a library file name (soname) to the store path
+// providing it, so dependency resolution does not have to search the
+// store. The file holds "name<TAB>store path" lines; later lines win.
+// It is appended to on registration and loaded into a hash table, which
+// is reread only when the file changes. Removed store paths are dropped
+// from the file by db_remove_path(s).
+typedef struct {
+    char* name;
+    char* path;
+} DBLibEntry;
+
+static struct {
+    DBLibEntry* slots;
+    uint32_t capacity;  // Power of two
+    uint32_t count;
+    uint64_t ino;       // File the table was loaded from
+    uint64_t size;      // Bytes of it loaded so far
+} db_libs;
+
+static void db_libs_clear(void) {
+    for (uint32_t i = 0; i < db_libs.capacity; i++) {
+        free(db_libs.slots[i].name);
+        free(db_libs.slots[i].path);
+    }
+    free(db_libs.slots);
+    memset(&db_libs, 0, sizeof(db_libs));
+}
+
+static DBLibEntry* db_libs_slot(const char* name) {
+    uint32_t mask = db_libs.capacity - 1;
+    uint32_t i = (uint32_t)db_string_key(name) & mask;
+    while (db_libs.slots[i].name && strcmp(db_libs.slots[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &db_libs.slots[i];
+}
+
+// Insert or replace the provider of a library in the table
+static int db_libs_set(const char* name, const char* path) {
+    if ((db_libs.count + 1) * 2 > db_libs.capacity) {
+        DBLibEntry* old = db_libs.slots;
+        uint32_t old_capacity = db_libs.capacity;
+        uint32_t capacity = old_capacity ? old_capacity * 2 : 256;
+        DBLibEntry* slots = calloc(capacity, sizeof(DBLibEntry));
+        if (!slots) return -1;
+        db_libs.slots = slots;
+        db_libs.capacity = capacity;
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i].name) *db_libs_slot(old[i].name) = old[i];
+        }
+        free(old);
+    }
+
+    DBLibEntry* slot = db_libs_slot(name);
+    char* copy = strdup(path);
+    if (!copy) return -1;
+    if (slot->name) {
+        free(slot->path);
+    } else if (!(slot->name = strdup(name))) {
+        free(copy);
+        return -1;
+    } else {
+        db_libs.count++;
+    }
+    slot->path = copy;
+    return 0;
+}
+
+// Load lines appended since the last call, or everything if the file
+// was replaced
+static void db_libs_refresh(void) {
+    struct stat st;
+    if (stat(LIBS_PATH, &st) != 0) {
+        if (db_libs.ino != 0) db_libs_clear();
+        return;
+    }
+    if ((uint64_t)st.st_ino != db_libs.ino || (uint64_t)st.st_size < db_libs.size) {
+        db_libs_clear();
+        db_libs.ino = (uint64_t)st.st_ino;
+    }
+    if ((uint64_t)st.st_size == db_libs.size) {
+        return;
+    }
+
+    FILE* f = fopen(LIBS_PATH, "r");
+    if (!f || fseeko(f, (off_t)db_libs.size, SEEK_SET) != 0) {
+        if (f) fclose(f);
+        return;
+    }
+    char line[PATH_MAX * 2];
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len-1] != '\n') {
+            break; // Partly written line, read it next time
+        }
+        db_libs.size += len;
+        line[len-1] = '\0';
+        char* tab = strchr(line, '\t');
+        if (!tab) continue;
+        *tab = '\0';
+        db_libs_set(line, tab + 1);
+    }
+    fclose(f);
+}
+
+// Record that store_path provides the library file name
+int db_register_library(const char* name, const char* store_path) {
+    if (!name || !store_path || strpbrk(name, "\t\n") || strchr(store_path, '\n')) {
+        return -1;
+    }
+    db_libs_refresh();
+    if (db_libs.capacity > 0) {
+        const DBLibEntry* slot = db_libs_slot(name);
+        if (slot->name && strcmp(slot->path, store_path) == 0) {
+            return 0; // Already recorded
+        }
+    }
+
+    if (ensure_db_dir_exists() != 0) {
+        return -1;
+    }
+    // A single append of a whole line, so concurrent writers do not
+    // interleave; under the lock, so a rewrite cannot drop it
+    char line[PATH_MAX * 2];
+    int len = snprintf(line, sizeof(line), "%s\t%s\n", name, store_path);
+    if (len < 0 || len >= (int)sizeof(line)) {
+        return -1;
+    }
+    int lock = db_lock(1);
+    if (lock == -1) {
+        return -1;
+    }
+    int fd = open(LIBS_PATH, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd == -1 || write(fd, line, len) != len) {
+        fprintf(stderr, "Failed to update library index %s: %s\n", LIBS_PATH, strerror(errno));
+        if (fd != -1) close(fd);
+        db_unlock(lock);
+        return -1;
+    }
+    close(fd);
+    db_unlock(lock);
+    return db_libs_set(name, store_path);
+}
+
+// Store path providing a library file name, or NULL. Entries whose store
+// path is no longer registered are ignored. The string is valid until
+// the next library index call.
+const char* db_find_library(const char* name) {
+    db_libs_refresh();
+    if (db_libs.capacity == 0) {
+        return NULL;
+    }
+    const DBLibEntry* slot = db_libs_slot(name);
+    if (!slot->name || !db_path_exists(slot->path)) {
+        return NULL;
+    }
+    return slot->path;
+}
+
+// Rewrite the library index without the lines of paths; caller holds
+// the lock
+static int db_libs_rewrite(const char** paths, int n) {
+    FILE* original = fopen(LIBS_PATH, "r");
+    if (!original) {
+        return 0;
+    }
+
+    char temp_path[PATH_MAX];
+    db_temp_path(temp_path, LIBS_PATH);
+    const char** sorted = malloc((n > 0 ? n : 1) * sizeof(char*));
+    FILE* temp = sorted ? fopen(temp_path, "w") : NULL;
+    if (!temp) {
+        fclose(original);
+        free(sorted);
+        return -1;
+    }
+    memcpy(sorted, paths, n * sizeof(char*));
+    qsort(sorted, n, sizeof(char*), compare_strings);
+
+    int found = 0;
+    int ret = 0;
+    char line[PATH_MAX * 2];
+    while (fgets(line, sizeof(line), original)) {
+        size_t len = strlen(line);
+        char* tab = strchr(line, '\t');
+        if (tab && len > 0 && line[len-1] == '\n') {
+            line[len-1] = '\0';
+            const char* key = tab + 1;
+            int drop = bsearch(&key, sorted, n, sizeof(char*), compare_strings) != NULL;
+            line[len-1] = '\n';
+            if (drop) {
+                found++;
+                continue;
             }
-        } else {
-            found_in_db = 1;
+        }
+        if (fputs(line, temp) == EOF) {
+            ret = -1;
+            break;
         }
     }
+    fclose(original);
+    free(sorted);
 
-    fclose(db);
-    if (fclose(temp_db) != 0) {
-         fprintf(stderr, "Failed to close temporary db file %s: %s\n", temp_db_path, strerror(errno));
-         remove(temp_db_path);
-         return -1;
+    if (fclose(temp) != 0) ret = -1;
+    if (ret != 0 || found == 0) {
+        remove(temp_path);
+        return ret;
+    }
+    if (rename(temp_path, LIBS_PATH) == -1) {
+        fprintf(stderr, "Failed to update library index %s: %s\n", LIBS_PATH, strerror(errno));
+        remove(temp_path);
+        return -1;
+    }
+    return found;
+}
+
+// Drop the library index entries of removed store paths. The rewrite
+// holds the lock, so no line appended meanwhile is lost.
+static int db_libs_remove_paths(const char** paths, int n) {
+    int lock = db_lock(1);
+    if (lock == -1) {
+        return -1;
     }
+    int ret = db_libs_rewrite(paths, n);
+    db_unlock(lock);
+    return ret;
+}
 
-    // Replace the old database with the new one only if entry was found
-    if (found_in_db) {
-        if (rename(temp_db_path, DB_PATH) == -1) {
-            fprintf(stderr, "Failed to update database %s: %s\n", DB_PATH, strerror(errno));
-            remove(temp_db_path); // Attempt cleanup
+// Remove a path from the database (called by GC)
+int db_remove_path(const char* path) {
+    if (db_prepare() != 0) {
+        return -1;
+    }
+
+    // Record the removal only if the path is registered
+    if (db_path_exists(path)) {
+        const char* strs[1] = { path };
+        if (db_journal_append(DB_OP_REMOVE, 0, 0, strs, 1) != 0) {
+            fprintf(stderr, "Failed to record removal of %s in database\n", path);
             return -1;
         }
-    } else {
-        remove(temp_db_path); // No change needed, remove temp file
     }
 
-    // Also remove from roots file 
+    // Also remove from roots file and library index
     // This uses the helper function
     remove_line_from_file(ROOTS_PATH, path);
+    db_libs_remove_paths(&path, 1);
    
 
     return 0; // Success
 }
 
+// Remove many paths at once (called by the GC sweep). All removals go to
+// the journal as one group and the roots file and library index are
+// rewritten once.
+int db_remove_paths(const char** paths, int n) {
+    if (n <= 0) {
+        return 0;
+    }
+    if (db_prepare() != 0 || db_txn_begin() != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!db_path_exists(paths[i])) continue;
+        const char* strs[1] = { paths[i] };
+        if (db_journal_append(DB_OP_REMOVE, 0, 0, strs, 1) != 0) {
+            fprintf(stderr, "Failed to record removal of %s in database\n", paths[i]);
+            db_txn_abort();
+            return -1;
+        }
+    }
+    if (db_txn_commit() != 0) {
+        fprintf(stderr, "Failed to commit removal of %d paths\n", n);
+        return -1;
+    }
+
+    if (remove_lines_from_file(ROOTS_PATH, paths, n) < 0 ||
+        db_libs_remove_paths(paths, n) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
 // Add a GC Root
 int db_add_root(const char* path) {
     // 1. Verify the path exists in the store database first
@@ -413,236 +2417,119 @@ int db_store_hash(const char* path, const char* hash) {
         return -1;
     }
 
-    // First check if database exists
-    FILE* db = open_db("r+");
-    if (!db) {
-        // Database doesn't exist or can't be opened for update
-        fprintf(stderr, "Failed to open database for updating hash\n");
-        return -1;
-    }
-
-    DBEntry entry;
-    int found = 0;
-    long pos = 0;
-    
-    // Search for existing entry
-    rewind(db);
-    while (fread(&entry, sizeof(entry), 1, db) == 1) {
-        if (strcmp(entry.path, path) == 0) {
-            found = 1;
-            break;
-        }
-        pos = ftell(db);
-    }
-
-    if (!found) {
+    if (!db_path_exists(path)) {
         fprintf(stderr, "Path %s not found in database for hash update\n", path);
-        fclose(db);
         return -1;
     }
 
-    // Update the hash
-    strncpy(entry.hash, hash, SHA256_DIGEST_STRING_LENGTH - 1);
-    entry.hash[SHA256_DIGEST_STRING_LENGTH - 1] = '\0';
-    
-    // Seek back and write updated entry
-    if (fseek(db, pos, SEEK_SET) != 0) {
-        fprintf(stderr, "Failed to seek in database for hash update\n");
-        fclose(db);
+    const char* strs[2] = { path, hash };
+    if (db_journal_append(DB_OP_SET_HASH, DB_HASH_CANONICAL, 0, strs, 2) != 0) {
+        fprintf(stderr, "Failed to write updated hash to database\n");
         return -1;
     }
 
-    size_t written = fwrite(&entry, sizeof(entry), 1, db);
-    if (written != 1) {
-        fprintf(stderr, "Failed to write updated hash to database: %s\n", strerror(errno));
-        fclose(db);
-        return -1;
+    printf("Successfully stored hash for %s\n", path);
+    return 0;
+}
+
+// Stored hash for path as a pointer into the mapped database or overlay
+const char* db_peek_hash(const char* path) {
+    DBPathView view;
+    if (!db_lookup(path, &view)) {
+        return NULL;
     }
+    return view_hash(&view);
+}
 
-    // Ensure changes are written to disk
-    if (fflush(db) != 0) {
-        fprintf(stderr, "Failed to flush database changes: %s\n", strerror(errno));
-        fclose(db);
+// Format of the stored hash for path, -1 if it is not registered
+int db_get_hash_format(const char* path) {
+    DBPathView view;
+    if (!db_lookup(path, &view)) {
         return -1;
     }
-
-    fclose(db);
-    printf("Successfully stored hash for %s\n", path);
-    return 0;
+    return view_hash_format(&view);
 }
 
 // Get stored hash for path
 char* db_get_hash(const char* path) {
-    FILE* db = open_db("r");
-    if (!db) return NULL;
+    const char* hash = db_peek_hash(path);
+    return hash ? strdup(hash) : NULL;
+}
 
-    DBEntry entry;
-    while (fread(&entry, sizeof(entry), 1, db) == 1) {
-        if (strcmp(entry.path, path) == 0) {
-            char* hash = strdup(entry.hash);
-            fclose(db);
-            return hash;
-        }
+// Replace the legacy hash of a path that just verified with its canonical
+// hash, so from now on it is verified file by file with cached digests.
+// Failing only costs the upgrade, so it is not an error.
+static void upgrade_legacy_hash(const char* path, NarManifest* manifest) {
+    char canonical[SHA256_DIGEST_STRING_LENGTH];
+    HashCachePending pending = {0};
+    if (nar_hash_path_manifest(path, NULL, NULL, hash_cache_record, &pending,
+                               io_throttle_read, NULL, manifest, canonical) != 0 ||
+        db_store_hash(path, canonical) != 0) {
+        fprintf(stderr, "Warning: Failed to upgrade the legacy hash of %s\n", path);
+        hash_cache_pending_free(&pending);
+        return;
     }
-
-    fclose(db);
-    return NULL;
+    HashCache cache;
+    hash_cache_load(&cache);
+    hash_cache_commit(&cache, &pending);
+    hash_cache_save(&cache, 0);
+    hash_cache_free(&cache);
+    hash_cache_pending_free(&pending);
+    printf("Upgraded the stored hash of %s to the canonical format: %s\n", path, canonical);
 }
 
-// Verify path hash matches stored hash
-int db_verify_path_hash(const char* path) {
-    char* stored_hash = db_get_hash(path);
-    if (!stored_hash) {
+// Verify path hash matches stored hash, recomputing it in the format it
+// was stored in. A matching legacy hash is upgraded to the canonical one.
+int db_verify_path_hash(const char* path, int deep, NarManifest* manifest) {
+    const char* stored = db_peek_hash(path);
+    if (!stored || !*stored) {
         fprintf(stderr, "No stored hash found for %s\n", path);
         return -1;
     }
-
-    // Compute current hash of path contents
-    char* current_hash = NULL;
-    struct stat st;
-
-    if (stat(path, &st) == 0) {
-        SHA256_CTX ctx;
-        sha256_init(&ctx);
-
-        if (S_ISDIR(st.st_mode)) {
-            // For directories, first get sorted list of all files
-            char* file_list[1024];
-            int file_count = 0;
-            
-            // Helper to collect files recursively 
-            void collect_files(const char* dir_path) {
-                DIR* dir = opendir(dir_path);
-                if (!dir) return;
-                
-                struct dirent* entry;
-                while ((entry = readdir(dir)) != NULL && file_count < 1024) {
-                    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                        continue;
-                        
-                    char full_path[PATH_MAX];
-                    snprintf(full_path, PATH_MAX, "%s/%s", dir_path, entry->d_name);
-                    
-                    struct stat st;
-                    if (stat(full_path, &st) != 0) continue;
-                    
-                    if (S_ISDIR(st.st_mode)) {
-                        collect_files(full_path);
-                    } else if (S_ISREG(st.st_mode)) {
-                        // Store relative path for consistent hashing
-                        file_list[file_count++] = strdup(full_path + strlen(path) + 1);
-                    }
-                }
-                closedir(dir);
-            }
-            
-            // Get all file paths
-            collect_files(path);
-            
-            // Sort paths for consistent hash
-            for (int i = 0; i < file_count - 1; i++) {
-                for (int j = i + 1; j < file_count; j++) {
-                    if (strcmp(file_list[i], file_list[j]) > 0) {
-                        char* temp = file_list[i];
-                        file_list[i] = file_list[j];
-                        file_list[j] = temp;
-                    }
-                }
-            }
-            
-            // Hash each file in sorted order
-            for (int i = 0; i < file_count; i++) {
-                // Add relative path to hash first
-                sha256_update(&ctx, (uint8_t*)file_list[i], strlen(file_list[i]));
-                
-                // Then hash file contents
-                char full_path[PATH_MAX];
-                snprintf(full_path, PATH_MAX, "%s/%s", path, file_list[i]);
-                
-                FILE* f = fopen(full_path, "rb");
-                if (f) {
-                    uint8_t buffer[4096];
-                    size_t bytes;
-                    while ((bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-                        sha256_update(&ctx, buffer, bytes);
-                    }
-                    fclose(f);
-                }
-                free(file_list[i]);
-            }
-            
-            // Finalize hash
-            uint8_t hash[SHA256_BLOCK_SIZE];
-            sha256_final(&ctx, hash);
-            current_hash = malloc(SHA256_DIGEST_STRING_LENGTH);
-            if (current_hash) {
-                for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
-                    sprintf(current_hash + (i * 2), "%02x", hash[i]);
-                }
-                current_hash[SHA256_DIGEST_STRING_LENGTH - 1] = 0;
-            }
-        } else {
-            // For single files, we need to:
-            // 1. Check if it's in bin/ directory
-            // 2. Hash both path and contents like storage does
-            char bin_path[PATH_MAX];
-            char* base = strrchr(path, '/');
-            if (base) {
-                base++; // Skip the /
-                snprintf(bin_path, PATH_MAX, "%s/bin/%s", path, base);
-                if (access(bin_path, F_OK) == 0) {
-                    // It's a binary in bin/, hash path first
-                    const char* rel_path = "bin/";
-                    sha256_update(&ctx, (uint8_t*)rel_path, strlen(rel_path));
-                    sha256_update(&ctx, (uint8_t*)base, strlen(base));
-
-                    // Then hash contents
-                    FILE* f = fopen(bin_path, "rb");
-                    if (f) {
-                        uint8_t buffer[4096];
-                        size_t bytes;
-                        while ((bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-                            sha256_update(&ctx, buffer, bytes);
-                        }
-                        fclose(f);
-                    }
-                } else {
-                    // Regular file, just hash contents
-                    FILE* f = fopen(path, "rb");
-                    if (f) {
-                        uint8_t buffer[4096];
-                        size_t bytes;
-                        while ((bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-                            sha256_update(&ctx, buffer, bytes);
-                        }
-                        fclose(f);
-                    }
-                }
-            }
-            
-            uint8_t hash[SHA256_BLOCK_SIZE];
-            sha256_final(&ctx, hash);
-            current_hash = malloc(SHA256_DIGEST_STRING_LENGTH);
-            if (current_hash) {
-                for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
-                    sprintf(current_hash + (i * 2), "%02x", hash[i]);
-                }
-                current_hash[SHA256_DIGEST_STRING_LENGTH - 1] = 0;
-            }
+    // Copy it out: computing the current hash may take long enough for
+    // another process to change the database
+    char stored_hash[SHA256_DIGEST_STRING_LENGTH];
+    strncpy(stored_hash, stored, sizeof(stored_hash) - 1);
+    stored_hash[sizeof(stored_hash) - 1] = '\0';
+    int format = db_get_hash_format(path);
+
+    char current_hash[SHA256_DIGEST_STRING_LENGTH];
+    if (format != DB_HASH_CANONICAL) {
+        if (nar_hash_path_legacy(path, io_throttle_read, NULL, current_hash) != 0) {
+            fprintf(stderr, "Failed to compute current hash for %s\n", path);
+            return -1;
         }
+        printf("Stored hash:  %s (legacy format)\n", stored_hash);
+        printf("Current hash: %s\n", current_hash);
+        if (strcmp(stored_hash, current_hash) != 0) return -1;
+        upgrade_legacy_hash(path, manifest);
+        return 0;
     }
 
-    if (!current_hash) {
-        free(stored_hash);
+    // Files unchanged since they were last verified keep their digests;
+    // the ones read now are remembered if the whole path checks out
+    HashCache cache;
+    HashCachePending pending = {0};
+    hash_cache_load(&cache);
+    HashCacheLookup lookup = { &cache, 0 };
+    int ret = nar_hash_path_manifest(path, deep ? NULL : hash_cache_lookup, &lookup, hash_cache_record,
+                                     &pending, io_throttle_read, NULL, manifest, current_hash);
+    size_t files = pending.count;
+    int result = ret == 0 ? strcmp(stored_hash, current_hash) : -1;
+    if (result == 0) {
+        hash_cache_commit(&cache, &pending);
+        hash_cache_save(&cache, 0);
+    }
+    hash_cache_pending_free(&pending);
+    hash_cache_free(&cache);
+    if (ret != 0) {
         fprintf(stderr, "Failed to compute current hash for %s\n", path);
         return -1;
     }
 
-    int result = strcmp(stored_hash, current_hash);
     printf("Stored hash:  %s\n", stored_hash);
     printf("Current hash: %s\n", current_hash);
-    free(stored_hash);
-    free(current_hash);
+    printf("Files read:   %zu of %zu (the rest unchanged since last verified)\n", files - lookup.hits, files);
 
     return result == 0 ? 0 : -1;
 }
@@ -2,6 +2,7 @@
 #define NIX_STORE_DB_H
 
 #include <time.h>
+#include "nar.h"
 
 // register path in db
 int db_register_path(const char* path, const char** references);
@@ -12,8 +13,36 @@ int db_path_exists(const char* path);
 // get path references
 char** db_get_references(const char* path);
 
+// get paths referring to a path, directly or (closure) transitively;
+// the closure includes the path itself
+char** db_get_referrers(const char* path);
+char** db_get_referrers_closure(const char* path);
+
+// zero-copy queries: strings passed to fn or returned point into the
+// mapped database or journal overlay and are only valid until the
+// database is next modified
+int db_foreach_reference(const char* path, int (*fn)(const char* ref, void* arg), void* arg);
+const char* db_peek_hash(const char* path);
+int db_foreach_referrer(const char* path, int (*fn)(const char* referrer, void* arg), void* arg);
+int db_foreach_path(int (*fn)(const char* path, void* arg), void* arg);
+
+// commit buffered changes to the journal; changes made outside a
+// transaction are committed as they are made
+int db_sync(void);
+
+// transactions: changes between begin and the outermost commit are
+// written together in one journal group; abort drops them
+int db_txn_begin(void);
+int db_txn_commit(void);
+void db_txn_abort(void);
+
 // remove path from db
 int db_remove_path(const char* path);
+int db_remove_paths(const char** paths, int n);
+
+// library index: store path providing a library file name
+int db_register_library(const char* name, const char* store_path);
+const char* db_find_library(const char* name);
 
 // gc root management
 int db_add_root(const char* path);
@@ -24,9 +53,17 @@ int db_register_profile(const char* profile_name, const char* path);
 int db_remove_profile(const char* profile_name);
 char* db_get_profile_path(const char* profile_name);
 
-// hash verification
+// hash verification; db_store_hash records a canonical (nar.c) hash,
+// paths hashed before that keep the legacy format until they next verify
+#define DB_HASH_LEGACY 0
+#define DB_HASH_CANONICAL 1
 int db_store_hash(const char* path, const char* hash);
 char* db_get_hash(const char* path);
-int db_verify_path_hash(const char* path);
+int db_get_hash_format(const char* path);
+// verify re-reads only files changed since they were last verified
+// (hash_cache.h), or every file with deep; a canonical hash also lists
+// the path's nodes in manifest (may be NULL), as does a legacy hash,
+// which is replaced by the canonical one once it matches
+int db_verify_path_hash(const char* path, int deep, NarManifest* manifest);
 
 #endif
@@ -41,12 +41,16 @@ void config_init(void) {
     config.store.verify_signatures = false;
     config.store.allow_user_install = false;
     config.store.store_path_permissions = 0555;
+    config.store.ingest_mode = strdup("copy");
+    config.store.normalize_mtime = false;
+    config.store.auto_optimise = false;
+    config.store.content_addressed = false;
 
     // Dependencies defaults
     config.dependencies.auto_scan = true;
     config.dependencies.max_depth = 10;
     config.dependencies.extra_lib_paths = strdup("/proc/boot,/system/lib");
-    config.dependencies.scanner = strdup("ldd");
+    config.dependencies.scanner = strdup("elf");
 
     // Profile defaults
     config.profiles.default_profile = strdup("default");
@@ -71,12 +75,16 @@ static int install_default_config(void) {
         "store.enforce_readonly = true\n"
         "store.verify_signatures = false\n"
         "store.allow_user_install = false\n"
-        "store.store_path_permissions = 0555\n\n"
+        "store.store_path_permissions = 0555\n"
+        "store.ingest_mode = copy\n"
+        "store.normalize_mtime = false\n"
+        "store.auto_optimise = false\n"
+        "store.content_addressed = false\n\n"
         "# Dependencies settings\n"
         "dependencies.auto_scan = true\n"
         "dependencies.max_depth = 10\n"
         "dependencies.extra_lib_paths = /proc/boot,/system/lib\n"
-        "dependencies.scanner = ldd\n\n"
+        "dependencies.scanner = elf\n\n"
         "# Profile settings\n"
         "profiles.default_profile = default\n"
         "profiles.auto_backup = true\n"
@@ -111,6 +119,7 @@ static void config_free(void) {
     free(config.shell.allowed_system_paths);
     free(config.shell.preserved_env_vars);
     free(config.store.store_path);
+    free(config.store.ingest_mode);
     free(config.dependencies.extra_lib_paths);
     free(config.dependencies.scanner);
     free(config.profiles.default_profile);
@@ -273,6 +282,21 @@ int config_load(const char* config_path) {
                 config.store.store_path_permissions = perms;
             }
         }
+        else if (strcmp(key, "store.ingest_mode") == 0) {
+            if (strcmp(value, "copy") == 0 || strcmp(value, "reflink") == 0 || strcmp(value, "hardlink") == 0) {
+                free(config.store.ingest_mode);
+                config.store.ingest_mode = strdup(value);
+            }
+        }
+        else if (strcmp(key, "store.normalize_mtime") == 0) {
+            config.store.normalize_mtime = parse_bool(value);
+        }
+        else if (strcmp(key, "store.auto_optimise") == 0) {
+            config.store.auto_optimise = parse_bool(value);
+        }
+        else if (strcmp(key, "store.content_addressed") == 0) {
+            config.store.content_addressed = parse_bool(value);
+        }
         else if (strcmp(key, "dependencies.auto_scan") == 0) {
             config.dependencies.auto_scan = parse_bool(value);
         }
@@ -289,7 +313,7 @@ int config_load(const char* config_path) {
             }
         }
         else if (strcmp(key, "dependencies.scanner") == 0) {
-            if (strchr(value, '/') == NULL) { // Must be program name only
+            if (strcmp(value, "elf") == 0 || strcmp(value, "ldd") == 0) {
                 free(config.dependencies.scanner);
                 config.dependencies.scanner = strdup(value);
             }
@@ -18,6 +18,10 @@ typedef struct {
         bool verify_signatures;
         bool allow_user_install;
         int store_path_permissions;
+        char* ingest_mode;
+        bool normalize_mtime;
+        bool auto_optimise;
+        bool content_addressed;
     } store;
 
     struct {
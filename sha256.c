@@ -2,46 +2,334 @@
 #include "sha256.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-void sha256_transform(SHA256_CTX *ctx, const uint8_t *data) {
-    uint32_t a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
+// Hardware kernels: SHA-NI on x86, the ARMv8 Crypto Extensions on
+// aarch64. Each is compiled with a target attribute, so the rest of the
+// program does not require the instructions; sha256_select_impl() picks
+// one at run time.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA256_HAVE_SHANI 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 
-    for (i = 0, j = 0; i < 16; ++i, j += 4)
-        m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
-    
-    for (; i < 64; ++i)
-        m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
-
-    a = ctx->state[0];
-    b = ctx->state[1];
-    c = ctx->state[2];
-    d = ctx->state[3];
-    e = ctx->state[4];
-    f = ctx->state[5];
-    g = ctx->state[6];
-    h = ctx->state[7];
-
-    for (i = 0; i < 64; ++i) {
-        t1 = h + EP1(e) + CH(e, f, g) + k[i] + m[i];
-        t2 = EP0(a) + MAJ(a, b, c);
-        h = g;
-        g = f;
-        f = e;
-        e = d + t1;
-        d = c;
-        c = b;
-        b = a;
-        a = t1 + t2;
-    }
-
-    ctx->state[0] += a;
-    ctx->state[1] += b;
-    ctx->state[2] += c;
-    ctx->state[3] += d;
-    ctx->state[4] += e;
-    ctx->state[5] += f;
-    ctx->state[6] += g;
-    ctx->state[7] += h;
+#if defined(__aarch64__) && defined(__GNUC__)
+#define SHA256_HAVE_ARMCE 1
+#include <arm_neon.h>
+#include <signal.h>
+#include <setjmp.h>
+#if defined(__QNX__)
+#include <sys/syspage.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#endif
+#endif
+
+// Load a big-endian 32-bit word
+#define LOAD32_BE(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+                      ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+
+// One round. Instead of shifting the eight working variables along, the
+// caller rotates the argument names, so only d and h are written.
+#define ROUND(a, b, c, d, e, f, g, h, i, w) do { \
+    uint32_t t1_ = (h) + EP1(e) + CH(e, f, g) + k[i] + (w); \
+    (d) += t1_; \
+    (h) = t1_ + EP0(a) + MAJ(a, b, c); \
+} while (0)
+
+// Message schedule: the first 16 words come from the block, the rest are
+// computed in place in a 16-word ring
+#define W_LOAD(i) (m[i])
+#define W_SCHED(i) (m[(i) & 15] += SIG1(m[((i) - 2) & 15]) + m[((i) - 7) & 15] + SIG0(m[((i) - 15) & 15]))
+
+#define ROUNDS8(i, W) do { \
+    ROUND(a, b, c, d, e, f, g, h, (i) + 0, W((i) + 0)); \
+    ROUND(h, a, b, c, d, e, f, g, (i) + 1, W((i) + 1)); \
+    ROUND(g, h, a, b, c, d, e, f, (i) + 2, W((i) + 2)); \
+    ROUND(f, g, h, a, b, c, d, e, (i) + 3, W((i) + 3)); \
+    ROUND(e, f, g, h, a, b, c, d, (i) + 4, W((i) + 4)); \
+    ROUND(d, e, f, g, h, a, b, c, (i) + 5, W((i) + 5)); \
+    ROUND(c, d, e, f, g, h, a, b, (i) + 6, W((i) + 6)); \
+    ROUND(b, c, d, e, f, g, h, a, (i) + 7, W((i) + 7)); \
+} while (0)
+
+// Process nblocks consecutive 64-byte blocks
+static void sha256_transform_blocks(uint32_t state[8], const uint8_t *data, size_t nblocks) {
+    uint32_t a, b, c, d, e, f, g, h, m[16];
+
+    for (; nblocks > 0; --nblocks, data += 64) {
+        for (int i = 0; i < 16; ++i)
+            m[i] = LOAD32_BE(data + i * 4);
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        ROUNDS8(0, W_LOAD);
+        ROUNDS8(8, W_LOAD);
+        ROUNDS8(16, W_SCHED);
+        ROUNDS8(24, W_SCHED);
+        ROUNDS8(32, W_SCHED);
+        ROUNDS8(40, W_SCHED);
+        ROUNDS8(48, W_SCHED);
+        ROUNDS8(56, W_SCHED);
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef SHA256_HAVE_SHANI
+// SHA-NI kernel. The state is kept as ABEF/CDGH halves as the
+// sha256rnds2 instruction expects; each group does four rounds.
+#define SHANI_ROUNDS(i, msg) do { \
+    MSG = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i *)&k[4 * (i)])); \
+    STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG); \
+    MSG = _mm_shuffle_epi32(MSG, 0x0E); \
+    STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG); \
+} while (0)
+// Finish the schedule words four groups ahead (uses prev before SHANI_SCHED1 changes it)
+#define SHANI_SCHED2(cur, prev, next) do { \
+    next = _mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4)); \
+    next = _mm_sha256msg2_epu32(next, cur); \
+} while (0)
+#define SHANI_SCHED1(prev, cur) (prev = _mm_sha256msg1_epu32(prev, cur))
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_transform_blocks_shani(uint32_t state[8], const uint8_t *data, size_t nblocks) {
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i STATE0, STATE1, MSG, TMP, MSG0, MSG1, MSG2, MSG3, ABEF_SAVE, CDGH_SAVE;
+
+    TMP = _mm_loadu_si128((const __m128i *)&state[0]);
+    STATE1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    TMP = _mm_shuffle_epi32(TMP, 0xB1);          // CDAB
+    STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);    // EFGH
+    STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);    // ABEF
+    STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0); // CDGH
+
+    for (; nblocks > 0; --nblocks, data += 64) {
+        ABEF_SAVE = STATE0;
+        CDGH_SAVE = STATE1;
+
+        MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), MASK);
+        MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), MASK);
+        MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), MASK);
+        MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), MASK);
+
+        SHANI_ROUNDS(0, MSG0);
+        SHANI_ROUNDS(1, MSG1);  SHANI_SCHED1(MSG0, MSG1);
+        SHANI_ROUNDS(2, MSG2);  SHANI_SCHED1(MSG1, MSG2);
+        SHANI_ROUNDS(3, MSG3);  SHANI_SCHED2(MSG3, MSG2, MSG0); SHANI_SCHED1(MSG2, MSG3);
+        SHANI_ROUNDS(4, MSG0);  SHANI_SCHED2(MSG0, MSG3, MSG1); SHANI_SCHED1(MSG3, MSG0);
+        SHANI_ROUNDS(5, MSG1);  SHANI_SCHED2(MSG1, MSG0, MSG2); SHANI_SCHED1(MSG0, MSG1);
+        SHANI_ROUNDS(6, MSG2);  SHANI_SCHED2(MSG2, MSG1, MSG3); SHANI_SCHED1(MSG1, MSG2);
+        SHANI_ROUNDS(7, MSG3);  SHANI_SCHED2(MSG3, MSG2, MSG0); SHANI_SCHED1(MSG2, MSG3);
+        SHANI_ROUNDS(8, MSG0);  SHANI_SCHED2(MSG0, MSG3, MSG1); SHANI_SCHED1(MSG3, MSG0);
+        SHANI_ROUNDS(9, MSG1);  SHANI_SCHED2(MSG1, MSG0, MSG2); SHANI_SCHED1(MSG0, MSG1);
+        SHANI_ROUNDS(10, MSG2); SHANI_SCHED2(MSG2, MSG1, MSG3); SHANI_SCHED1(MSG1, MSG2);
+        SHANI_ROUNDS(11, MSG3); SHANI_SCHED2(MSG3, MSG2, MSG0); SHANI_SCHED1(MSG2, MSG3);
+        SHANI_ROUNDS(12, MSG0); SHANI_SCHED2(MSG0, MSG3, MSG1); SHANI_SCHED1(MSG3, MSG0);
+        SHANI_ROUNDS(13, MSG1); SHANI_SCHED2(MSG1, MSG0, MSG2);
+        SHANI_ROUNDS(14, MSG2); SHANI_SCHED2(MSG2, MSG1, MSG3);
+        SHANI_ROUNDS(15, MSG3);
+
+        STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+        STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+    }
+
+    TMP = _mm_shuffle_epi32(STATE0, 0x1B);       // FEBA
+    STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);    // DCHG
+    STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0); // DCBA
+    STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);    // ABEF
+    _mm_storeu_si128((__m128i *)&state[0], STATE0);
+    _mm_storeu_si128((__m128i *)&state[4], STATE1);
+}
+
+// CPUID: SSSE3 and SSE4.1 in leaf 1, SHA in leaf 7
+static int sha256_cpu_has_shani(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 9)) || !(ecx & (1u << 19))) {
+        return 0;
+    }
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1u << 29)) != 0;
+}
+#endif
+
+#ifdef SHA256_HAVE_ARMCE
+// ARMv8 Crypto Extensions kernel; each group does four rounds and then
+// extends that group's message words for the group four ahead
+#define ARMCE_ROUNDS(i, msg) do { \
+    TMP = vaddq_u32(msg, vld1q_u32(&k[4 * (i)])); \
+    ABEF = STATE0; \
+    STATE0 = vsha256hq_u32(STATE0, STATE1, TMP); \
+    STATE1 = vsha256h2q_u32(STATE1, ABEF, TMP); \
+} while (0)
+#define ARMCE_SCHED(m0, m1, m2, m3) (m0 = vsha256su1q_u32(vsha256su0q_u32(m0, m1), m2, m3))
+
+__attribute__((target("+crypto")))
+static void sha256_transform_blocks_armce(uint32_t state[8], const uint8_t *data, size_t nblocks) {
+    uint32x4_t STATE0 = vld1q_u32(&state[0]);
+    uint32x4_t STATE1 = vld1q_u32(&state[4]);
+    uint32x4_t MSG0, MSG1, MSG2, MSG3, TMP, ABEF, ABCD_SAVE, EFGH_SAVE;
+
+    for (; nblocks > 0; --nblocks, data += 64) {
+        ABCD_SAVE = STATE0;
+        EFGH_SAVE = STATE1;
+
+        MSG0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 0)));
+        MSG1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+        MSG2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+        MSG3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+        ARMCE_ROUNDS(0, MSG0);  ARMCE_SCHED(MSG0, MSG1, MSG2, MSG3);
+        ARMCE_ROUNDS(1, MSG1);  ARMCE_SCHED(MSG1, MSG2, MSG3, MSG0);
+        ARMCE_ROUNDS(2, MSG2);  ARMCE_SCHED(MSG2, MSG3, MSG0, MSG1);
+        ARMCE_ROUNDS(3, MSG3);  ARMCE_SCHED(MSG3, MSG0, MSG1, MSG2);
+        ARMCE_ROUNDS(4, MSG0);  ARMCE_SCHED(MSG0, MSG1, MSG2, MSG3);
+        ARMCE_ROUNDS(5, MSG1);  ARMCE_SCHED(MSG1, MSG2, MSG3, MSG0);
+        ARMCE_ROUNDS(6, MSG2);  ARMCE_SCHED(MSG2, MSG3, MSG0, MSG1);
+        ARMCE_ROUNDS(7, MSG3);  ARMCE_SCHED(MSG3, MSG0, MSG1, MSG2);
+        ARMCE_ROUNDS(8, MSG0);  ARMCE_SCHED(MSG0, MSG1, MSG2, MSG3);
+        ARMCE_ROUNDS(9, MSG1);  ARMCE_SCHED(MSG1, MSG2, MSG3, MSG0);
+        ARMCE_ROUNDS(10, MSG2); ARMCE_SCHED(MSG2, MSG3, MSG0, MSG1);
+        ARMCE_ROUNDS(11, MSG3); ARMCE_SCHED(MSG3, MSG0, MSG1, MSG2);
+        ARMCE_ROUNDS(12, MSG0);
+        ARMCE_ROUNDS(13, MSG1);
+        ARMCE_ROUNDS(14, MSG2);
+        ARMCE_ROUNDS(15, MSG3);
+
+        STATE0 = vaddq_u32(STATE0, ABCD_SAVE);
+        STATE1 = vaddq_u32(STATE1, EFGH_SAVE);
+    }
+
+    vst1q_u32(&state[0], STATE0);
+    vst1q_u32(&state[4], STATE1);
+}
+
+static sigjmp_buf sha256_probe_env;
+
+static void sha256_probe_sigill(int sig) {
+    (void)sig;
+    siglongjmp(sha256_probe_env, 1);
+}
+
+// Whether the CPU implements the SHA-256 instructions. Uses the OS
+// feature flags where available and otherwise executes the kernel once
+// with SIGILL caught.
+static int sha256_cpu_has_armce(void) {
+#if defined(__QNX__) && defined(AARCH64_CPU_FLAG_SHA256)
+    return (SYSPAGE_ENTRY(cpuinfo)->flags & AARCH64_CPU_FLAG_SHA256) != 0;
+#elif defined(__linux__) && defined(HWCAP_SHA2)
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#else
+    struct sigaction sa, old;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sha256_probe_sigill;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGILL, &sa, &old) != 0) {
+        return 0;
+    }
+    int supported = 0;
+    if (sigsetjmp(sha256_probe_env, 1) == 0) {
+        uint32_t state[8] = {0};
+        uint8_t block[64] = {0};
+        sha256_transform_blocks_armce(state, block, 1);
+        supported = 1;
+    }
+    sigaction(SIGILL, &old, NULL);
+    return supported;
+#endif
+}
+#endif
+
+typedef void (*sha256_blocks_fn)(uint32_t state[8], const uint8_t *data, size_t nblocks);
+
+static void sha256_transform_blocks_resolve(uint32_t state[8], const uint8_t *data, size_t nblocks);
+
+// Kernel used by every update; resolved on first use
+static sha256_blocks_fn sha256_blocks = sha256_transform_blocks_resolve;
+static const char *sha256_impl = NULL;
+
+// Check a kernel against the portable code on a known input, so a broken
+// or misdetected kernel falls back instead of producing wrong hashes
+static int sha256_kernel_ok(sha256_blocks_fn fn) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    uint8_t data[128];
+    uint32_t expected[8], actual[8];
+    for (int i = 0; i < 128; i++) data[i] = (uint8_t)(i * 37 + 11);
+    memcpy(expected, iv, sizeof(iv));
+    memcpy(actual, iv, sizeof(iv));
+    sha256_transform_blocks(expected, data, 2);
+    fn(actual, data, 2);
+    return memcmp(expected, actual, sizeof(expected)) == 0;
+}
+
+// Choose the transform kernel. QNIX_SHA256_IMPL=c|shani|armce overrides
+// the detection, e.g. for benchmarking or to rule out a kernel.
+static void sha256_select_impl(void) {
+    const char *want = getenv("QNIX_SHA256_IMPL");
+    if (want && !*want) want = NULL;
+    sha256_blocks_fn fn = sha256_transform_blocks;
+    const char *name = "c";
+
+#ifdef SHA256_HAVE_SHANI
+    if ((!want || strcmp(want, "shani") == 0) && sha256_cpu_has_shani()) {
+        fn = sha256_transform_blocks_shani;
+        name = "shani";
+    }
+#endif
+#ifdef SHA256_HAVE_ARMCE
+    if ((!want || strcmp(want, "armce") == 0) && sha256_cpu_has_armce()) {
+        fn = sha256_transform_blocks_armce;
+        name = "armce";
+    }
+#endif
+
+    if (fn != sha256_transform_blocks && !sha256_kernel_ok(fn)) {
+        fprintf(stderr, "Warning: %s SHA-256 kernel failed its self-check, using portable code\n", name);
+        fn = sha256_transform_blocks;
+        name = "c";
+    }
+    sha256_impl = name;
+    sha256_blocks = fn;
+}
+
+static void sha256_transform_blocks_resolve(uint32_t state[8], const uint8_t *data, size_t nblocks) {
+    sha256_select_impl();
+    sha256_blocks(state, data, nblocks);
+}
+
+// Name of the transform kernel in use: "c", "shani" or "armce"
+const char *sha256_impl_name(void) {
+    if (!sha256_impl) {
+        sha256_select_impl();
+    }
+    return sha256_impl;
+}
+
+void sha256_transform(SHA256_CTX *ctx, const uint8_t *data) {
+    sha256_blocks(ctx->state, data, 1);
 }
 
 void sha256_init(SHA256_CTX *ctx) {
@@ -58,17 +346,34 @@ void sha256_init(SHA256_CTX *ctx) {
 }
 
 void sha256_update(SHA256_CTX *ctx, const uint8_t *data, size_t len) {
-    size_t i;
-
-    for (i = 0; i < len; ++i) {
-        ctx->data[ctx->datalen] = data[i];
-        ctx->datalen++;
-        if (ctx->datalen == 64) {
-            sha256_transform(ctx, ctx->data);
-            ctx->bitlen += 512;
-            ctx->datalen = 0;
+    // Top up a partly filled block first
+    if (ctx->datalen > 0) {
+        size_t fill = 64 - ctx->datalen;
+        if (fill > len) fill = len;
+        memcpy(ctx->data + ctx->datalen, data, fill);
+        ctx->datalen += fill;
+        data += fill;
+        len -= fill;
+        if (ctx->datalen < 64) {
+            return;
         }
+        sha256_blocks(ctx->state, ctx->data, 1);
+        ctx->bitlen += 512;
+        ctx->datalen = 0;
+    }
+
+    // Transform whole blocks straight from the caller's buffer
+    size_t nblocks = len / 64;
+    if (nblocks > 0) {
+        sha256_blocks(ctx->state, data, nblocks);
+        ctx->bitlen += (uint64_t)nblocks * 512;
+        data += nblocks * 64;
+        len -= nblocks * 64;
     }
+
+    // Keep the tail for the next call
+    memcpy(ctx->data, data, len);
+    ctx->datalen = len;
 }
 
 void sha256_final(SHA256_CTX *ctx, uint8_t *hash) {
@@ -137,3 +442,464 @@ char* sha256_hash_string(const uint8_t *data, size_t len) {
     
     return hash_str;
 }
+
+// Multi-buffer hashing: several independent messages share one pass
+// through the rounds, one message per SIMD lane. The state is kept
+// transposed, state[word][lane], so a vector load picks up one word of
+// every lane.
+typedef void (*sha256_mb_fn)(uint32_t state[8][SHA256_MB_MAX_LANES],
+                             const uint8_t *data[SHA256_MB_MAX_LANES], size_t nblocks);
+
+#ifdef SHA256_HAVE_SHANI
+#define SHA256_HAVE_AVX2 1
+
+#define MB8_ROR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define MB8_XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+#define MB8_EP0(x) MB8_XOR3(MB8_ROR(x, 2), MB8_ROR(x, 13), MB8_ROR(x, 22))
+#define MB8_EP1(x) MB8_XOR3(MB8_ROR(x, 6), MB8_ROR(x, 11), MB8_ROR(x, 25))
+#define MB8_SIG0(x) MB8_XOR3(MB8_ROR(x, 7), MB8_ROR(x, 18), _mm256_srli_epi32(x, 3))
+#define MB8_SIG1(x) MB8_XOR3(MB8_ROR(x, 17), MB8_ROR(x, 19), _mm256_srli_epi32(x, 10))
+#define MB8_CH(x, y, z) _mm256_xor_si256(_mm256_and_si256(x, y), _mm256_andnot_si256(x, z))
+#define MB8_MAJ(x, y, z) _mm256_or_si256(_mm256_and_si256(x, y), _mm256_and_si256(z, _mm256_or_si256(x, y)))
+
+// Turn eight rows of eight words (one row per lane) into eight vectors
+// holding one word of every lane
+__attribute__((target("avx2")))
+static inline void sha256_mb8_transpose(__m256i r[8]) {
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+// AVX2 kernel: eight lanes
+__attribute__((target("avx2")))
+static void sha256_mb_blocks_avx2(uint32_t state[8][SHA256_MB_MAX_LANES],
+                                  const uint8_t *data[SHA256_MB_MAX_LANES], size_t nblocks) {
+    const __m256i BSWAP = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i s[8], v[8], w[16];
+
+    for (int i = 0; i < 8; i++) {
+        s[i] = _mm256_loadu_si256((const __m256i *)state[i]);
+    }
+
+    for (size_t b = 0; b < nblocks; b++) {
+        for (int half = 0; half < 2; half++) {
+            __m256i *r = &w[half * 8];
+            for (int lane = 0; lane < 8; lane++) {
+                const uint8_t *p = data[lane] + b * 64 + half * 32;
+                r[lane] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)p), BSWAP);
+            }
+            sha256_mb8_transpose(r);
+        }
+
+        for (int i = 0; i < 8; i++) v[i] = s[i];
+
+        for (int t = 0; t < 64; t++) {
+            if (t >= 16) {
+                w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(MB8_SIG1(w[(t - 2) & 15]), w[(t - 7) & 15]),
+                                             _mm256_add_epi32(MB8_SIG0(w[(t - 15) & 15]), w[t & 15]));
+            }
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(v[7], MB8_EP1(v[4])),
+                                          _mm256_add_epi32(MB8_CH(v[4], v[5], v[6]),
+                                                           _mm256_add_epi32(_mm256_set1_epi32((int)k[t]), w[t & 15])));
+            __m256i t2 = _mm256_add_epi32(MB8_EP0(v[0]), MB8_MAJ(v[0], v[1], v[2]));
+            v[7] = v[6];
+            v[6] = v[5];
+            v[5] = v[4];
+            v[4] = _mm256_add_epi32(v[3], t1);
+            v[3] = v[2];
+            v[2] = v[1];
+            v[1] = v[0];
+            v[0] = _mm256_add_epi32(t1, t2);
+        }
+
+        for (int i = 0; i < 8; i++) s[i] = _mm256_add_epi32(s[i], v[i]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i *)state[i], s[i]);
+    }
+}
+
+// AVX2 needs the CPU flag and the OS saving the YMM registers
+static int sha256_cpu_has_avx2(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 27))) {
+        return 0;
+    }
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6 || __get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1u << 5)) != 0;
+}
+#endif
+
+#ifdef SHA256_HAVE_ARMCE
+#define SHA256_HAVE_NEON 1
+
+#define MB4_ROR(x, n) vsriq_n_u32(vshlq_n_u32(x, 32 - (n)), x, n)
+#define MB4_XOR3(a, b, c) veorq_u32(veorq_u32(a, b), c)
+#define MB4_EP0(x) MB4_XOR3(MB4_ROR(x, 2), MB4_ROR(x, 13), MB4_ROR(x, 22))
+#define MB4_EP1(x) MB4_XOR3(MB4_ROR(x, 6), MB4_ROR(x, 11), MB4_ROR(x, 25))
+#define MB4_SIG0(x) MB4_XOR3(MB4_ROR(x, 7), MB4_ROR(x, 18), vshrq_n_u32(x, 3))
+#define MB4_SIG1(x) MB4_XOR3(MB4_ROR(x, 17), MB4_ROR(x, 19), vshrq_n_u32(x, 10))
+#define MB4_CH(x, y, z) vbslq_u32(x, y, z)
+#define MB4_MAJ(x, y, z) vbslq_u32(veorq_u32(x, y), z, y)
+
+// NEON kernel: four lanes. Advanced SIMD is part of every aarch64 CPU,
+// so this needs no detection.
+static void sha256_mb_blocks_neon(uint32_t state[8][SHA256_MB_MAX_LANES],
+                                  const uint8_t *data[SHA256_MB_MAX_LANES], size_t nblocks) {
+    uint32x4_t s[8], v[8], w[16];
+
+    for (int i = 0; i < 8; i++) {
+        s[i] = vld1q_u32(state[i]);
+    }
+
+    for (size_t b = 0; b < nblocks; b++) {
+        for (int t = 0; t < 16; t++) {
+            uint32_t words[4];
+            for (int lane = 0; lane < 4; lane++) {
+                words[lane] = LOAD32_BE(data[lane] + b * 64 + t * 4);
+            }
+            w[t] = vld1q_u32(words);
+        }
+
+        for (int i = 0; i < 8; i++) v[i] = s[i];
+
+        for (int t = 0; t < 64; t++) {
+            if (t >= 16) {
+                w[t & 15] = vaddq_u32(vaddq_u32(MB4_SIG1(w[(t - 2) & 15]), w[(t - 7) & 15]),
+                                      vaddq_u32(MB4_SIG0(w[(t - 15) & 15]), w[t & 15]));
+            }
+            uint32x4_t t1 = vaddq_u32(vaddq_u32(v[7], MB4_EP1(v[4])),
+                                      vaddq_u32(MB4_CH(v[4], v[5], v[6]),
+                                                vaddq_u32(vdupq_n_u32(k[t]), w[t & 15])));
+            uint32x4_t t2 = vaddq_u32(MB4_EP0(v[0]), MB4_MAJ(v[0], v[1], v[2]));
+            v[7] = v[6];
+            v[6] = v[5];
+            v[5] = v[4];
+            v[4] = vaddq_u32(v[3], t1);
+            v[3] = v[2];
+            v[2] = v[1];
+            v[1] = v[0];
+            v[0] = vaddq_u32(t1, t2);
+        }
+
+        for (int i = 0; i < 8; i++) s[i] = vaddq_u32(s[i], v[i]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        vst1q_u32(state[i], s[i]);
+    }
+}
+#endif
+
+// Lanes without a message run over this instead; kernel calls are split
+// so they never read past it
+#define SHA256_MB_IDLE_BLOCKS 16
+static const uint8_t sha256_mb_idle[SHA256_MB_IDLE_BLOCKS * 64];
+
+static sha256_mb_fn sha256_mb_blocks = NULL;
+static int sha256_mb_lanes = 0;
+
+// Hash messages through a multi-buffer kernel. Each lane hashes the
+// whole blocks of its message in place, then one or two padded tail
+// blocks, and takes the next message as soon as it finishes, so lanes
+// stay busy when message lengths differ.
+static void sha256_hash_many_mb(sha256_mb_fn fn, int lanes, const uint8_t *const *data, const size_t *len,
+                                size_t n, uint8_t digests[][SHA256_BLOCK_SIZE]) {
+    uint32_t state[8][SHA256_MB_MAX_LANES];
+    const uint8_t *ptr[SHA256_MB_MAX_LANES];
+    size_t blocks[SHA256_MB_MAX_LANES];
+    size_t job[SHA256_MB_MAX_LANES];
+    int in_tail[SHA256_MB_MAX_LANES];
+    uint8_t tail[SHA256_MB_MAX_LANES][128];
+    size_t next = 0;
+    int active = 0;
+
+    for (int lane = 0; lane < SHA256_MB_MAX_LANES; lane++) {
+        ptr[lane] = sha256_mb_idle;
+        blocks[lane] = 0;
+        job[lane] = (size_t)-1;
+        for (int i = 0; i < 8; i++) state[i][lane] = 0;
+    }
+
+    for (;;) {
+        // Give idle lanes the next messages
+        for (int lane = 0; lane < lanes && next < n; lane++) {
+            if (job[lane] != (size_t)-1) continue;
+
+            static const uint32_t iv[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+            };
+            size_t rem = len[next] % 64;
+            size_t tail_blocks = rem < 56 ? 1 : 2;
+            uint64_t bitlen = (uint64_t)len[next] * 8;
+
+            if (rem > 0) memcpy(tail[lane], data[next] + (len[next] - rem), rem);
+            tail[lane][rem] = 0x80;
+            memset(tail[lane] + rem + 1, 0, tail_blocks * 64 - rem - 1);
+            for (int i = 0; i < 8; i++) {
+                tail[lane][tail_blocks * 64 - 1 - i] = (uint8_t)(bitlen >> (i * 8));
+                state[i][lane] = iv[i];
+            }
+
+            job[lane] = next++;
+            if (len[job[lane]] >= 64) {
+                ptr[lane] = data[job[lane]];
+                blocks[lane] = len[job[lane]] / 64;
+                in_tail[lane] = 0;
+            } else {
+                ptr[lane] = tail[lane];
+                blocks[lane] = tail_blocks;
+                in_tail[lane] = 1;
+            }
+            active++;
+        }
+        if (active == 0) break;
+
+        // Run every lane until the first one reaches the end of its input
+        size_t step = (size_t)-1;
+        for (int lane = 0; lane < lanes; lane++) {
+            if (job[lane] != (size_t)-1 && blocks[lane] < step) step = blocks[lane];
+        }
+        if (active < lanes && step > SHA256_MB_IDLE_BLOCKS) step = SHA256_MB_IDLE_BLOCKS;
+        fn(state, ptr, step);
+
+        for (int lane = 0; lane < lanes; lane++) {
+            if (job[lane] == (size_t)-1) continue;
+            ptr[lane] += step * 64;
+            blocks[lane] -= step;
+            if (blocks[lane] > 0) continue;
+
+            if (!in_tail[lane]) {
+                size_t rem = len[job[lane]] % 64;
+                ptr[lane] = tail[lane];
+                blocks[lane] = rem < 56 ? 1 : 2;
+                in_tail[lane] = 1;
+                continue;
+            }
+
+            uint8_t *out = digests[job[lane]];
+            for (int i = 0; i < 8; i++) {
+                out[i * 4] = (uint8_t)(state[i][lane] >> 24);
+                out[i * 4 + 1] = (uint8_t)(state[i][lane] >> 16);
+                out[i * 4 + 2] = (uint8_t)(state[i][lane] >> 8);
+                out[i * 4 + 3] = (uint8_t)state[i][lane];
+            }
+            job[lane] = (size_t)-1;
+            ptr[lane] = sha256_mb_idle;
+            active--;
+        }
+    }
+}
+
+// Check a multi-buffer kernel against single-buffer hashing on messages
+// of assorted lengths, including ones that need two padding blocks
+static int sha256_mb_kernel_ok(sha256_mb_fn fn, int lanes) {
+    static const size_t lens[] = { 0, 3, 55, 56, 64, 119, 200, 1000, 63, 4096, 1 };
+    const size_t count = sizeof(lens) / sizeof(lens[0]);
+    const uint8_t *data[sizeof(lens) / sizeof(lens[0])];
+    uint8_t digests[sizeof(lens) / sizeof(lens[0])][SHA256_BLOCK_SIZE];
+    uint8_t expected[SHA256_BLOCK_SIZE];
+    static uint8_t buf[4096 + 64];
+
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t)(i * 37 + 11);
+    for (size_t i = 0; i < count; i++) data[i] = buf + i;
+
+    sha256_hash_many_mb(fn, lanes, data, lens, count, digests);
+    for (size_t i = 0; i < count; i++) {
+        sha256_hash(data[i], lens[i], expected);
+        if (memcmp(expected, digests[i], SHA256_BLOCK_SIZE) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Choose the multi-buffer kernel. It is only worth using when there is
+// no hardware SHA-256: a SHA-NI or Crypto Extensions core hashes one
+// stream faster than the SIMD lanes hash eight. QNIX_SHA256_IMPL=avx2 or
+// neon forces it (with the portable single-buffer code).
+static void sha256_mb_select(void) {
+    const char *want = getenv("QNIX_SHA256_IMPL");
+    if (want && !*want) want = NULL;
+    int portable = strcmp(sha256_impl_name(), "c") == 0;
+    sha256_mb_fn fn = NULL;
+    int lanes = 1;
+    const char *name = NULL;
+
+#ifdef SHA256_HAVE_AVX2
+    if (((!want && portable) || (want && strcmp(want, "avx2") == 0)) && sha256_cpu_has_avx2()) {
+        fn = sha256_mb_blocks_avx2;
+        lanes = 8;
+        name = "avx2";
+    }
+#endif
+#ifdef SHA256_HAVE_NEON
+    if ((!want && portable) || (want && strcmp(want, "neon") == 0)) {
+        fn = sha256_mb_blocks_neon;
+        lanes = 4;
+        name = "neon";
+    }
+#endif
+
+    if (fn && !sha256_mb_kernel_ok(fn, lanes)) {
+        fprintf(stderr, "Warning: %s multi-buffer SHA-256 kernel failed its self-check, hashing serially\n", name);
+        fn = NULL;
+        lanes = 1;
+    }
+    sha256_mb_blocks = fn;
+    sha256_mb_lanes = lanes;
+}
+
+// Number of messages sha256_hash_many() hashes at once
+int sha256_hash_many_lanes(void) {
+    if (!sha256_mb_lanes) {
+        sha256_mb_select();
+    }
+    return sha256_mb_lanes;
+}
+
+void sha256_hash_many(const uint8_t *const *data, const size_t *len, size_t n,
+                      uint8_t digests[][SHA256_BLOCK_SIZE]) {
+    if (sha256_hash_many_lanes() > 1 && n > 1) {
+        sha256_hash_many_mb(sha256_mb_blocks, sha256_mb_lanes, data, len, n, digests);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        sha256_hash(data[i], len[i], digests[i]);
+    }
+}
+
+// Files up to this size are read whole and hashed in batches
+#define SHA256_MB_SMALL_FILE (64 * 1024)
+#define SHA256_MB_BATCH_BYTES (1024 * 1024)
+
+// Read a whole small file into buf; returns its length or -1
+static ssize_t sha256_read_small_file(int fd, uint8_t *buf, size_t size, Sha256ReadHook hook, void *hook_arg) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t r = read(fd, buf + got, size - got);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        got += r;
+        if (hook) hook((size_t)r, hook_arg);
+    }
+    return (ssize_t)got;
+}
+
+static int sha256_hash_fd(int fd, uint8_t *digest, Sha256ReadHook hook, void *hook_arg) {
+    SHA256_CTX ctx;
+    uint8_t buffer[SHA256_MB_SMALL_FILE];
+    ssize_t r;
+
+    sha256_init(&ctx);
+    while ((r = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (hook) hook((size_t)r, hook_arg);
+        sha256_update(&ctx, buffer, r);
+    }
+    sha256_final(&ctx, digest);
+    return 0;
+}
+
+int sha256_hash_files(const char *const *paths, size_t n, uint8_t digests[][SHA256_BLOCK_SIZE]) {
+    return sha256_hash_files_with(paths, n, digests, NULL, NULL);
+}
+
+int sha256_hash_files_with(const char *const *paths, size_t n, uint8_t digests[][SHA256_BLOCK_SIZE],
+                           Sha256ReadHook hook, void *hook_arg) {
+    uint8_t *arena = malloc(SHA256_MB_BATCH_BYTES);
+    const uint8_t **data = malloc(n * sizeof(*data));
+    size_t *len = malloc(n * sizeof(*len));
+    size_t *slot = malloc(n * sizeof(*slot));
+    uint8_t (*batch_digests)[SHA256_BLOCK_SIZE] = malloc(n * SHA256_BLOCK_SIZE);
+    int result = 0;
+
+    if (!arena || !data || !len || !slot || !batch_digests) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(arena); free(data); free(len); free(slot); free(batch_digests);
+        return -1;
+    }
+
+    size_t used = 0, batched = 0;
+    for (size_t i = 0; i <= n; i++) {
+        int fd = -1;
+        struct stat st;
+
+        if (i < n) {
+            fd = open(paths[i], O_RDONLY);
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                fprintf(stderr, "Failed to read %s: %s\n", paths[i], strerror(errno));
+                memset(digests[i], 0, SHA256_BLOCK_SIZE);
+                if (fd >= 0) close(fd);
+                result = -1;
+                continue;
+            }
+        }
+
+        // Hash the pending batch when it is full or at the end
+        int small = i < n && st.st_size <= SHA256_MB_SMALL_FILE;
+        if (batched > 0 && (i == n || (small && used + st.st_size > SHA256_MB_BATCH_BYTES))) {
+            sha256_hash_many(data, len, batched, batch_digests);
+            for (size_t j = 0; j < batched; j++) {
+                memcpy(digests[slot[j]], batch_digests[j], SHA256_BLOCK_SIZE);
+            }
+            used = 0;
+            batched = 0;
+        }
+        if (i == n) break;
+
+        if (small) {
+            ssize_t got = sha256_read_small_file(fd, arena + used, st.st_size, hook, hook_arg);
+            if (got < 0) {
+                fprintf(stderr, "Failed to read %s: %s\n", paths[i], strerror(errno));
+                memset(digests[i], 0, SHA256_BLOCK_SIZE);
+                result = -1;
+            } else {
+                data[batched] = arena + used;
+                len[batched] = got;
+                slot[batched] = i;
+                batched++;
+                used += got;
+            }
+        } else if (sha256_hash_fd(fd, digests[i], hook, hook_arg) != 0) {
+            fprintf(stderr, "Failed to read %s: %s\n", paths[i], strerror(errno));
+            memset(digests[i], 0, SHA256_BLOCK_SIZE);
+            result = -1;
+        }
+        close(fd);
+    }
+
+    free(arena);
+    free(data);
+    free(len);
+    free(slot);
+    free(batch_digests);
+    return result;
+}
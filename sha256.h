@@ -43,6 +43,29 @@ void sha256_transform(SHA256_CTX *ctx, const uint8_t *data);
 void sha256_hash(const uint8_t *data, size_t len, uint8_t *hash);
 char* sha256_hash_string(const uint8_t *data, size_t len);
 
+// Name of the transform kernel selected for this CPU ("c", "shani" or "armce")
+const char *sha256_impl_name(void);
+
+// Multi-buffer hashing of independent messages, several at once in SIMD
+// lanes (AVX2 or NEON) when the CPU has no SHA-256 instructions
+#define SHA256_MB_MAX_LANES 8
+void sha256_hash_many(const uint8_t *const *data, const size_t *len, size_t n,
+                      uint8_t digests[][SHA256_BLOCK_SIZE]);
+int sha256_hash_many_lanes(void);
+
+// Hash the contents of each file into digests[i]; small files are read
+// whole and batched through sha256_hash_many(). Returns -1 if any file
+// could not be read (its digest is zeroed).
+int sha256_hash_files(const char *const *paths, size_t n, uint8_t digests[][SHA256_BLOCK_SIZE]);
+
+// Told the size of each piece of a file as it is read
+typedef void (*Sha256ReadHook)(size_t bytes, void *arg);
+
+// sha256_hash_files, passing every read (at most 64 KiB) to hook, which
+// may be NULL; e.g. to pace the reads
+int sha256_hash_files_with(const char *const *paths, size_t n, uint8_t digests[][SHA256_BLOCK_SIZE],
+                           Sha256ReadHook hook, void *hook_arg);
+
 #define SHA256_DIGEST_STRING_LENGTH 65  /* 32 bytes * 2 + NULL */
 
 #endif /* SHA256_H */
\ No newline at end of file
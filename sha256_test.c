@@ -0,0 +1,129 @@
+// known-answer tests for the SHA-256 kernels, run once per QNIX_SHA256_IMPL setting
+#include "sha256.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MILLION_A 1000000
+
+typedef struct {
+    const char* name;
+    const uint8_t* data;
+    size_t len;
+    const char* digest;
+} Vector;
+
+static int failures;
+
+static void to_hex(const uint8_t digest[SHA256_BLOCK_SIZE], char hex[SHA256_DIGEST_STRING_LENGTH]) {
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static void check(const char* test, const Vector* v, const uint8_t digest[SHA256_BLOCK_SIZE]) {
+    char hex[SHA256_DIGEST_STRING_LENGTH];
+    to_hex(digest, hex);
+    if (strcmp(hex, v->digest) != 0) {
+        fprintf(stderr, "FAIL %s(%s): got %s, expected %s\n", test, v->name, hex, v->digest);
+        failures++;
+    }
+}
+
+// Feed the message in pieces of every size around the block boundary
+static void hash_in_pieces(const Vector* v, size_t piece, uint8_t digest[SHA256_BLOCK_SIZE]) {
+    SHA256_CTX ctx;
+    sha256_init(&ctx);
+    for (size_t off = 0; off < v->len; off += piece) {
+        sha256_update(&ctx, v->data + off, v->len - off < piece ? v->len - off : piece);
+    }
+    sha256_final(&ctx, digest);
+}
+
+// Write each message to a file and hash them together, as the store does
+static void hash_as_files(const Vector* vectors, size_t n) {
+    char (*paths)[32] = malloc(n * sizeof(*paths));
+    const char** names = malloc(n * sizeof(*names));
+    uint8_t (*digests)[SHA256_BLOCK_SIZE] = malloc(n * SHA256_BLOCK_SIZE);
+    if (!paths || !names || !digests) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    size_t made = 0;
+    for (; made < n; made++) {
+        snprintf(paths[made], sizeof(paths[made]), "/tmp/sha256-test.XXXXXX");
+        int fd = mkstemp(paths[made]);
+        if (fd < 0 || write(fd, vectors[made].data, vectors[made].len) != (ssize_t)vectors[made].len) {
+            fprintf(stderr, "FAIL sha256_hash_files: cannot write %s\n", paths[made]);
+            failures++;
+            if (fd >= 0) close(fd);
+            break;
+        }
+        close(fd);
+        names[made] = paths[made];
+    }
+    if (made == n) {
+        if (sha256_hash_files(names, n, digests) != 0) {
+            fprintf(stderr, "FAIL sha256_hash_files: read error\n");
+            failures++;
+        }
+        for (size_t i = 0; i < n; i++) check("sha256_hash_files", &vectors[i], digests[i]);
+    }
+    for (size_t i = 0; i < made; i++) unlink(paths[i]);
+    free(paths);
+    free(names);
+    free(digests);
+}
+
+int main(void) {
+    static uint8_t million_a[MILLION_A];
+    memset(million_a, 'a', sizeof(million_a));
+
+    // FIPS 180-2 appendix B and the NIST example messages
+    static const char m448[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    static const char m896[] = "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+                               "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+    const Vector vectors[] = {
+        { "empty", (const uint8_t*)"", 0,
+          "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+        { "abc", (const uint8_t*)"abc", 3,
+          "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+        { "448 bits", (const uint8_t*)m448, sizeof(m448) - 1,
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+        { "896 bits", (const uint8_t*)m896, sizeof(m896) - 1,
+          "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+        { "million a", million_a, MILLION_A,
+          "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+    };
+    const size_t count = sizeof(vectors) / sizeof(vectors[0]);
+    uint8_t digest[SHA256_BLOCK_SIZE];
+
+    for (size_t i = 0; i < count; i++) {
+        sha256_hash(vectors[i].data, vectors[i].len, digest);
+        check("sha256_hash", &vectors[i], digest);
+        static const size_t pieces[] = { 1, 55, 63, 64, 65, 4096 };
+        for (size_t p = 0; p < sizeof(pieces) / sizeof(pieces[0]); p++) {
+            hash_in_pieces(&vectors[i], pieces[p], digest);
+            check("sha256_update", &vectors[i], digest);
+        }
+    }
+
+    // Enough messages to fill every lane more than once, lengths mixed so
+    // lanes finish at different blocks
+    const size_t many = 2 * SHA256_MB_MAX_LANES + 1;
+    const uint8_t* data[2 * SHA256_MB_MAX_LANES + 1];
+    size_t len[2 * SHA256_MB_MAX_LANES + 1];
+    uint8_t digests[2 * SHA256_MB_MAX_LANES + 1][SHA256_BLOCK_SIZE];
+    for (size_t i = 0; i < many; i++) {
+        data[i] = vectors[(i * 3) % count].data;
+        len[i] = vectors[(i * 3) % count].len;
+    }
+    sha256_hash_many(data, len, many, digests);
+    for (size_t i = 0; i < many; i++) check("sha256_hash_many", &vectors[(i * 3) % count], digests[i]);
+
+    hash_as_files(vectors, count);
+
+    const char* want = getenv("QNIX_SHA256_IMPL");
+    printf("QNIX_SHA256_IMPL=%s: kernel %s, %d multi-buffer lane(s): %s\n", want ? want : "",
+           sha256_impl_name(), sha256_hash_many_lanes(), failures ? "FAILED" : "all known answers match");
+    return failures ? 1 : 0;
+}
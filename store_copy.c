@@ -0,0 +1,623 @@
+// copying files and trees into the store
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // copy_file_range
+#endif
+#include "store_copy.h"
+#include "nix_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/time.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+#define COPY_BUFFER_SIZE (64 * 1024)
+#define COPY_DIGESTS_MIN_CAPACITY 64
+
+// Source files with more than one link already copied in this tree, so
+// the other names become links to the same copy
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    char* path;  // Destination of the first copy
+} CopyLink;
+
+typedef struct {
+    CopyDigests* digests;
+    int ingest_mode;  // STORE_INGEST_*
+    mode_t seal_perms;  // How the store path is sealed afterwards,
+    int seal_flags;     // for STORE_INGEST_HARDLINK
+    CopyLink* links;
+    size_t link_count;
+    size_t link_capacity;
+    uint8_t* buffer;  // COPY_BUFFER_SIZE bytes for read/write copies
+} CopyContext;
+
+static uint64_t copy_path_key(const char* path) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+void copy_digests_init(CopyDigests* digests) {
+    digests->slots = NULL;
+    digests->capacity = 0;
+    digests->count = 0;
+}
+
+void copy_digests_free(CopyDigests* digests) {
+    for (size_t i = 0; i < digests->capacity; i++) {
+        free(digests->slots[i].path);
+    }
+    free(digests->slots);
+    copy_digests_init(digests);
+}
+
+static CopyDigestEntry* copy_digests_slot(CopyDigestEntry* slots, size_t capacity, const char* path) {
+    size_t i = copy_path_key(path) & (capacity - 1);
+    while (slots[i].path && strcmp(slots[i].path, path) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+// Record the digest of a copied file; kept at most half full
+static int copy_digests_add(CopyDigests* digests, const char* path, uint64_t size,
+                            const uint8_t digest[SHA256_BLOCK_SIZE]) {
+    if ((digests->count + 1) * 2 > digests->capacity) {
+        size_t capacity = digests->capacity ? digests->capacity * 2 : COPY_DIGESTS_MIN_CAPACITY;
+        CopyDigestEntry* slots = calloc(capacity, sizeof(CopyDigestEntry));
+        if (!slots) return -1;
+        for (size_t i = 0; i < digests->capacity; i++) {
+            if (digests->slots[i].path) {
+                *copy_digests_slot(slots, capacity, digests->slots[i].path) = digests->slots[i];
+            }
+        }
+        free(digests->slots);
+        digests->slots = slots;
+        digests->capacity = capacity;
+    }
+
+    CopyDigestEntry* slot = copy_digests_slot(digests->slots, digests->capacity, path);
+    if (!slot->path) {
+        if (!(slot->path = strdup(path))) return -1;
+        digests->count++;
+    }
+    slot->size = size;
+    memcpy(slot->digest, digest, SHA256_BLOCK_SIZE);
+    return 0;
+}
+
+int copy_digests_lookup(const char* path, const struct stat* st, uint8_t digest[SHA256_BLOCK_SIZE], void* arg) {
+    CopyDigests* digests = arg;
+    if (!digests || digests->count == 0) return -1;
+
+    CopyDigestEntry* slot = copy_digests_slot(digests->slots, digests->capacity, path);
+    if (!slot->path || slot->size != (uint64_t)st->st_size) return -1;
+    memcpy(digest, slot->digest, SHA256_BLOCK_SIZE);
+    return 0;
+}
+
+static int pwrite_all(int fd, const uint8_t* buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t w = pwrite(fd, buf, len, off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= w;
+        off += w;
+    }
+    return 0;
+}
+
+// Let the kernel move the data from in to out at off; len < 0 copies to
+// the end of the file. Returns the bytes copied, or -1 with nothing
+// copied when neither copy_file_range nor sendfile can handle the files.
+static off_t copy_data_kernel(int in, int out, off_t off, off_t len) {
+#if defined(__linux__)
+    off_t done = 0;
+    int use_sendfile = 0;
+    while (len < 0 || done < len) {
+        size_t chunk = (len < 0 || len - done > (1 << 30)) ? (1 << 30) : (size_t)(len - done);
+        off_t in_off = off + done;
+        ssize_t n;
+        if (!use_sendfile) {
+            off_t out_off = off + done;
+            n = copy_file_range(in, &in_off, out, &out_off, chunk, 0);
+            if (n < 0 && done == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                                      errno == EOPNOTSUPP || errno == EBADF)) {
+                use_sendfile = 1;
+                continue;
+            }
+        } else {
+            if (lseek(out, off + done, SEEK_SET) < 0) return done > 0 ? done : -1;
+            n = sendfile(out, in, &in_off, chunk);
+            if (n < 0 && done == 0 && (errno == ENOSYS || errno == EINVAL)) {
+                return -1;
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return done > 0 ? done : -2;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+#else
+    (void)in; (void)out; (void)off; (void)len;
+    return -1;
+#endif
+}
+
+// Copy len bytes (to the end of the file if len < 0) from in to out at
+// off. With a hash context the data passes through the buffer so it can
+// be hashed on the way; otherwise the kernel copies it where it can.
+static int copy_data(CopyContext* cc, int in, int out, off_t off, off_t len, SHA256_CTX* ctx,
+                     off_t* copied, const char* src, const char* dst) {
+    *copied = 0;
+    if (!ctx) {
+        off_t n = copy_data_kernel(in, out, off, len);
+        if (n == -2) {
+            fprintf(stderr, "Failed to copy %s to %s: %s\n", src, dst, strerror(errno));
+            return -1;
+        }
+        if (n >= 0) {
+            *copied = n;
+            if (len < 0 || n == len) return 0;
+            // Cut short: finish below
+            off += n;
+            if (len >= 0) len -= n;
+        }
+    }
+
+    while (len != 0) {
+        size_t want = (len < 0 || len > COPY_BUFFER_SIZE) ? COPY_BUFFER_SIZE : (size_t)len;
+        ssize_t r = pread(in, cc->buffer, want, off);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to read %s: %s\n", src, strerror(errno));
+            return -1;
+        }
+        if (r == 0) break;
+        if (ctx) sha256_update(ctx, cc->buffer, r);
+        if (pwrite_all(out, cc->buffer, r, off) != 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", dst, strerror(errno));
+            return -1;
+        }
+        off += r;
+        *copied += r;
+        if (len > 0) len -= r;
+    }
+    return 0;
+}
+
+// Copy a file's data. Files with fewer blocks than their size suggests
+// are copied segment by segment so holes stay holes.
+static int copy_file_data(CopyContext* cc, int in, int out, const struct stat* st, SHA256_CTX* ctx,
+                          uint64_t* total, const char* src, const char* dst) {
+    off_t copied;
+#ifdef SEEK_HOLE
+    if (st->st_size > 0 && (off_t)st->st_blocks * 512 < st->st_size) {
+        static const uint8_t zero[4096];
+        off_t pos = 0;
+        while (pos < st->st_size) {
+            off_t data = lseek(in, pos, SEEK_DATA);
+            if (data < 0 && errno == ENXIO) data = st->st_size;  // Only a hole is left
+            if (data < 0) break;  // Not supported here: plain copy of the rest
+            off_t hole = data < st->st_size ? lseek(in, data, SEEK_HOLE) : st->st_size;
+            if (hole < 0 || hole > st->st_size) hole = st->st_size;
+
+            for (off_t z = pos; ctx && z < data; z += sizeof(zero)) {
+                sha256_update(ctx, zero, (size_t)(data - z < (off_t)sizeof(zero) ? data - z : (off_t)sizeof(zero)));
+            }
+            if (hole > data && copy_data(cc, in, out, data, hole - data, ctx, &copied, src, dst) != 0) {
+                return -1;
+            }
+            pos = hole;
+        }
+        if (pos >= st->st_size) {
+            if (ftruncate(out, st->st_size) != 0) {
+                fprintf(stderr, "Failed to write %s: %s\n", dst, strerror(errno));
+                return -1;
+            }
+            *total = st->st_size;
+            return 0;
+        }
+        if (pos > 0) {
+            // SEEK_DATA stopped working part way; the hash would be off
+            fprintf(stderr, "Failed to read %s: %s\n", src, strerror(errno));
+            return -1;
+        }
+    }
+#endif
+    if (copy_data(cc, in, out, 0, -1, ctx, &copied, src, dst) != 0) return -1;
+    *total = copied;
+    return 0;
+}
+
+int store_ingest_mode_parse(const char* name) {
+    if (!name || strcmp(name, "copy") == 0) return STORE_INGEST_COPY;
+    if (strcmp(name, "reflink") == 0) return STORE_INGEST_REFLINK;
+    if (strcmp(name, "hardlink") == 0) return STORE_INGEST_HARDLINK;
+    return -1;
+}
+
+// Share the source's data blocks with out. Returns 0 if the filesystem
+// cloned the file.
+static int clone_file(int in, int out) {
+#if defined(__linux__)
+    return ioctl(out, FICLONE, in) == 0 ? 0 : -1;
+#else
+    (void)in; (void)out;
+    return -1;
+#endif
+}
+
+// Mode store_seal_tree gives a regular file that has mode: perms without
+// write bits, and without execute bits unless the file had some
+static mode_t sealed_file_mode(mode_t mode, mode_t perms) {
+    mode_t sealed = perms & 0777 & ~(mode_t)0222;
+    return (mode & 0111) ? sealed : sealed & ~(mode_t)0111;
+}
+
+// Hardlink mode: make dst another name for src. The store path is sealed
+// afterwards, which would chmod and touch the linked inode, and the
+// source could be edited later. So only files already in the store are
+// linked, and only if sealing leaves them as a copy with mode would be.
+// Returns 1 if linked, 0 to copy instead, -1 on error.
+static int link_file(CopyContext* cc, const char* src, const char* dst, mode_t mode) {
+    struct stat st;
+    char real[PATH_MAX];
+    if (stat(src, &st) != 0 || !S_ISREG(st.st_mode) || !realpath(src, real) ||
+        strncmp(real, NIX_STORE_PATH "/", strlen(NIX_STORE_PATH) + 1) != 0) {
+        return 0;
+    }
+    mode_t want = (cc->seal_flags & STORE_SEAL_READONLY) ? sealed_file_mode(mode, cc->seal_perms) : mode & 07777;
+    if ((st.st_mode & 07777) != want) return 0;
+    if ((cc->seal_flags & STORE_SEAL_MTIME) && st.st_mtime != STORE_SEAL_EPOCH) return 0;
+    if (link(src, dst) == 0) return 1;
+    if (errno == EEXIST && unlink(dst) == 0 && link(src, dst) == 0) return 1;
+    if (errno == EXDEV || errno == EPERM || errno == EMLINK || errno == ENOTSUP) return 0;
+    fprintf(stderr, "Failed to link %s to %s: %s\n", dst, src, strerror(errno));
+    return -1;
+}
+
+static int copy_file(CopyContext* cc, const char* src, const char* dst, const struct stat* st, mode_t mode) {
+    if (cc->ingest_mode == STORE_INGEST_HARDLINK) {
+        int linked = link_file(cc, src, dst, mode);
+        if (linked != 0) return linked > 0 ? 0 : -1;
+    }
+
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", src, strerror(errno));
+        return -1;
+    }
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, mode & 07777);
+    if (out < 0 && errno == EEXIST && unlink(dst) == 0) {
+        out = open(dst, O_WRONLY | O_CREAT | O_EXCL, mode & 07777);
+    }
+    if (out < 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", dst, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    struct stat in_st;
+    if (!st) {
+        if (fstat(in, &in_st) != 0) {
+            fprintf(stderr, "Failed to stat %s: %s\n", src, strerror(errno));
+            close(in);
+            close(out);
+            unlink(dst);
+            return -1;
+        }
+        st = &in_st;
+    }
+
+    // A clone costs no data I/O; the file is then hashed when the store
+    // path is, like any file without a recorded digest. Files hardlink
+    // mode could not link are cloned where possible too.
+    int cloned = cc->ingest_mode != STORE_INGEST_COPY && clone_file(in, out) == 0;
+
+    SHA256_CTX ctx;
+    uint64_t total = 0;
+    sha256_init(&ctx);
+    int ret = cloned ? 0 : copy_file_data(cc, in, out, st, cc->digests ? &ctx : NULL, &total, src, dst);
+    close(in);
+
+    // The mode given to open() is reduced by the umask
+    if (ret == 0 && fchmod(out, mode & 07777) != 0) {
+        fprintf(stderr, "Failed to set mode of %s: %s\n", dst, strerror(errno));
+        ret = -1;
+    }
+    if (close(out) != 0 && ret == 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", dst, strerror(errno));
+        ret = -1;
+    }
+    if (ret != 0) {
+        unlink(dst);
+        return -1;
+    }
+
+    if (cc->digests && !cloned) {
+        uint8_t digest[SHA256_BLOCK_SIZE];
+        sha256_final(&ctx, digest);
+        if (copy_digests_add(cc->digests, dst, total, digest) != 0) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int copy_context_init(CopyContext* cc, CopyDigests* digests, int ingest_mode,
+                             mode_t seal_perms, int seal_flags) {
+    memset(cc, 0, sizeof(*cc));
+    cc->digests = digests;
+    cc->ingest_mode = ingest_mode;
+    cc->seal_perms = seal_perms;
+    cc->seal_flags = seal_flags;
+    cc->buffer = malloc(COPY_BUFFER_SIZE);
+    if (!cc->buffer) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void copy_context_free(CopyContext* cc) {
+    for (size_t i = 0; i < cc->link_count; i++) free(cc->links[i].path);
+    free(cc->links);
+    free(cc->buffer);
+}
+
+int store_ingest_file(const char* src, const char* dst, mode_t mode, CopyDigests* digests, int ingest_mode,
+                      mode_t seal_perms, int seal_flags) {
+    CopyContext cc;
+    if (copy_context_init(&cc, digests, ingest_mode, seal_perms, seal_flags) != 0) return -1;
+    int ret = copy_file(&cc, src, dst, NULL, mode);
+    copy_context_free(&cc);
+    return ret;
+}
+
+// Link dst to an earlier copy of the same source inode. Returns 1 if it
+// did, 0 if this is the first name seen (now remembered), -1 on error.
+static int copy_hardlink(CopyContext* cc, const struct stat* st, const char* dst) {
+    for (size_t i = 0; i < cc->link_count; i++) {
+        if (cc->links[i].dev != st->st_dev || cc->links[i].ino != st->st_ino) continue;
+        if (link(cc->links[i].path, dst) != 0 && !(errno == EEXIST && unlink(dst) == 0 &&
+                                                  link(cc->links[i].path, dst) == 0)) {
+            fprintf(stderr, "Failed to link %s to %s: %s\n", dst, cc->links[i].path, strerror(errno));
+            return -1;
+        }
+        if (cc->digests) {
+            uint8_t digest[SHA256_BLOCK_SIZE];
+            if (copy_digests_lookup(cc->links[i].path, st, digest, cc->digests) == 0 &&
+                copy_digests_add(cc->digests, dst, (uint64_t)st->st_size, digest) != 0) {
+                fprintf(stderr, "Memory allocation failed\n");
+                return -1;
+            }
+        }
+        return 1;
+    }
+
+    if (cc->link_count == cc->link_capacity) {
+        size_t capacity = cc->link_capacity ? cc->link_capacity * 2 : 16;
+        CopyLink* links = realloc(cc->links, capacity * sizeof(CopyLink));
+        if (!links) return 0;  // Just copy it again
+        cc->links = links;
+        cc->link_capacity = capacity;
+    }
+    if ((cc->links[cc->link_count].path = strdup(dst)) != NULL) {
+        cc->links[cc->link_count].dev = st->st_dev;
+        cc->links[cc->link_count].ino = st->st_ino;
+        cc->link_count++;
+    }
+    return 0;
+}
+
+static int copy_tree(CopyContext* cc, const char* src, const char* dst) {
+    DIR* dir = opendir(src);
+    if (!dir) {
+        fprintf(stderr, "Failed to open directory %s: %s\n", src, strerror(errno));
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char src_path[PATH_MAX], dst_path[PATH_MAX];
+        if (snprintf(src_path, PATH_MAX, "%s/%s", src, entry->d_name) >= PATH_MAX ||
+            snprintf(dst_path, PATH_MAX, "%s/%s", dst, entry->d_name) >= PATH_MAX) {
+            fprintf(stderr, "Path too long: %s/%s\n", src, entry->d_name);
+            ret = -1;
+            continue;
+        }
+
+        struct stat st;
+        if (lstat(src_path, &st) != 0) {
+            fprintf(stderr, "Failed to stat %s: %s\n", src_path, strerror(errno));
+            ret = -1;
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            // Keep the directory writable until its contents are in place
+            struct stat dst_st;
+            if (mkdir(dst_path, (st.st_mode & 0777) | S_IRWXU) != 0 &&
+                !(errno == EEXIST && stat(dst_path, &dst_st) == 0 && S_ISDIR(dst_st.st_mode))) {
+                fprintf(stderr, "Failed to create directory %s: %s\n", dst_path, strerror(errno));
+                ret = -1;
+                continue;
+            }
+            if (copy_tree(cc, src_path, dst_path) != 0) ret = -1;
+            chmod(dst_path, st.st_mode & 07777);
+        } else if (S_ISREG(st.st_mode)) {
+            int linked = st.st_nlink > 1 ? copy_hardlink(cc, &st, dst_path) : 0;
+            if (linked < 0 || (linked == 0 && copy_file(cc, src_path, dst_path, &st, st.st_mode) != 0)) {
+                ret = -1;
+            }
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(src_path, target, sizeof(target) - 1);
+            if (len < 0) {
+                fprintf(stderr, "Failed to read symlink %s: %s\n", src_path, strerror(errno));
+                ret = -1;
+                continue;
+            }
+            target[len] = '\0';
+            if (symlink(target, dst_path) != 0 && !(errno == EEXIST && unlink(dst_path) == 0 &&
+                                                    symlink(target, dst_path) == 0)) {
+                fprintf(stderr, "Failed to create symlink %s: %s\n", dst_path, strerror(errno));
+                ret = -1;
+            }
+        } else {
+            fprintf(stderr, "Skipping %s: unsupported file type\n", src_path);
+            ret = -1;
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+int store_copy_file(const char* src, const char* dst, mode_t mode, CopyDigests* digests) {
+    return store_ingest_file(src, dst, mode, digests, STORE_INGEST_COPY, 0, 0);
+}
+
+int store_ingest_tree(const char* src, const char* dst, CopyDigests* digests, int ingest_mode,
+                      mode_t seal_perms, int seal_flags) {
+    CopyContext cc;
+    if (copy_context_init(&cc, digests, ingest_mode, seal_perms, seal_flags) != 0) return -1;
+    int ret = copy_tree(&cc, src, dst);
+    copy_context_free(&cc);
+    return ret;
+}
+
+int store_copy_tree(const char* src, const char* dst, CopyDigests* digests) {
+    return store_ingest_tree(src, dst, digests, STORE_INGEST_COPY, 0, 0);
+}
+
+int store_copy_dir(const char* src, const char* dst) {
+    struct stat st;
+    if (stat(src, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Not a directory: %s\n", src);
+        return -1;
+    }
+    if (mkdir(dst, (st.st_mode & 0777) | S_IRWXU) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create directory %s: %s\n", dst, strerror(errno));
+        return -1;
+    }
+    return store_copy_tree(src, dst, NULL);
+}
+
+int store_remove_tree(const char* path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        if (errno == ENOENT) return 0;
+        fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlink(path) != 0) {
+            fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    // Store directories are read-only; make this one writable to empty it
+    if ((st.st_mode & S_IRWXU) != S_IRWXU) {
+        chmod(path, st.st_mode | S_IRWXU);
+    }
+
+    DIR* dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Failed to open directory %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int ret = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[PATH_MAX];
+        if (snprintf(child, PATH_MAX, "%s/%s", path, entry->d_name) >= PATH_MAX) {
+            fprintf(stderr, "Path too long: %s/%s\n", path, entry->d_name);
+            ret = -1;
+            continue;
+        }
+        if (store_remove_tree(child) != 0) ret = -1;
+    }
+    closedir(dir);
+
+    if (ret == 0 && rmdir(path) != 0) {
+        fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
+
+// nftw() passes no argument to its callback
+static mode_t seal_perms;
+static int seal_flags;
+static int seal_failures;
+
+static int seal_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)ftw;
+    if (type == FTW_NS || type == FTW_DNR) {
+        fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+        seal_failures++;
+        return 0;
+    }
+
+    // Like chmod a-w,a+rX with the perms in place of a+rx: directories
+    // and executables get all of them, other files lose the x bits
+    if ((seal_flags & STORE_SEAL_READONLY) && !S_ISLNK(st->st_mode)) {
+        mode_t mode = S_ISREG(st->st_mode) ? sealed_file_mode(st->st_mode, seal_perms) : seal_perms;
+        if ((st->st_mode & 07777) != mode && chmod(path, mode) != 0) {
+            fprintf(stderr, "Failed to set mode of %s: %s\n", path, strerror(errno));
+            seal_failures++;
+        }
+    }
+
+    if (seal_flags & STORE_SEAL_MTIME) {
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = STORE_SEAL_EPOCH;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0) {
+            fprintf(stderr, "Failed to set times of %s: %s\n", path, strerror(errno));
+            seal_failures++;
+        }
+    }
+    return 0;
+}
+
+int store_seal_tree(const char* path, mode_t perms, int flags) {
+    seal_perms = perms & 0777 & ~(mode_t)0222;
+    seal_flags = flags;
+    seal_failures = 0;
+    // Depth first, so each directory is made read-only after its entries
+    if (nftw(path, seal_entry, 16, FTW_PHYS | FTW_DEPTH) != 0) {
+        fprintf(stderr, "Failed to walk %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return seal_failures ? -1 : 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * store_copy.h - Copying files and trees into the store
+ */
+#ifndef STORE_COPY_H
+#define STORE_COPY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "sha256.h"
+
+// Contents digests of the files written by a copy, keyed by destination
+// path, so the store path can be hashed without reading them back
+typedef struct {
+    char* path;
+    uint64_t size;
+    uint8_t digest[SHA256_BLOCK_SIZE];
+} CopyDigestEntry;
+
+typedef struct {
+    CopyDigestEntry* slots;  // Open addressing, capacity is a power of two
+    size_t capacity;
+    size_t count;
+} CopyDigests;
+
+void copy_digests_init(CopyDigests* digests);
+void copy_digests_free(CopyDigests* digests);
+
+// NarDigestLookup over a CopyDigests table (arg); a digest is only used
+// while the file still has the size it was copied with
+int copy_digests_lookup(const char* path, const struct stat* st, uint8_t digest[SHA256_BLOCK_SIZE], void* arg);
+
+// Copy one regular file to dst (replaced if it exists) with the given
+// mode, reading the source once. If digests is not NULL the contents are
+// hashed in the same pass and recorded under dst; otherwise the data is
+// moved by copy_file_range or sendfile where available. Holes in sparse
+// files are kept.
+int store_copy_file(const char* src, const char* dst, mode_t mode, CopyDigests* digests);
+
+// Copy the contents of directory src into the existing directory dst:
+// subdirectories, regular files (with their permission bits), symlinks
+// (as links) and hardlinks within the tree (as links). Like cp, existing
+// directories are merged into and existing files replaced. Every entry is
+// attempted; failures are reported per file and make the result -1.
+int store_copy_tree(const char* src, const char* dst, CopyDigests* digests);
+
+// How files are placed in the store (store.ingest_mode)
+#define STORE_INGEST_COPY 0      // Copy the data
+#define STORE_INGEST_REFLINK 1   // Share the data blocks (FICLONE); copy where unsupported
+#define STORE_INGEST_HARDLINK 2  // Link files that are already sealed in the store; reflink
+                                 // or copy the rest, so sources outside it are never shared
+
+// STORE_INGEST_* for "copy", "reflink" or "hardlink" (NULL: copy), -1 if unknown
+int store_ingest_mode_parse(const char* name);
+
+// store_copy_file and store_copy_tree with a choice of ingest mode.
+// seal_perms and seal_flags are what store_seal_tree is given afterwards;
+// a file is only hardlinked if sealing would leave its inode unchanged.
+int store_ingest_file(const char* src, const char* dst, mode_t mode, CopyDigests* digests, int ingest_mode,
+                      mode_t seal_perms, int seal_flags);
+int store_ingest_tree(const char* src, const char* dst, CopyDigests* digests, int ingest_mode,
+                      mode_t seal_perms, int seal_flags);
+
+// Copy directory src to dst, creating dst if needed (cp -rP src/. dst/)
+int store_copy_dir(const char* src, const char* dst);
+
+// Remove path and everything below it, making read-only directories
+// writable first (rm -rf); a missing path is not an error
+int store_remove_tree(const char* path);
+
+// What store_seal_tree changes
+#define STORE_SEAL_READONLY 1  // Permissions (store.enforce_readonly)
+#define STORE_SEAL_MTIME 2     // Times set to STORE_SEAL_EPOCH (store.normalize_mtime)
+#define STORE_SEAL_EPOCH 1     // As in Nix: 1970-01-01 00:00:01
+
+// Seal a store path after it is filled, in one walk without following
+// symlinks: directories and executable files get perms (write bits
+// removed), other files perms without the execute bits; symlinks keep
+// theirs. Every entry is attempted; returns -1 if any failed.
+int store_seal_tree(const char* path, mode_t perms, int flags);
+
+#endif
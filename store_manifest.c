@@ -0,0 +1,809 @@
+// per-file digests of store paths, for finding and repairing damaged files
+#include "store_manifest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "nix_store.h"
+#include "store_copy.h"
+#include "store_optimise.h"
+#include "hash_cache.h"
+#include "io_throttle.h"
+#include "qnix_config.h"
+
+#define MANIFEST_DIR NIX_STORE_PATH "/.nix-db/manifests"
+#define MANIFEST_MAGIC "qnix-manifest 1"
+#define MANIFEST_LINE (4 * PATH_MAX + 128)  // Escaping at most doubles path and target
+#define MANIFEST_BATCH 16                   // Files a worker hashes at a time
+#define MANIFEST_MAX_JOBS 64
+#define MANIFEST_THREAD_STACK (512 * 1024)  // A batch of PATH_MAX paths per worker
+
+// One line per node, fields separated by tabs; backslash, tab and newline
+// in names are escaped:
+//   d <path>
+//   f|x <size> <sha256> <path>     (x: executable)
+//   l <path> <target>
+// The first line is MANIFEST_MAGIC and the store path itself has path "".
+
+static int manifest_file(const char* store_path, char file[PATH_MAX]) {
+    char name_buf[PATH_MAX];
+    snprintf(name_buf, PATH_MAX, "%s", store_path);
+    const char* name = basename(name_buf);
+    if (!*name || strcmp(name, "/") == 0 || snprintf(file, PATH_MAX, "%s/%s", MANIFEST_DIR, name) >= PATH_MAX) {
+        fprintf(stderr, "Invalid store path: %s\n", store_path);
+        return -1;
+    }
+    return 0;
+}
+
+static void put_escaped(FILE* f, const char* s) {
+    for (; *s; s++) {
+        if (*s == '\\') fputs("\\\\", f);
+        else if (*s == '\t') fputs("\\t", f);
+        else if (*s == '\n') fputs("\\n", f);
+        else fputc(*s, f);
+    }
+}
+
+// Undo put_escaped in place; -1 on an invalid escape
+static int unescape(char* s) {
+    char* out = s;
+    for (; *s; s++) {
+        if (*s != '\\') {
+            *out++ = *s;
+            continue;
+        }
+        s++;
+        if (*s == '\\') *out++ = '\\';
+        else if (*s == 't') *out++ = '\t';
+        else if (*s == 'n') *out++ = '\n';
+        else return -1;
+    }
+    *out = '\0';
+    return 0;
+}
+
+int store_manifest_write(const char* store_path, const NarManifest* manifest) {
+    char file[PATH_MAX], tmp_path[PATH_MAX];
+    if (manifest_file(store_path, file) != 0) return -1;
+    if (mkdir(MANIFEST_DIR, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", MANIFEST_DIR, strerror(errno));
+        return -1;
+    }
+    if (snprintf(tmp_path, PATH_MAX, "%s.%ld.tmp", file, (long)getpid()) >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s\n", file);
+        return -1;
+    }
+    FILE* f = fopen(tmp_path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to write %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "%s\n", MANIFEST_MAGIC);
+    for (size_t i = 0; i < manifest->count; i++) {
+        const NarManifestEntry* e = &manifest->entries[i];
+        if (e->type == S_IFDIR) {
+            fputs("d\t", f);
+            put_escaped(f, e->path);
+        } else if (e->type == S_IFREG) {
+            fprintf(f, "%c\t%llu\t", e->executable ? 'x' : 'f', (unsigned long long)e->size);
+            for (int j = 0; j < SHA256_BLOCK_SIZE; j++) fprintf(f, "%02x", e->digest[j]);
+            fputc('\t', f);
+            put_escaped(f, e->path);
+        } else {
+            fputs("l\t", f);
+            put_escaped(f, e->path);
+            fputc('\t', f);
+            put_escaped(f, e->target ? e->target : "");
+        }
+        fputc('\n', f);
+    }
+
+    int ok = !ferror(f);
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp_path, file) != 0) {
+        fprintf(stderr, "Failed to write %s\n", file);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_digest(const char* hex, uint8_t digest[SHA256_BLOCK_SIZE]) {
+    if (strlen(hex) != SHA256_BLOCK_SIZE * 2) return -1;
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        digest[i] = (uint8_t)byte;
+    }
+    return 0;
+}
+
+// Parse one line (without its newline) into manifest
+static int parse_line(char* line, NarManifest* manifest) {
+    char* fields[4];
+    int n = 0;
+    fields[n++] = line;
+    for (char* p = line; *p; p++) {
+        if (*p != '\t') continue;
+        if (n == 4) return -1;
+        *p = '\0';
+        fields[n++] = p + 1;
+    }
+    if (strlen(fields[0]) != 1) return -1;
+
+    switch (fields[0][0]) {
+    case 'd':
+        if (n != 2 || unescape(fields[1]) != 0) return -1;
+        return nar_manifest_add(manifest, fields[1], S_IFDIR, 0, 0, NULL, NULL);
+    case 'f':
+    case 'x': {
+        uint8_t digest[SHA256_BLOCK_SIZE];
+        char* end;
+        if (n != 4 || parse_digest(fields[2], digest) != 0 || unescape(fields[3]) != 0) return -1;
+        unsigned long long size = strtoull(fields[1], &end, 10);
+        if (end == fields[1] || *end) return -1;
+        return nar_manifest_add(manifest, fields[3], S_IFREG, fields[0][0] == 'x', size, digest, NULL);
+    }
+    case 'l':
+        if (n != 3 || unescape(fields[1]) != 0 || unescape(fields[2]) != 0) return -1;
+        return nar_manifest_add(manifest, fields[1], S_IFLNK, 0, 0, NULL, fields[2]);
+    default:
+        return -1;
+    }
+}
+
+int store_manifest_load(const char* store_path, NarManifest* manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+    char file[PATH_MAX];
+    if (manifest_file(store_path, file) != 0) return -1;
+    FILE* f = fopen(file, "r");
+    if (!f) {
+        if (errno != ENOENT) fprintf(stderr, "Failed to open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    char* line = malloc(MANIFEST_LINE);
+    if (!line) {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(f);
+        return -1;
+    }
+    int ret = 0;
+    int first = 1;
+    while (ret == 0 && fgets(line, MANIFEST_LINE, f)) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
+            ret = -1;
+            break;
+        }
+        line[len - 1] = '\0';
+        if (first) {
+            if (strcmp(line, MANIFEST_MAGIC) != 0) ret = -1;
+            first = 0;
+        } else if (parse_line(line, manifest) != 0) {
+            ret = -1;
+        }
+    }
+    if (ferror(f) || first) ret = -1;
+    free(line);
+    fclose(f);
+
+    if (ret != 0) {
+        fprintf(stderr, "Warning: Manifest %s is damaged\n", file);
+        nar_manifest_free(manifest);
+    }
+    return ret;
+}
+
+void store_manifest_remove(const char* store_path) {
+    char file[PATH_MAX];
+    if (manifest_file(store_path, file) != 0) return;
+    if (unlink(file) != 0 && errno != ENOENT) {
+        fprintf(stderr, "Warning: Failed to remove %s: %s\n", file, strerror(errno));
+    }
+}
+
+// Whether path lies below dir (both relative; "" is the store path itself)
+static int is_below(const char* path, const char* dir) {
+    size_t len = strlen(dir);
+    if (len == 0) return *path != '\0';
+    return strncmp(path, dir, len) == 0 && path[len] == '/';
+}
+
+// Index just past the entries below entry i (they follow it directly)
+static size_t subtree_end(const NarManifest* manifest, size_t i) {
+    size_t end = i + 1;
+    if (manifest->entries[i].type != S_IFDIR) return end;
+    while (end < manifest->count && is_below(manifest->entries[end].path, manifest->entries[i].path)) end++;
+    return end;
+}
+
+static const char* display_path(const char* rel) {
+    return *rel ? rel : ".";
+}
+
+// What differs between two nodes at the same path, NULL if nothing
+static const char* node_problem(const NarManifestEntry* want, const NarManifestEntry* have) {
+    if (want->type != have->type) return "type changed";
+    if (want->type == S_IFREG) {
+        if (want->executable != have->executable) return "executable bit changed";
+        if (want->size != have->size) return "size changed";
+        if (memcmp(want->digest, have->digest, SHA256_BLOCK_SIZE) != 0) return "contents changed";
+    } else if (want->type == S_IFLNK) {
+        if (strcmp(want->target ? want->target : "", have->target ? have->target : "") != 0) {
+            return "symlink target changed";
+        }
+    }
+    return NULL;
+}
+
+size_t store_manifest_diff(const NarManifest* expected, const NarManifest* actual, const char* prefix) {
+    size_t lines = 0;
+    for (size_t i = 0; i < expected->count; i++) {
+        const NarManifestEntry* want = &expected->entries[i];
+        long j = nar_manifest_find(actual, want->path);
+        const char* problem = j < 0 ? "missing" : node_problem(want, &actual->entries[j]);
+        if (!problem) continue;
+        printf("%s%s: %s\n", prefix, display_path(want->path), problem);
+        lines++;
+        // Whatever was below a missing or replaced directory is gone too
+        if (want->type == S_IFDIR) i = subtree_end(expected, i) - 1;
+    }
+    for (size_t j = 0; j < actual->count; j++) {
+        if (nar_manifest_find(expected, actual->entries[j].path) >= 0) continue;
+        printf("%s%s: unexpected\n", prefix, display_path(actual->entries[j].path));
+        lines++;
+        if (actual->entries[j].type == S_IFDIR) j = subtree_end(actual, j) - 1;
+    }
+    return lines;
+}
+
+// A regular file whose contents are still to be checked
+typedef struct {
+    size_t entry;  // Index in the manifest
+    struct stat st;
+    uint8_t digest[SHA256_BLOCK_SIZE];
+    int read;      // Hashed now rather than taken from the cache
+    int failed;    // Could not be read
+} ManifestFile;
+
+// Files shared by the verify workers; lock guards next, stop and the counters
+typedef struct {
+    const char* root;
+    const NarManifest* manifest;
+    ManifestFile* files;
+    size_t count;
+    size_t next;
+    HashCache* cache;  // NULL: read every file
+    int fail_fast;
+    int stop;
+    size_t damaged;
+    size_t read;
+    pthread_mutex_t lock;
+} ManifestPool;
+
+// Full path of a manifest entry below root
+static int entry_path(const char* root, const char* rel, char full[PATH_MAX]) {
+    int len = *rel ? snprintf(full, PATH_MAX, "%s/%s", root, rel) : snprintf(full, PATH_MAX, "%s", root);
+    if (len >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s/%s\n", root, rel);
+        return -1;
+    }
+    return 0;
+}
+
+static void* manifest_worker(void* arg) {
+    ManifestPool* pool = arg;
+    HashCacheLookup lookup = { pool->cache, 0 };
+    char paths[MANIFEST_BATCH][PATH_MAX];
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->stop || pool->next == pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        size_t start = pool->next;
+        size_t n = pool->count - start < MANIFEST_BATCH ? pool->count - start : MANIFEST_BATCH;
+        pool->next += n;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Files the cache knows are not read; the rest are hashed together
+        const char* to_read[MANIFEST_BATCH];
+        ManifestFile* reading[MANIFEST_BATCH];
+        size_t k = 0;
+        for (size_t i = 0; i < n; i++) {
+            ManifestFile* f = &pool->files[start + i];
+            if (entry_path(pool->root, pool->manifest->entries[f->entry].path, paths[i]) != 0) {
+                f->failed = 1;
+                continue;
+            }
+            if (pool->cache && hash_cache_lookup(paths[i], &f->st, f->digest, &lookup) == 0) continue;
+            to_read[k] = paths[i];
+            reading[k++] = f;
+        }
+        if (k > 0) {
+            uint8_t digests[MANIFEST_BATCH][SHA256_BLOCK_SIZE];
+            static const uint8_t unread[SHA256_BLOCK_SIZE];
+            int batch_ok = sha256_hash_files_with(to_read, k, digests, io_throttle_read, NULL) == 0;
+            for (size_t i = 0; i < k; i++) {
+                // Files that could not be read are left with a zero digest
+                if (!batch_ok && memcmp(digests[i], unread, SHA256_BLOCK_SIZE) == 0) {
+                    reading[i]->failed = 1;
+                    continue;
+                }
+                memcpy(reading[i]->digest, digests[i], SHA256_BLOCK_SIZE);
+                reading[i]->read = 1;
+            }
+        }
+
+        size_t damaged = 0;
+        for (size_t i = 0; i < n; i++) {
+            ManifestFile* f = &pool->files[start + i];
+            if (f->failed || memcmp(f->digest, pool->manifest->entries[f->entry].digest, SHA256_BLOCK_SIZE) != 0) {
+                damaged++;
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->read += k;
+        pool->damaged += damaged;
+        if (damaged && pool->fail_fast) pool->stop = 1;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Hash the files on up to jobs threads, comparing them to the manifest
+static void check_contents(ManifestPool* pool, int jobs) {
+    if (pool->count == 0) return;
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    size_t batches = (pool->count + MANIFEST_BATCH - 1) / MANIFEST_BATCH;
+    if (jobs > MANIFEST_MAX_JOBS) jobs = MANIFEST_MAX_JOBS;
+    if ((size_t)jobs > batches) jobs = (int)batches;
+
+    // Pick the SHA-256 kernels before the workers share them
+    sha256_hash_many_lanes();
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_t threads[MANIFEST_MAX_JOBS];
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, MANIFEST_THREAD_STACK);
+    // This thread is one of the workers
+    int started = 0;
+    for (int i = 1; i < jobs; i++) {
+        if (pthread_create(&threads[started], &attr, manifest_worker, pool) == 0) started++;
+    }
+    pthread_attr_destroy(&attr);
+    manifest_worker(pool);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+// What is wrong with the type, mode or size of the regular file e at
+// full, or NULL if its contents are left to check
+static const char* file_problem(const NarManifestEntry* e, const char* full, struct stat* st) {
+    if (lstat(full, st) != 0) return errno == ENOENT ? "missing" : "unreadable";
+    if (!S_ISREG(st->st_mode)) return "type changed";
+    if (((st->st_mode & 0111) != 0) != e->executable) return "executable bit changed";
+    if ((uint64_t)st->st_size != e->size) return "size changed";
+    return NULL;
+}
+
+// Names in the directory at full that the manifest does not have
+static int find_unexpected(const NarManifest* manifest, const char* rel, const char* full,
+                           char*** extra, size_t* extra_count) {
+    DIR* dir = opendir(full);
+    if (!dir) return -1;
+    int ret = 0;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char child[PATH_MAX];
+        int len = *rel ? snprintf(child, PATH_MAX, "%s/%s", rel, de->d_name)
+                       : snprintf(child, PATH_MAX, "%s", de->d_name);
+        if (len >= PATH_MAX) {
+            fprintf(stderr, "Path too long: %s/%s\n", full, de->d_name);
+            ret = -1;
+            break;
+        }
+        if (nar_manifest_find(manifest, child) >= 0) continue;
+
+        char** grown = realloc(*extra, (*extra_count + 1) * sizeof(char*));
+        if (!grown || !(grown[*extra_count] = strdup(child))) {
+            if (grown) *extra = grown;
+            ret = -1;
+            break;
+        }
+        *extra = grown;
+        (*extra_count)++;
+    }
+    closedir(dir);
+    return ret;
+}
+
+// The store directory holding a path is read-only: it is made writable
+// for a change and its mode and times restored after
+typedef struct {
+    char dir[PATH_MAX];
+    struct stat st;
+} SealedParent;
+
+static int unseal_parent(const char* path, SealedParent* parent) {
+    char path_buf[PATH_MAX];
+    snprintf(path_buf, PATH_MAX, "%s", path);
+    snprintf(parent->dir, PATH_MAX, "%s", dirname(path_buf));
+    if (stat(parent->dir, &parent->st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", parent->dir, strerror(errno));
+        return -1;
+    }
+    if (!(parent->st.st_mode & S_IWUSR) && chmod(parent->dir, parent->st.st_mode | S_IWUSR) != 0) {
+        fprintf(stderr, "Failed to make %s writable: %s\n", parent->dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void reseal_parent(const SealedParent* parent) {
+    if (!(parent->st.st_mode & S_IWUSR)) chmod(parent->dir, parent->st.st_mode);
+    struct timespec times[2];
+    times[0].tv_sec = parent->st.st_atime;
+    times[1].tv_sec = parent->st.st_mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, parent->dir, times, 0);
+}
+
+// Mode a file of the store gets when it is sealed
+static mode_t sealed_file_mode(int executable) {
+    QnixConfig* cfg = config_get();
+    mode_t mode = cfg->store.enforce_readonly ? (cfg->store.store_path_permissions & 0555) : 0755;
+    return executable ? mode : (mode & ~0111);
+}
+
+// Write the file of entry e at full from an intact copy: the same file in
+// repair_from, the .links file with its digest, or the damaged file itself
+// if only its mode changed. The copy is checked against the digest before
+// it is renamed over full; old is the damaged file (NULL if missing).
+static int restore_file(const NarManifestEntry* e, const char* full, const char* repair_from,
+                        const struct stat* old) {
+    mode_t mode = sealed_file_mode(e->executable);
+    char candidates[4][PATH_MAX];
+    int n = 0;
+    if (repair_from && entry_path(repair_from, e->path, candidates[n]) == 0) n++;
+    store_link_path(e->digest, mode, candidates[n++]);
+    if (old && S_ISREG(old->st_mode) && (old->st_mode & 07777) != mode) {
+        store_link_path(e->digest, old->st_mode, candidates[n++]);
+    }
+    // With only its mode changed, the damaged file still has the data
+    if (old && S_ISREG(old->st_mode)) snprintf(candidates[n++], PATH_MAX, "%s", full);
+
+    char tmp_path[PATH_MAX];
+    char path_buf[PATH_MAX];
+    snprintf(path_buf, PATH_MAX, "%s", full);
+    if (snprintf(tmp_path, PATH_MAX, "%s/.repair-%ld", dirname(path_buf), (long)getpid()) >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s\n", full);
+        return -1;
+    }
+
+    const char* source = NULL;
+    for (int i = 0; i < n && !source; i++) {
+        struct stat st;
+        // Every candidate is checked against the digest as it is copied
+        if (lstat(candidates[i], &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != e->size) continue;
+
+        CopyDigests copied;
+        copy_digests_init(&copied);
+        uint8_t digest[SHA256_BLOCK_SIZE];
+        struct stat tmp_st;
+        if (store_copy_file(candidates[i], tmp_path, mode, &copied) == 0 && lstat(tmp_path, &tmp_st) == 0 &&
+            copy_digests_lookup(tmp_path, &tmp_st, digest, &copied) == 0 &&
+            memcmp(digest, e->digest, SHA256_BLOCK_SIZE) == 0) {
+            source = candidates[i];
+        } else {
+            unlink(tmp_path);
+        }
+        copy_digests_free(&copied);
+    }
+    if (!source) {
+        fprintf(stderr, "  %s: no intact copy found%s\n", display_path(e->path),
+                repair_from ? "" : " (pass --from <dir> with the original files)");
+        return -1;
+    }
+
+    // Replacing the name leaves the damaged data where it is; writing into
+    // it would change every store file it is shared with
+    if (rename(tmp_path, full) != 0) {
+        fprintf(stderr, "Failed to replace %s: %s\n", full, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    printf("  %s: restored from %s\n", display_path(e->path), source);
+
+    // The .links name of a damaged file shares its damage. The restored
+    // file takes its place, so no file is linked to the bad data and the
+    // other files that shared it can be repaired from the new one.
+    if (old && S_ISREG(old->st_mode) && old->st_nlink > 1) {
+        char link_path[PATH_MAX];
+        struct stat link_st;
+        store_link_path(e->digest, old->st_mode, link_path);
+        if (lstat(link_path, &link_st) == 0 && link_st.st_dev == old->st_dev && link_st.st_ino == old->st_ino) {
+            unlink(link_path);
+            store_link_path(e->digest, mode, link_path);
+            link(full, link_path);
+            if (old->st_nlink > 2) {
+                printf("  Warning: %lu other store files shared the damaged data; run --verify-all\n",
+                       (unsigned long)(old->st_nlink - 2));
+            }
+        }
+    }
+    return 0;
+}
+
+// Put the node of entry i back as the manifest has it
+static int restore_entry(const NarManifestEntry* e, const char* full, const char* repair_from) {
+    SealedParent parent;
+    if (unseal_parent(full, &parent) != 0) return -1;
+
+    struct stat old;
+    int exists = lstat(full, &old) == 0;
+    int ret = 0;
+    // Whatever has the wrong type goes; damaged files are replaced by rename
+    if (exists && (S_ISDIR(old.st_mode) || e->type != S_IFREG) &&
+        !(S_ISDIR(old.st_mode) && e->type == S_IFDIR)) {
+        ret = store_remove_tree(full);
+        exists = 0;
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "Failed to remove %s\n", full);
+    } else if (e->type == S_IFDIR) {
+        if (!exists && mkdir(full, 0755) != 0) {
+            fprintf(stderr, "Failed to create %s: %s\n", full, strerror(errno));
+            ret = -1;
+        } else if (!exists) {
+            printf("  %s: recreated\n", display_path(e->path));
+        }
+    } else if (e->type == S_IFLNK) {
+        if (symlink(e->target ? e->target : "", full) != 0) {
+            fprintf(stderr, "Failed to create %s: %s\n", full, strerror(errno));
+            ret = -1;
+        } else {
+            printf("  %s: recreated\n", display_path(e->path));
+        }
+    } else {
+        ret = restore_file(e, full, repair_from, exists ? &old : NULL);
+    }
+    reseal_parent(&parent);
+    return ret;
+}
+
+static int repair(const char* root, const NarManifest* manifest, const char** problems,
+                  char** extra, size_t extra_count, const char* repair_from) {
+    int ret = 0;
+    for (size_t i = 0; i < extra_count; i++) {
+        char full[PATH_MAX];
+        SealedParent parent;
+        if (entry_path(root, extra[i], full) != 0 || unseal_parent(full, &parent) != 0) {
+            ret = -1;
+            continue;
+        }
+        if (store_remove_tree(full) == 0) {
+            printf("  %s: removed\n", extra[i]);
+        } else {
+            fprintf(stderr, "Failed to remove %s\n", full);
+            ret = -1;
+        }
+        reseal_parent(&parent);
+    }
+
+    for (size_t i = 0; i < manifest->count; i++) {
+        if (!problems[i]) continue;
+        // A directory is rebuilt with everything below it
+        size_t end = subtree_end(manifest, i);
+        char full[PATH_MAX];
+        int restored = entry_path(root, manifest->entries[i].path, full) == 0 &&
+                       restore_entry(&manifest->entries[i], full, repair_from) == 0;
+        for (size_t j = i + 1; restored && j < end; j++) {
+            char child[PATH_MAX];
+            if (entry_path(root, manifest->entries[j].path, child) != 0 ||
+                restore_entry(&manifest->entries[j], child, repair_from) != 0) {
+                ret = -1;
+            }
+        }
+        if (!restored || make_store_path_read_only(full) != 0) ret = -1;
+        i = end - 1;
+    }
+    return ret;
+}
+
+int store_manifest_verify(const char* path, const char* expected_hash, int flags, int jobs,
+                          const char* repair_from) {
+    NarManifest manifest;
+    if (store_manifest_load(path, &manifest) != 0) return STORE_MANIFEST_UNUSABLE;
+    char manifest_hash[SHA256_DIGEST_STRING_LENGTH];
+    if (nar_manifest_hash(&manifest, manifest_hash) != 0 || strcmp(manifest_hash, expected_hash) != 0) {
+        fprintf(stderr, "Warning: Manifest of %s does not match its stored hash, ignoring it\n", path);
+        nar_manifest_free(&manifest);
+        return STORE_MANIFEST_UNUSABLE;
+    }
+
+    int fail_fast = (flags & STORE_VERIFY_FAIL_FAST) && !(flags & STORE_VERIFY_REPAIR);
+    const char** problems = calloc(manifest.count, sizeof(char*));
+    ManifestFile* files = malloc(manifest.count * sizeof(ManifestFile));
+    char** extra = NULL;
+    size_t extra_count = 0;
+    if (!problems || !files) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(problems);
+        free(files);
+        nar_manifest_free(&manifest);
+        return -1;
+    }
+
+    // Everything but file contents is checked with lstat, readlink and readdir
+    size_t file_count = 0, damaged = 0;
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < manifest.count && !(fail_fast && damaged); i++) {
+        const NarManifestEntry* e = &manifest.entries[i];
+        char full[PATH_MAX];
+        struct stat st;
+        if (entry_path(path, e->path, full) != 0) {
+            ret = -1;
+            break;
+        }
+        if (e->type == S_IFREG) {
+            if (!(problems[i] = file_problem(e, full, &st))) {
+                files[file_count].entry = i;
+                files[file_count].st = st;
+                files[file_count].read = files[file_count].failed = 0;
+                file_count++;
+            }
+        } else if (lstat(full, &st) != 0) {
+            problems[i] = errno == ENOENT ? "missing" : "unreadable";
+        } else if ((st.st_mode & S_IFMT) != e->type) {
+            problems[i] = "type changed";
+        } else if (e->type == S_IFLNK) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(full, target, sizeof(target) - 1);
+            if (len >= 0) target[len] = '\0';
+            if (len < 0 || strcmp(target, e->target ? e->target : "") != 0) problems[i] = "symlink target changed";
+        } else {
+            size_t before = extra_count;
+            if (find_unexpected(&manifest, e->path, full, &extra, &extra_count) != 0) {
+                problems[i] = "unreadable";
+            }
+            damaged += extra_count - before;
+        }
+        if (problems[i]) {
+            damaged++;
+            if (e->type == S_IFDIR) i = subtree_end(&manifest, i) - 1;
+        }
+    }
+
+    ManifestPool pool;
+    memset(&pool, 0, sizeof(pool));
+    HashCache cache;
+    hash_cache_load(&cache);
+    pool.root = path;
+    pool.manifest = &manifest;
+    pool.files = files;
+    pool.count = ret == 0 && !(fail_fast && damaged) ? file_count : 0;
+    pool.cache = (flags & STORE_VERIFY_DEEP) ? NULL : &cache;
+    pool.fail_fast = fail_fast;
+    check_contents(&pool, jobs);
+    damaged += pool.damaged;
+
+    // Files not reached after a fail-fast stop are left out
+    HashCachePending pending = {0};
+    size_t checked = pool.stop ? pool.next : pool.count;
+    for (size_t i = 0; i < checked; i++) {
+        ManifestFile* f = &files[i];
+        char full[PATH_MAX];
+        if (f->failed) {
+            problems[f->entry] = "unreadable";
+            continue;
+        }
+        if (memcmp(f->digest, manifest.entries[f->entry].digest, SHA256_BLOCK_SIZE) != 0) {
+            problems[f->entry] = "contents changed";
+        }
+        // A file's digest holds whether or not it is the one wanted
+        if (f->read && entry_path(path, manifest.entries[f->entry].path, full) == 0) {
+            hash_cache_record(full, &f->st, f->digest, &pending);
+        }
+    }
+    hash_cache_commit(&cache, &pending);
+    hash_cache_save(&cache, 0);
+    hash_cache_pending_free(&pending);
+    hash_cache_free(&cache);
+
+    for (size_t i = 0; i < manifest.count; i++) {
+        if (problems[i]) printf("  %s: %s\n", display_path(manifest.entries[i].path), problems[i]);
+    }
+    for (size_t i = 0; i < extra_count; i++) printf("  %s: unexpected\n", extra[i]);
+    printf("Checked %zu files against the manifest: %zu read, %zu unchanged since last verified\n",
+           checked, pool.read, checked - pool.read);
+    if (damaged > 0) {
+        printf("%zu damaged %s%s\n", damaged, damaged == 1 ? "entry" : "entries",
+               fail_fast ? " (stopped at the first)" : "");
+    }
+
+    int result = ret != 0 ? -1 : damaged ? STORE_MANIFEST_DAMAGED : STORE_MANIFEST_INTACT;
+    if (result == STORE_MANIFEST_DAMAGED && (flags & STORE_VERIFY_REPAIR)) {
+        printf("Repairing %s\n", path);
+        if (repair(path, &manifest, problems, extra, extra_count, repair_from) != 0) {
+            fprintf(stderr, "Some entries of %s could not be repaired\n", path);
+        }
+        printf("Checking %s again\n", path);
+        result = store_manifest_verify(path, expected_hash, flags & ~STORE_VERIFY_REPAIR, jobs, NULL);
+    }
+
+    for (size_t i = 0; i < extra_count; i++) free(extra[i]);
+    free(extra);
+    free(problems);
+    free(files);
+    nar_manifest_free(&manifest);
+    return result;
+}
+
+long store_manifest_check_files(const char* path, const NarManifest* manifest, const size_t* entries,
+                                size_t count, const char** problems) {
+    ManifestFile* files = malloc((count ? count : 1) * sizeof(ManifestFile));
+    if (!files) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    size_t file_count = 0;
+    long damaged = 0;
+    for (size_t i = 0; i < count; i++) {
+        const NarManifestEntry* e = &manifest->entries[entries[i]];
+        char full[PATH_MAX];
+        struct stat st;
+        if (e->type != S_IFREG) continue;
+        if (entry_path(path, e->path, full) != 0) {
+            free(files);
+            return -1;
+        }
+        if ((problems[entries[i]] = file_problem(e, full, &st))) {
+            damaged++;
+            continue;
+        }
+        files[file_count].entry = entries[i];
+        files[file_count].st = st;
+        files[file_count].read = files[file_count].failed = 0;
+        file_count++;
+    }
+
+    // Read on this thread only: callers check several paths at once
+    ManifestPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.root = path;
+    pool.manifest = manifest;
+    pool.files = files;
+    pool.count = file_count;
+    check_contents(&pool, 1);
+    for (size_t i = 0; i < file_count; i++) {
+        ManifestFile* f = &files[i];
+        if (f->failed) {
+            problems[f->entry] = "unreadable";
+        } else if (memcmp(f->digest, manifest->entries[f->entry].digest, SHA256_BLOCK_SIZE) != 0) {
+            problems[f->entry] = "contents changed";
+        } else {
+            continue;
+        }
+        damaged++;
+    }
+    free(files);
+    return damaged;
+}
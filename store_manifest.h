@@ -0,0 +1,53 @@
+/*
+ * store_manifest.h - Per-file digests of store paths, for finding and repairing damaged files
+ */
+#ifndef STORE_MANIFEST_H
+#define STORE_MANIFEST_H
+
+#include <stddef.h>
+#include "nar.h"
+
+// A store path's manifest lists every node with the data the canonical
+// hash covers (nar.h). It is kept in .nix-db/manifests/<store path name>
+// and only trusted while nar_manifest_hash() of it equals the path's
+// stored hash.
+
+// Write the manifest of store_path, replacing any earlier one
+int store_manifest_write(const char* store_path, const NarManifest* manifest);
+
+// Read the manifest of store_path; -1 if there is none or it is unreadable
+int store_manifest_load(const char* store_path, NarManifest* manifest);
+
+// Remove the manifest of store_path, if it has one
+void store_manifest_remove(const char* store_path);
+
+// Print how actual differs from expected, one "<prefix><path>: <problem>"
+// line per node; returns the number of lines
+size_t store_manifest_diff(const NarManifest* expected, const NarManifest* actual, const char* prefix);
+
+// Results of store_manifest_verify
+#define STORE_MANIFEST_INTACT 0
+#define STORE_MANIFEST_DAMAGED 1
+#define STORE_MANIFEST_UNUSABLE 2  // No manifest, or it does not match expected_hash
+
+// Check the store path at path node by node against its manifest, with
+// STORE_VERIFY_* flags (nix_store.h). Regular files are hashed on up to
+// jobs threads (<= 0: one per CPU), taking the digests of unchanged files
+// from the hash cache unless STORE_VERIFY_DEEP. Every damaged or
+// unexpected node is printed. With STORE_VERIFY_REPAIR they are then
+// restored: files from repair_from (a copy of the tree, may be NULL) or
+// from an identical file in .links, each written beside the damaged one
+// and renamed over it, so data shared through .links is never written to.
+// The path is checked again afterwards and that result returned; -1 on
+// errors other than damage.
+int store_manifest_verify(const char* path, const char* expected_hash, int flags, int jobs,
+                          const char* repair_from);
+
+// Check the regular files at the given manifest indices of the store path
+// at path, reading each one whatever the hash cache holds; other entries
+// are skipped. problems[index] is set for each damaged file. Returns the
+// number damaged, -1 on other errors.
+long store_manifest_check_files(const char* path, const NarManifest* manifest, const size_t* entries,
+                                size_t count, const char** problems);
+
+#endif
@@ -0,0 +1,368 @@
+// deduplicating identical store files through hardlinks
+#include "store_optimise.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include "nix_store.h"
+
+#define STORE_LINKS_DIR NIX_STORE_PATH "/.links"
+#define OPTIMISE_INDEX NIX_STORE_PATH "/.nix-db/optimised"
+#define OPTIMISE_INDEX_LINE (NAME_MAX + 32)
+
+typedef struct {
+    char* path;
+    off_t size;
+    uint8_t digest[SHA256_BLOCK_SIZE];
+} OptimiseFile;
+
+typedef struct {
+    OptimiseFile* files;
+    size_t count;
+    size_t capacity;
+} OptimiseFileList;
+
+static void free_file_list(OptimiseFileList* list) {
+    for (size_t i = 0; i < list->count; i++) free(list->files[i].path);
+    free(list->files);
+}
+
+// Regular files below dir; empty files are left alone, linking saves nothing
+static int collect_files(const char* dir, OptimiseFileList* list) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Failed to open directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    int ret = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char path[PATH_MAX];
+        if (snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name) >= PATH_MAX) {
+            fprintf(stderr, "Path too long: %s/%s\n", dir, entry->d_name);
+            ret = -1;
+            continue;
+        }
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+            ret = -1;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (collect_files(path, list) != 0) ret = -1;
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size == 0) continue;
+
+        if (list->count == list->capacity) {
+            size_t capacity = list->capacity ? list->capacity * 2 : 64;
+            OptimiseFile* files = realloc(list->files, capacity * sizeof(OptimiseFile));
+            if (!files) {
+                fprintf(stderr, "Memory allocation failed\n");
+                ret = -1;
+                break;
+            }
+            list->files = files;
+            list->capacity = capacity;
+        }
+        OptimiseFile* f = &list->files[list->count];
+        f->path = strdup(path);
+        if (!f->path) {
+            fprintf(stderr, "Memory allocation failed\n");
+            ret = -1;
+            break;
+        }
+        f->size = st.st_size;
+        list->count++;
+    }
+    closedir(d);
+    return ret;
+}
+
+// Fill in each file's digest, from known where possible
+static int hash_files(OptimiseFileList* list, CopyDigests* known) {
+    const char** pending = malloc((list->count ? list->count : 1) * sizeof(char*));
+    size_t* pending_index = malloc((list->count ? list->count : 1) * sizeof(size_t));
+    uint8_t (*digests)[SHA256_BLOCK_SIZE] = malloc((list->count ? list->count : 1) * SHA256_BLOCK_SIZE);
+    if (!pending || !pending_index || !digests) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(pending);
+        free(pending_index);
+        free(digests);
+        return -1;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        struct stat st;
+        st.st_size = list->files[i].size;
+        if (known && copy_digests_lookup(list->files[i].path, &st, list->files[i].digest, known) == 0) continue;
+        pending[n] = list->files[i].path;
+        pending_index[n++] = i;
+    }
+
+    // Unreadable files are left with an all-zero digest, and skipped
+    int ret = n > 0 ? sha256_hash_files(pending, n, digests) : 0;
+    for (size_t i = 0; i < n; i++) {
+        memcpy(list->files[pending_index[i]].digest, digests[i], SHA256_BLOCK_SIZE);
+    }
+    free(pending);
+    free(pending_index);
+    free(digests);
+    return ret;
+}
+
+static int digest_is_zero(const uint8_t digest[SHA256_BLOCK_SIZE]) {
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        if (digest[i]) return 0;
+    }
+    return 1;
+}
+
+// Replace path with a hardlink to target. The store directory holding it
+// is read-only, so it is made writable for the rename and restored after,
+// times included.
+static int replace_with_link(const char* target, const char* path) {
+    char parent[PATH_MAX];
+    snprintf(parent, PATH_MAX, "%s", path);
+    char* dir = dirname(parent);
+
+    struct stat dir_st;
+    if (stat(dir, &dir_st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    int writable = (dir_st.st_mode & S_IWUSR) != 0;
+    if (!writable && chmod(dir, dir_st.st_mode | S_IWUSR) != 0) {
+        fprintf(stderr, "Failed to make %s writable: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    char tmp[PATH_MAX];
+    int ret = 0;
+    if (snprintf(tmp, PATH_MAX, "%s/.optimise-%ld", dir, (long)getpid()) >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s\n", dir);
+        ret = -1;
+    } else if (link(target, tmp) != 0) {
+        // Too many links to target: keep the file as it is
+        if (errno == EMLINK) ret = 1;
+        else {
+            fprintf(stderr, "Failed to link %s: %s\n", target, strerror(errno));
+            ret = -1;
+        }
+    } else if (rename(tmp, path) != 0) {
+        fprintf(stderr, "Failed to replace %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        ret = -1;
+    }
+
+    if (!writable) chmod(dir, dir_st.st_mode);
+    struct timespec times[2];
+    times[0].tv_sec = dir_st.st_atime;
+    times[1].tv_sec = dir_st.st_mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, dir, times, 0);
+    return ret;
+}
+
+void store_link_path(const uint8_t digest[SHA256_BLOCK_SIZE], mode_t mode, char link_path[PATH_MAX]) {
+    int len = snprintf(link_path, PATH_MAX, "%s/", STORE_LINKS_DIR);
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        len += snprintf(link_path + len, PATH_MAX - len, "%02x", digest[i]);
+    }
+    snprintf(link_path + len, PATH_MAX - len, "-%03o", (unsigned)(mode & 07777));
+}
+
+static int optimise_file(const OptimiseFile* f, OptimiseStats* stats) {
+    struct stat st;
+    if (lstat(f->path, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+
+    char link_path[PATH_MAX];
+    store_link_path(f->digest, st.st_mode, link_path);
+
+    struct stat link_st;
+    if (lstat(link_path, &link_st) != 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Failed to stat %s: %s\n", link_path, strerror(errno));
+            return -1;
+        }
+        // First file with these contents: it becomes the link
+        if (link(f->path, link_path) == 0 || errno == EMLINK) return 0;
+        if (errno != EEXIST || lstat(link_path, &link_st) != 0) {
+            fprintf(stderr, "Failed to link %s: %s\n", f->path, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (link_st.st_dev == st.st_dev && link_st.st_ino == st.st_ino) return 0;
+    if (!S_ISREG(link_st.st_mode) || link_st.st_size != st.st_size) {
+        fprintf(stderr, "Warning: %s does not match %s, not linking\n", link_path, f->path);
+        return 0;
+    }
+
+    int ret = replace_with_link(link_path, f->path);
+    if (ret != 0) return ret < 0 ? -1 : 0;
+    stats->files_linked++;
+    // The data is only freed if this was its last name
+    if (st.st_nlink == 1) stats->bytes_saved += (uint64_t)st.st_size;
+    return 0;
+}
+
+static int append_index(const char* name, ino_t ino) {
+    FILE* f = fopen(OPTIMISE_INDEX, "a");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", OPTIMISE_INDEX, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "%s %llu\n", name, (unsigned long long)ino);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+int store_optimise_path(const char* path, CopyDigests* known, OptimiseStats* stats) {
+    struct stat st;
+    if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Not a store path directory: %s\n", path);
+        return -1;
+    }
+    if (mkdir(STORE_LINKS_DIR, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", STORE_LINKS_DIR, strerror(errno));
+        return -1;
+    }
+
+    OptimiseFileList list = { NULL, 0, 0 };
+    int ret = collect_files(path, &list);
+    if (hash_files(&list, known) != 0) ret = -1;
+    for (size_t i = 0; i < list.count; i++) {
+        if (digest_is_zero(list.files[i].digest)) continue;
+        if (optimise_file(&list.files[i], stats) != 0) ret = -1;
+    }
+    free_file_list(&list);
+    stats->paths_scanned++;
+
+    // Only complete passes are recorded, so failures are retried
+    if (ret == 0) {
+        char name_buf[PATH_MAX];
+        snprintf(name_buf, PATH_MAX, "%s", path);
+        ret = append_index(basename(name_buf), st.st_ino);
+    }
+    return ret;
+}
+
+static int compare_lines(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Index lines, sorted for bsearch
+static char** load_index(size_t* count) {
+    *count = 0;
+    size_t capacity = 0;
+    char** lines = NULL;
+    FILE* f = fopen(OPTIMISE_INDEX, "r");
+    if (!f) return NULL;
+
+    char line[OPTIMISE_INDEX_LINE];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!line[0]) continue;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            char** grown = realloc(lines, capacity * sizeof(char*));
+            if (!grown) break;
+            lines = grown;
+        }
+        if (!(lines[*count] = strdup(line))) break;
+        (*count)++;
+    }
+    fclose(f);
+    if (*count > 1) qsort(lines, *count, sizeof(char*), compare_lines);
+    return lines;
+}
+
+int store_optimise(OptimiseStats* stats) {
+    size_t index_count;
+    char** index = load_index(&index_count);
+
+    DIR* store_dir = opendir(NIX_STORE_PATH);
+    if (!store_dir) {
+        fprintf(stderr, "Failed to open store directory %s: %s\n", NIX_STORE_PATH, strerror(errno));
+        for (size_t i = 0; i < index_count; i++) free(index[i]);
+        free(index);
+        return -1;
+    }
+
+    // The rewritten index: every store path found, optimised now or before
+    char tmp_index[PATH_MAX];
+    snprintf(tmp_index, PATH_MAX, "%s.tmp", OPTIMISE_INDEX);
+    FILE* out = fopen(tmp_index, "w");
+    if (!out) fprintf(stderr, "Warning: Failed to create %s: %s\n", tmp_index, strerror(errno));
+
+    int ret = 0;
+    struct dirent* entry;
+    while ((entry = readdir(store_dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;  // ., .., .nix-db, .links
+
+        char path[PATH_MAX];
+        if (snprintf(path, PATH_MAX, "%s/%s", NIX_STORE_PATH, entry->d_name) >= PATH_MAX) continue;
+        struct stat st;
+        if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+
+        char line[OPTIMISE_INDEX_LINE];
+        snprintf(line, sizeof(line), "%s %llu", entry->d_name, (unsigned long long)st.st_ino);
+        char* key = line;
+        if (index && bsearch(&key, index, index_count, sizeof(char*), compare_lines)) {
+            stats->paths_skipped++;
+        } else {
+            printf("Optimising %s\n", path);
+            if (store_optimise_path(path, NULL, stats) != 0) {
+                ret = -1;
+                continue;
+            }
+        }
+        if (out) fprintf(out, "%s\n", line);
+    }
+    closedir(store_dir);
+
+    for (size_t i = 0; i < index_count; i++) free(index[i]);
+    free(index);
+
+    if (out) {
+        if (fclose(out) != 0 || rename(tmp_index, OPTIMISE_INDEX) != 0) {
+            fprintf(stderr, "Warning: Failed to update %s: %s\n", OPTIMISE_INDEX, strerror(errno));
+            unlink(tmp_index);
+        }
+    }
+    return ret;
+}
+
+int store_optimise_prune_links(uint64_t* links_removed, uint64_t* bytes_freed) {
+    *links_removed = 0;
+    *bytes_freed = 0;
+    DIR* dir = opendir(STORE_LINKS_DIR);
+    if (!dir) return errno == ENOENT ? 0 : -1;
+
+    int ret = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char path[PATH_MAX];
+        if (snprintf(path, PATH_MAX, "%s/%s", STORE_LINKS_DIR, entry->d_name) >= PATH_MAX) continue;
+        struct stat st;
+        if (lstat(path, &st) != 0 || st.st_nlink != 1) continue;
+        if (unlink(path) != 0) {
+            fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+            ret = -1;
+            continue;
+        }
+        (*links_removed)++;
+        *bytes_freed += (uint64_t)st.st_size;
+    }
+    closedir(dir);
+    return ret;
+}
@@ -0,0 +1,36 @@
+/*
+ * store_optimise.h - Deduplicating identical store files through hardlinks
+ */
+#ifndef STORE_OPTIMISE_H
+#define STORE_OPTIMISE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include "store_copy.h"
+
+typedef struct {
+    uint64_t paths_scanned;
+    uint64_t paths_skipped;  // Recorded by an earlier run
+    uint64_t files_linked;   // Replaced by a link to an identical file
+    uint64_t bytes_saved;    // Data of linked files no longer stored twice
+} OptimiseStats;
+
+// Link the regular files of one store path into the store's .links
+// directory, where each distinct file has one name, <contents
+// sha256>-<octal mode>; files with the same contents and mode become
+// hardlinks to it. Contents digests are taken from known (may be NULL)
+// where it has them and the rest are hashed. The path is then recorded in
+// .nix-db/optimised, so later runs skip it. Stats are added to.
+int store_optimise_path(const char* path, CopyDigests* known, OptimiseStats* stats);
+
+// Optimise every store path not yet recorded (or re-created since), then
+// rewrite the record with the paths that still exist
+int store_optimise(OptimiseStats* stats);
+
+// Name in .links of the files with these contents and permission bits
+void store_link_path(const uint8_t digest[SHA256_BLOCK_SIZE], mode_t mode, char link_path[PATH_MAX]);
+
+// Remove links no store file shares any more (after garbage collection)
+int store_optimise_prune_links(uint64_t* links_removed, uint64_t* bytes_freed);
+
+#endif
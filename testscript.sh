@@ -38,4 +38,132 @@ if [ -d "$HELLO_PATH" ]; then
     echo "Hello package still exists after GC, as expected"
 else
     echo "ERROR: Hello package was removed by GC"
-fi
\ No newline at end of file
+fi
+
+# Ingest modes: reflink shares data blocks on btrfs/xfs and copies
+# elsewhere; hardlink only links files already sealed in the store. The
+# source must come out of every mode unchanged.
+mkdir -p ingest-pkg
+head -c 1048576 /dev/urandom > ingest-pkg/data
+chmod 644 ingest-pkg/data
+SOURCE_BEFORE=$(ls -li ingest-pkg/data)
+for MODE in copy reflink hardlink; do
+    ./nix-store --add-recursively ingest-pkg ingest-$MODE --ingest-mode $MODE > /dev/null
+    INGEST_PATH=$(find /data/nix/store -maxdepth 1 -name "*-ingest-$MODE" -type d)
+    if cmp -s ingest-pkg/data "$INGEST_PATH/data" && ./nix-store --verify "$INGEST_PATH" > /dev/null; then
+        echo "Ingest mode $MODE: store path matches its source"
+    else
+        echo "ERROR: Ingest mode $MODE produced a wrong store path"
+    fi
+done
+if [ "$(ls -li ingest-pkg/data)" = "$SOURCE_BEFORE" ]; then
+    echo "Source file unchanged by ingestion, as expected"
+else
+    echo "ERROR: Ingestion changed the source file"
+fi
+if command -v filefrag > /dev/null; then
+    REFLINK_PATH=$(find /data/nix/store -maxdepth 1 -name "*-ingest-reflink" -type d)
+    if filefrag -v "$REFLINK_PATH/data" | grep -q shared; then
+        echo "Reflink ingest shared data blocks with the source"
+    else
+        echo "Reflink ingest fell back to a copy (filesystem without FICLONE)"
+    fi
+fi
+
+# Adding a store path again links its sealed files instead of copying them
+./nix-store --add-recursively "$INGEST_PATH" ingest-relink --ingest-mode hardlink > /dev/null
+RELINK_PATH=$(find /data/nix/store -maxdepth 1 -name "*-ingest-relink" -type d)
+if [ "$(ls -l "$RELINK_PATH/data" | awk '{print $2}')" -gt 1 ]; then
+    echo "Hardlink ingest linked files from the store"
+else
+    echo "ERROR: Hardlink ingest copied a file that was already sealed in the store"
+fi
+
+# A library and an application that depends on it
+mkdir -p lib-pkg/lib app-pkg/bin
+echo "library code" > lib-pkg/lib/libdemo.so
+echo "more library code" > lib-pkg/lib/libextra.so
+cp hello-pkg/bin/hello app-pkg/bin/app
+./nix-store --add-recursively lib-pkg demo-lib > /dev/null
+LIB_PATH=$(find /data/nix/store -maxdepth 1 -name "*-demo-lib" -type d)
+./nix-store --add-with-explicit-deps app-pkg demo-app "$LIB_PATH" > /dev/null
+APP_PATH=$(find /data/nix/store -maxdepth 1 -name "*-demo-app" -type d)
+if ./nix-store --query-referrers "$LIB_PATH" | grep -q "$APP_PATH"; then
+    echo "Referrers of the library include the application"
+else
+    echo "ERROR: --query-referrers does not list the application"
+fi
+if ./nix-store --query-referrers-closure "$LIB_PATH" | grep -q "$APP_PATH"; then
+    echo "Referrer closure of the library includes the application"
+else
+    echo "ERROR: --query-referrers-closure does not list the application"
+fi
+
+# Verification options, including background pacing
+for OPTS in "" "--deep" "--fail-fast --jobs 2" "--deep --io-limit 4 --low-priority"; do
+    if ./nix-store --verify "$LIB_PATH" $OPTS > /dev/null; then
+        echo "Verify${OPTS:+ $OPTS}: library intact"
+    else
+        echo "ERROR: Verify${OPTS:+ $OPTS} failed on an intact path"
+    fi
+done
+
+# Damage a file, find it and repair it from the original package
+chmod u+w "$LIB_PATH/lib/libdemo.so"
+echo "corrupted" >> "$LIB_PATH/lib/libdemo.so"
+if ./nix-store --verify "$LIB_PATH" > /dev/null 2>&1; then
+    echo "ERROR: Verify missed a damaged file"
+else
+    echo "Verify found the damaged file, as expected"
+fi
+./nix-store --verify "$LIB_PATH" --repair --from lib-pkg > /dev/null
+if cmp -s lib-pkg/lib/libdemo.so "$LIB_PATH/lib/libdemo.so" && ./nix-store --verify "$LIB_PATH" --deep > /dev/null; then
+    echo "Repair restored the damaged file"
+else
+    echo "ERROR: Repair did not restore the damaged file"
+fi
+
+# Canonical serialization
+./nix-store --dump "$LIB_PATH" demo-lib.nar > /dev/null
+./nix-store --dump "$LIB_PATH" demo-lib-again.nar > /dev/null
+if grep -q qnix-archive-1 demo-lib.nar && cmp -s demo-lib.nar demo-lib-again.nar; then
+    echo "Dump is a stable canonical archive"
+else
+    echo "ERROR: --dump output is missing or not reproducible"
+fi
+
+# Whole-store verification: parallel, deep, sampled and resumed
+for OPTS in "--jobs 2" "--deep" "--sample 50 --seed 1" "--sample 50 --sample-paths --seed 1" "--resume" "--io-limit 4 --low-priority"; do
+    if ./nix-store --verify-all $OPTS > /dev/null; then
+        echo "Verify-all $OPTS: store intact"
+    else
+        echo "ERROR: Verify-all $OPTS failed on an intact store"
+    fi
+done
+
+# Deduplication links the identical files of the ingest test paths
+if ./nix-store --optimise | grep -q "linked [1-9]"; then
+    echo "Optimise linked identical files"
+else
+    echo "ERROR: Optimise did not link identical files"
+fi
+if ./nix-store --verify-all --deep > /dev/null; then
+    echo "Store still verifies after optimise"
+else
+    echo "ERROR: Store does not verify after optimise"
+fi
+
+# Content-addressed store paths: adding unchanged contents again reuses the path
+mkdir -p ca-test
+sed 's/^store.content_addressed = .*/store.content_addressed = true/' nix.conf > ca-test/nix.conf
+(cd ca-test && ../nix-store --add-recursively ../lib-pkg ca-lib > /dev/null)
+if (cd ca-test && ../nix-store --add-recursively ../lib-pkg ca-lib) | grep -q "already exists"; then
+    echo "Content-addressed add reused the existing path"
+else
+    echo "ERROR: Content-addressed add copied unchanged contents again"
+fi
+if [ "$(find /data/nix/store -maxdepth 1 -name "*-ca-lib" -type d | wc -l)" -eq 1 ]; then
+    echo "Content-addressed add produced a single path"
+else
+    echo "ERROR: Content-addressed add produced more than one path"
+fi